@@ -23,6 +23,8 @@
 #include <dlfcn.h>
 #include <stddef.h>
 
+#include "linker_trace.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -44,8 +46,11 @@ struct CameraBridge
         return "/system/lib/libcamera_compat_layer.so";
     }
     
-    CameraBridge() : libcamera_handle(android_dlopen(path_to_library(), RTLD_LAZY))
+    CameraBridge() : libcamera_handle(NULL)
     {
+        hybris_trace_begin("bridge", "CameraBridge", path_to_library());
+        libcamera_handle = android_dlopen(path_to_library(), RTLD_LAZY);
+        hybris_trace_end("bridge", "CameraBridge");
         assert(libcamera_handle && "Error loading camera library from");
     }
 
@@ -26,26 +26,27 @@
 #include <strings.h>
 #include <dlfcn.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <signal.h>
 #include <errno.h>
 #include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/xattr.h>
 #include <grp.h>
+#include <linux/futex.h>
 
 #include <netdb.h>
 
 /* TODO:
 *  - Check if the int arguments at attr_set/get match the ones at Android
 *  - Check how to deal with memory leaks (specially with static initializers)
-*  - Check for shared rwlock
 */
 
-/* Base address to check for Android specifics */
-#define ANDROID_TOP_ADDR_VALUE_MUTEX  0xFFFF
-#define ANDROID_TOP_ADDR_VALUE_COND   0xFFFF
-#define ANDROID_TOP_ADDR_VALUE_RWLOCK 0xFFFF
-
 #define ANDROID_MUTEX_SHARED_MASK      0x2000
 #define ANDROID_COND_SHARED_MASK       0x0001
 #define ANDROID_RWLOCKATTR_SHARED_MASK 0x0010
@@ -72,68 +73,64 @@ struct _hook {
     void *func;
 };
 
-/* Helpers */
-static int hybris_check_android_shared_mutex(int mutex_addr)
-{
-    /* If not initialized or initialized by Android, it should contain a low
-     * address, which is basically just the int values for Android's own
-     * pthread_mutex_t */
-    if ((mutex_addr <= ANDROID_TOP_ADDR_VALUE_MUTEX) &&
-                    (mutex_addr & ANDROID_MUTEX_SHARED_MASK))
-        return 1;
+/*
+ * Futexes, for the locks that keep their state in the bionic object itself
+ *
+ * */
 
-    return 0;
-}
+static __thread int hybris_tid;
 
-static int hybris_check_android_shared_cond(int cond_addr)
+static inline int hybris_gettid(void)
 {
-    /* If not initialized or initialized by Android, it should contain a low
-     * address, which is basically just the int values for Android's own
-     * pthread_cond_t */
-    if ((cond_addr <= ANDROID_TOP_ADDR_VALUE_COND) &&
-                    (cond_addr & ANDROID_COND_SHARED_MASK))
-        return 1;
-
-    return 0;
+    if (hybris_tid == 0)
+        hybris_tid = syscall(SYS_gettid);
+    return hybris_tid;
 }
 
-static void hybris_set_mutex_attr(int android_value, pthread_mutexattr_t *attr)
+/* The child of fork() is a new thread, with the TLS of the one that forked */
+static void hybris_reset_tid(void)
 {
-    /* Init already sets as PTHREAD_MUTEX_NORMAL */
-    pthread_mutexattr_init(attr);
-
-    if (android_value & ANDROID_PTHREAD_RECURSIVE_MUTEX_INITIALIZER) {
-        pthread_mutexattr_settype(attr, PTHREAD_MUTEX_RECURSIVE);
-    } else if (android_value & ANDROID_PTHREAD_ERRORCHECK_MUTEX_INITIALIZER) {
-        pthread_mutexattr_settype(attr, PTHREAD_MUTEX_ERRORCHECK);
-    }
+    hybris_tid = 0;
 }
 
-static pthread_mutex_t* hybris_alloc_init_mutex(int android_mutex)
+/* Sleeps while *addr is val. Returns 0, or -ETIMEDOUT once clock, either
+ * CLOCK_MONOTONIC or CLOCK_REALTIME, has reached abstime. The kernel
+ * tracks the deadline on that clock itself, so a waiter neither wakes
+ * early nor oversleeps when the clocks drift apart or the time is set.
+ * Spurious wakeups are possible. */
+static int hybris_futex_wait(volatile int *addr, int val, int shared,
+                             const struct timespec *abstime, clockid_t clock)
 {
-    pthread_mutex_t *realmutex = malloc(sizeof(pthread_mutex_t));
-    pthread_mutexattr_t attr;
-    hybris_set_mutex_attr(android_mutex, &attr);
-    pthread_mutex_init(realmutex, &attr);
-    return realmutex;
+    int op = FUTEX_WAIT_BITSET;
+    int saved_errno = errno;
+    int ret = 0;
+
+    if (!shared)
+        op |= FUTEX_PRIVATE_FLAG;
+    if (abstime != NULL && clock == CLOCK_REALTIME)
+        op |= FUTEX_CLOCK_REALTIME;
+
+    if (syscall(SYS_futex, addr, op, val, abstime, NULL,
+                FUTEX_BITSET_MATCH_ANY) < 0 && errno == ETIMEDOUT)
+        ret = -ETIMEDOUT;
+    errno = saved_errno;
+    return ret;
 }
 
-static pthread_cond_t* hybris_alloc_init_cond(void)
+/* Checks the deadline of a timed lock or wait up front, so that it is
+ * rejected whether or not the call would have had to wait */
+static inline int hybris_timespec_valid(const struct timespec *ts)
 {
-    pthread_cond_t *realcond = malloc(sizeof(pthread_cond_t));
-    pthread_condattr_t attr;
-    pthread_condattr_init(&attr);
-    pthread_cond_init(realcond, &attr);
-    return realcond;
+    return ts->tv_nsec >= 0 && ts->tv_nsec < 1000000000;
 }
 
-static pthread_rwlock_t* hybris_alloc_init_rwlock(void)
+static void hybris_futex_wake(volatile int *addr, int count, int shared)
 {
-    pthread_rwlock_t *realrwlock = malloc(sizeof(pthread_rwlock_t));
-    pthread_rwlockattr_t attr;
-    pthread_rwlockattr_init(&attr);
-    pthread_rwlock_init(realrwlock, &attr);
-    return realrwlock;
+    int saved_errno = errno;
+
+    syscall(SYS_futex, addr, shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE,
+            count);
+    errno = saved_errno;
 }
 
 /*
@@ -333,6 +330,240 @@ static int my_pthread_getattr_np(pthread_t thid, pthread_attr_t *__attr)
     return pthread_getattr_np(thid, realattr);
 }
 
+/*
+ * Lock profiling
+ *
+ * With HYBRIS_LOCK_PROFILE set, the mutex, rwlock and cond shims record for
+ * each lock address how often it was taken, how often that meant waiting
+ * and for how long, and the return address of the first caller. A cond
+ * has no owner to contend with: acquired counts its waits, and the wait
+ * time is the time spent waiting, timeouts included. The report, sorted
+ * by total wait, names the library of that caller. It goes to stderr, or
+ * to the file HYBRIS_LOCK_PROFILE names if that isn't "1", at exit and on
+ * SIGUSR2, unless the program already handles or ignores that signal by
+ * the time the profile starts. Naming a library takes the dl lock, as do
+ * malloc() and stdio
+ * their own locks, so the signal handler only wakes lockprof_thread,
+ * which holds no other lock while it writes the report. When the
+ * variable is unset, the shims only test lockprof_enabled.
+ *
+ * */
+
+#define unlikely(expr) __builtin_expect(!!(expr), 0)
+
+#define LOCKPROF_SLOTS      4096        /* a power of two */
+#define LOCKPROF_SIGNAL     SIGUSR2
+
+enum { LOCKPROF_MUTEX, LOCKPROF_RWLOCK, LOCKPROF_COND };
+
+static const char *lockprof_kinds[] = {
+    [LOCKPROF_MUTEX] = "mutex",
+    [LOCKPROF_RWLOCK] = "rwlock",
+    [LOCKPROF_COND] = "cond",
+};
+
+struct lockprof_slot {
+    void *lock;
+    void *caller;
+    int kind;
+    unsigned acquired;
+    unsigned contended;
+    unsigned long long wait_ns;
+    unsigned long long max_ns;
+};
+
+typedef int (*lockprof_trylock_fn)(void *lock);
+typedef int (*lockprof_lock_fn)(void *lock, const struct timespec *abstime);
+
+/* From the linker, which looks addr up with find_containing_library() */
+extern int android_dladdr(const void *addr, Dl_info *info);
+
+static int lockprof_enabled;
+static struct lockprof_slot *lockprof_slots;
+static unsigned lockprof_dropped;       /* locks that didn't fit */
+static sem_t lockprof_wakeup;
+static const char *lockprof_output;
+
+static inline unsigned long long lockprof_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int lockprof_compare(const void *a, const void *b)
+{
+    const struct lockprof_slot *sa = a, *sb = b;
+
+    if (sa->wait_ns != sb->wait_ns)
+        return sa->wait_ns < sb->wait_ns ? 1 : -1;
+    if (sa->contended != sb->contended)
+        return sa->contended < sb->contended ? 1 : -1;
+    return sa->acquired < sb->acquired ? 1 : sa->acquired > sb->acquired;
+}
+
+static void lockprof_dump(void)
+{
+    struct lockprof_slot *sorted;
+    const char *library;
+    char contended[16];
+    FILE *out = stderr;
+    Dl_info info;
+    unsigned i, n = 0;
+
+    sorted = malloc(LOCKPROF_SLOTS * sizeof(*sorted));
+    if (sorted == NULL)
+        return;
+    for (i = 0; i < LOCKPROF_SLOTS; i++) {
+        if (lockprof_slots[i].lock != NULL)
+            sorted[n++] = lockprof_slots[i];
+    }
+    qsort(sorted, n, sizeof(*sorted), lockprof_compare);
+
+    if (lockprof_output != NULL)
+        out = fopen(lockprof_output, "a");
+    if (out == NULL) {
+        free(sorted);
+        return;
+    }
+
+    fprintf(out, "HYBRIS LOCK PROFILE (pid %d): %u locks, %u not tracked\n",
+            getpid(), n, lockprof_dropped);
+    fprintf(out, "%-18s %-6s %10s %10s %12s %10s %s\n", "lock", "kind",
+            "acquired", "contended", "wait us", "max us", "library");
+    for (i = 0; i < n; i++) {
+        library = "-";
+        if (android_dladdr(sorted[i].caller, &info) && info.dli_fname)
+            library = info.dli_fname;
+        if (sorted[i].kind == LOCKPROF_COND)
+            strcpy(contended, "-");
+        else
+            snprintf(contended, sizeof(contended), "%u",
+                     sorted[i].contended);
+        fprintf(out, "%-18p %-6s %10u %10s %12llu %10llu %s\n",
+                sorted[i].lock, lockprof_kinds[sorted[i].kind],
+                sorted[i].acquired, contended, sorted[i].wait_ns / 1000,
+                sorted[i].max_ns / 1000, library);
+    }
+
+    if (out != stderr)
+        fclose(out);
+    free(sorted);
+}
+
+static void lockprof_signal(int sig)
+{
+    sem_post(&lockprof_wakeup);
+}
+
+static void *lockprof_thread(void *arg)
+{
+    for (;;) {
+        if (sem_wait(&lockprof_wakeup) == 0)
+            lockprof_dump();
+    }
+    return NULL;
+}
+
+/* Finds or claims the slot of lock, with open addressing */
+static struct lockprof_slot *lockprof_slot(void *lock, int kind,
+                                           void *caller)
+{
+    unsigned hash = ((unsigned long) lock >> 2) * 2654435761u;
+    struct lockprof_slot *slot;
+    unsigned i;
+
+    for (i = 0; i < LOCKPROF_SLOTS; i++) {
+        slot = &lockprof_slots[(hash + i) & (LOCKPROF_SLOTS - 1)];
+        if (slot->lock == NULL &&
+            __sync_bool_compare_and_swap(&slot->lock, NULL, lock)) {
+            slot->kind = kind;
+            slot->caller = caller;
+            return slot;
+        }
+        if (slot->lock == lock)
+            return slot;
+    }
+    __sync_fetch_and_add(&lockprof_dropped, 1);
+    return NULL;
+}
+
+static void lockprof_record(void *lock, int kind, void *caller,
+                            int contended, unsigned long long ns)
+{
+    struct lockprof_slot *slot = lockprof_slot(lock, kind, caller);
+    unsigned long long max;
+
+    if (slot == NULL)
+        return;
+    __sync_fetch_and_add(&slot->acquired, 1);
+    if (contended)
+        __sync_fetch_and_add(&slot->contended, 1);
+    if (ns != 0) {
+        __sync_fetch_and_add(&slot->wait_ns, ns);
+        while ((max = slot->max_ns) < ns &&
+               !__sync_bool_compare_and_swap(&slot->max_ns, max, ns))
+            ;
+    }
+}
+
+/* Takes lock with trylock if it is free, and times lockfn otherwise */
+static int lockprof_acquire(void *lock, int kind, lockprof_trylock_fn trylock,
+                            lockprof_lock_fn lockfn,
+                            const struct timespec *abstime, void *caller)
+{
+    unsigned long long start;
+    int ret;
+
+    if (trylock(lock) == 0) {
+        lockprof_record(lock, kind, caller, 0, 0);
+        return 0;
+    }
+
+    start = lockprof_now();
+    ret = lockfn(lock, abstime);
+    if (ret == 0)
+        lockprof_record(lock, kind, caller, 1, lockprof_now() - start);
+    return ret;
+}
+
+static void lockprof_init(void)
+{
+    const char *env = getenv("HYBRIS_LOCK_PROFILE");
+    struct sigaction sa;
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if (env == NULL || *env == '\0' || !strcmp(env, "0"))
+        return;
+
+    lockprof_slots = mmap(NULL, LOCKPROF_SLOTS * sizeof(*lockprof_slots),
+                          PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (lockprof_slots == MAP_FAILED)
+        return;
+    if (strcmp(env, "1"))
+        lockprof_output = env;
+
+    /* Without the thread, or the signal, the report is only written at
+     * exit */
+    sem_init(&lockprof_wakeup, 0, 0);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (sigaction(LOCKPROF_SIGNAL, NULL, &sa) == 0 &&
+        !(sa.sa_flags & SA_SIGINFO) && sa.sa_handler == SIG_DFL &&
+        pthread_create(&thread, &attr, lockprof_thread, NULL) == 0) {
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = lockprof_signal;
+        sa.sa_flags = SA_RESTART;
+        sigaction(LOCKPROF_SIGNAL, &sa, NULL);
+    }
+    pthread_attr_destroy(&attr);
+    atexit(lockprof_dump);
+    lockprof_enabled = 1;
+}
+
 /*
  * pthread_mutex* functions
  *
@@ -341,94 +572,269 @@ static int my_pthread_getattr_np(pthread_t thid, pthread_attr_t *__attr)
  *
  * */
 
-static int my_pthread_mutex_init(pthread_mutex_t *__mutex,
-                          __const pthread_mutexattr_t *__mutexattr)
+/* Mutexes live in the 4-byte bionic pthread_mutex_t itself, laid out the
+ * way bionic does so that static initializers and mutexes shared with
+ * Android processes work:
+ *
+ *   bits  0-1   state: unlocked, locked, or locked with waiters
+ *   bits  2-12  recursion count
+ *   bit  13     process shared (ANDROID_MUTEX_SHARED_MASK)
+ *   bits 14-15  type, as in the ANDROID_PTHREAD_*_MUTEX_INITIALIZERs
+ *   bits 16-31  owner tid, for recursive and error checking mutexes
+ *
+ * Waiters sleep on the word with a futex when it says locked with waiters.
+ */
+#define MUTEX_STATE_MASK        0x0003
+#define MUTEX_UNLOCKED          0x0000
+#define MUTEX_LOCKED            0x0001
+#define MUTEX_CONTENDED         0x0002
+#define MUTEX_COUNTER_ONE       0x0004
+#define MUTEX_COUNTER_MASK      0x1ffc
+#define MUTEX_TYPE_MASK         0xc000
+#define MUTEX_TYPE_NORMAL       ANDROID_PTHREAD_MUTEX_INITIALIZER
+#define MUTEX_TYPE_RECURSIVE    ANDROID_PTHREAD_RECURSIVE_MUTEX_INITIALIZER
+#define MUTEX_TYPE_ERRORCHECK   ANDROID_PTHREAD_ERRORCHECK_MUTEX_INITIALIZER
+#define MUTEX_OWNER_MASK        0xffff0000
+#define MUTEX_OWNER_SHIFT       16
+
+/* Like bionic, only keeps the low 16 bits of the tid */
+static inline int hybris_mutex_owner(void)
 {
-    pthread_mutex_t *realmutex = malloc(sizeof(pthread_mutex_t));
-    *((int *)__mutex) = (int) realmutex;
-    return pthread_mutex_init(realmutex, __mutexattr);
+    return (int)((unsigned) hybris_gettid() << MUTEX_OWNER_SHIFT);
 }
 
-static int my_pthread_mutex_destroy(pthread_mutex_t *__mutex)
+static inline void hybris_mutex_lock_normal(volatile int *m, int shared)
 {
-    int ret;
-    pthread_mutex_t *realmutex = (pthread_mutex_t *) *(int *) __mutex;
+    if (__sync_bool_compare_and_swap(m, shared, shared | MUTEX_LOCKED))
+        return;
 
-    ret = pthread_mutex_destroy(realmutex);
-    free(realmutex);
+    /* Whoever unlocks has to wake someone up from now on */
+    while (__sync_lock_test_and_set(m, shared | MUTEX_CONTENDED) != shared)
+        hybris_futex_wait(m, shared | MUTEX_CONTENDED, shared, NULL,
+                          CLOCK_MONOTONIC);
+}
 
-    return ret;
+static inline int hybris_mutex_unlock_normal(volatile int *m, int shared)
+{
+    if ((*m & MUTEX_STATE_MASK) == MUTEX_UNLOCKED)
+        return EPERM;
+
+    if (__sync_fetch_and_sub(m, MUTEX_LOCKED) != (shared | MUTEX_LOCKED)) {
+        *m = shared;
+        hybris_futex_wake(m, 1, shared);
+    }
+    return 0;
 }
 
-static int my_pthread_mutex_lock(pthread_mutex_t *__mutex)
+/* Recursive and error checking mutexes, kept out of line so that they
+ * don't weigh down the normal ones */
+static int __attribute__((noinline))
+hybris_mutex_lock_owned(volatile int *m, int mvalue)
 {
-    if (nvidia_hack)
+    int shared = mvalue & ANDROID_MUTEX_SHARED_MASK;
+    int unlocked = (mvalue & MUTEX_TYPE_MASK) | shared;
+    int owner = hybris_mutex_owner();
+
+    if ((mvalue & MUTEX_STATE_MASK) != MUTEX_UNLOCKED &&
+        (mvalue & MUTEX_OWNER_MASK) == owner) {
+        if ((mvalue & MUTEX_TYPE_MASK) == MUTEX_TYPE_ERRORCHECK)
+            return EDEADLK;
+        if ((mvalue & MUTEX_COUNTER_MASK) == MUTEX_COUNTER_MASK)
+            return EAGAIN;
+        /* Only we change the count, and nobody else can take the lock
+         * while we hold it, so the add can't disturb a waiter */
+        __sync_fetch_and_add(m, MUTEX_COUNTER_ONE);
         return 0;
+    }
 
-    if (!__mutex) {
-        LOGD("Null mutex lock, not locking.");
+    if (__sync_bool_compare_and_swap(m, unlocked,
+                                     owner | unlocked | MUTEX_LOCKED))
         return 0;
+
+    for (;;) {
+        mvalue = *m;
+        if ((mvalue & MUTEX_STATE_MASK) == MUTEX_UNLOCKED) {
+            /* There may be others asleep, so mark it contended for them */
+            if (__sync_bool_compare_and_swap(m, mvalue,
+                                    owner | unlocked | MUTEX_CONTENDED))
+                return 0;
+            continue;
+        }
+        if ((mvalue & MUTEX_STATE_MASK) == MUTEX_LOCKED) {
+            int contended = (mvalue & ~MUTEX_STATE_MASK) | MUTEX_CONTENDED;
+            if (!__sync_bool_compare_and_swap(m, mvalue, contended))
+                continue;
+            mvalue = contended;
+        }
+        hybris_futex_wait(m, mvalue, shared, NULL, CLOCK_MONOTONIC);
     }
+}
+
+static int __attribute__((noinline))
+hybris_mutex_unlock_owned(volatile int *m, int mvalue)
+{
+    int shared = mvalue & ANDROID_MUTEX_SHARED_MASK;
+    int owner = hybris_mutex_owner();
 
-    int value = (*(int *) __mutex);
-    if (hybris_check_android_shared_mutex(value)) {
-        LOGD("Shared mutex with Android, not locking.");
+    if ((mvalue & MUTEX_STATE_MASK) == MUTEX_UNLOCKED ||
+        (mvalue & MUTEX_OWNER_MASK) != owner)
+        return EPERM;
+
+    if (mvalue & MUTEX_COUNTER_MASK) {
+        __sync_fetch_and_sub(m, MUTEX_COUNTER_ONE);
         return 0;
     }
 
-    pthread_mutex_t *realmutex = (pthread_mutex_t *) value;
+    /* __sync_lock_test_and_set() is only an acquire barrier */
+    __sync_synchronize();
+    mvalue = __sync_lock_test_and_set(m, (mvalue & MUTEX_TYPE_MASK) | shared);
+    if ((mvalue & MUTEX_STATE_MASK) == MUTEX_CONTENDED)
+        hybris_futex_wake(m, 1, shared);
+    return 0;
+}
 
-    if (value <= ANDROID_TOP_ADDR_VALUE_MUTEX) {
-        realmutex = hybris_alloc_init_mutex(value);
-        *((int *)__mutex) = (int) realmutex;
+static int my_pthread_mutex_init(pthread_mutex_t *__mutex,
+                          __const pthread_mutexattr_t *__mutexattr)
+{
+    /* The attribute functions are glibc's own, so is the attribute */
+    int type = PTHREAD_MUTEX_NORMAL;
+    int pshared = PTHREAD_PROCESS_PRIVATE;
+    int value = MUTEX_TYPE_NORMAL;
+
+    if (__mutexattr != NULL) {
+        pthread_mutexattr_gettype(__mutexattr, &type);
+        pthread_mutexattr_getpshared(__mutexattr, &pshared);
     }
 
-    return pthread_mutex_lock(realmutex);
+    if (type == PTHREAD_MUTEX_RECURSIVE)
+        value = MUTEX_TYPE_RECURSIVE;
+    else if (type == PTHREAD_MUTEX_ERRORCHECK)
+        value = MUTEX_TYPE_ERRORCHECK;
+    if (pshared == PTHREAD_PROCESS_SHARED)
+        value |= ANDROID_MUTEX_SHARED_MASK;
+
+    *(volatile int *) __mutex = value;
+    return 0;
 }
 
-static int my_pthread_mutex_trylock(pthread_mutex_t *__mutex)
+static int my_pthread_mutex_destroy(pthread_mutex_t *__mutex)
+{
+    if ((*(volatile int *) __mutex & MUTEX_STATE_MASK) != MUTEX_UNLOCKED)
+        return EBUSY;
+    return 0;
+}
+
+static inline int hybris_mutex_lock(pthread_mutex_t *mutex)
 {
-    int value = (*(int *) __mutex);
+    volatile int *m = (volatile int *) mutex;
+    int value = *m;
 
-    if (hybris_check_android_shared_mutex(value)) {
-        LOGD("Shared mutex with Android, not try locking.");
+    if ((value & MUTEX_TYPE_MASK) == MUTEX_TYPE_NORMAL) {
+        hybris_mutex_lock_normal(m, value & ANDROID_MUTEX_SHARED_MASK);
         return 0;
     }
 
-    pthread_mutex_t *realmutex = (pthread_mutex_t *) value;
+    return hybris_mutex_lock_owned(m, value);
+}
 
-    if (value <= ANDROID_TOP_ADDR_VALUE_MUTEX) {
-        realmutex = hybris_alloc_init_mutex(value);
-        *((int *)__mutex) = (int) realmutex;
+static int my_pthread_mutex_trylock(pthread_mutex_t *__mutex)
+{
+    volatile int *m = (volatile int *) __mutex;
+    int value = *m;
+    int unlocked = value & (MUTEX_TYPE_MASK | ANDROID_MUTEX_SHARED_MASK);
+    int owner = 0;
+
+    if ((value & MUTEX_TYPE_MASK) != MUTEX_TYPE_NORMAL) {
+        owner = hybris_mutex_owner();
+        if ((value & MUTEX_TYPE_MASK) == MUTEX_TYPE_RECURSIVE &&
+            (value & MUTEX_STATE_MASK) != MUTEX_UNLOCKED &&
+            (value & MUTEX_OWNER_MASK) == owner)
+            return hybris_mutex_lock_owned(m, value);
     }
 
-    return pthread_mutex_trylock(realmutex);
+    if (__sync_bool_compare_and_swap(m, unlocked,
+                                     owner | unlocked | MUTEX_LOCKED))
+        return 0;
+    return EBUSY;
 }
 
-static int my_pthread_mutex_unlock(pthread_mutex_t *__mutex)
+/* There is no timed lock among the mutex shims */
+static int lockprof_mutex_lock(void *mutex, const struct timespec *abstime)
+{
+    return hybris_mutex_lock(mutex);
+}
+
+/* Set by hybris_hooks_init() unless GRAPHICS=NVIDIA or the lock profile
+ * give the mutex shims more to do than locking. Until then, everything
+ * goes the slow way. */
+static int mutex_fast_path;
+
+/* Everything but taking a free normal private mutex */
+static int __attribute__((noinline))
+hybris_mutex_lock_slow(pthread_mutex_t *mutex, void *caller)
 {
     if (nvidia_hack)
         return 0;
 
-    if (!__mutex) {
-        LOGD("Null mutex lock, not unlocking.");
+    if (!mutex) {
+        LOGD("Null mutex lock, not locking.");
         return 0;
     }
 
-    int value = (*(int *) __mutex);
-    if (hybris_check_android_shared_mutex(value)) {
-        LOGD("Shared mutex with Android, not unlocking.");
+    if (unlikely(lockprof_enabled))
+        return lockprof_acquire(mutex, LOCKPROF_MUTEX,
+                                (lockprof_trylock_fn) my_pthread_mutex_trylock,
+                                lockprof_mutex_lock, NULL, caller);
+
+    return hybris_mutex_lock(mutex);
+}
+
+static int my_pthread_mutex_lock(pthread_mutex_t *__mutex)
+{
+    if (mutex_fast_path && __mutex != NULL &&
+        __sync_bool_compare_and_swap((volatile int *) __mutex,
+                                     MUTEX_TYPE_NORMAL,
+                                     MUTEX_TYPE_NORMAL | MUTEX_LOCKED))
         return 0;
-    }
 
-    if (value <= ANDROID_TOP_ADDR_VALUE_MUTEX) {
-        LOGD("Trying to unlock a lock that's not locked/initialized"
-               " by Hybris, not unlocking.");
+    return hybris_mutex_lock_slow(__mutex, __builtin_return_address(0));
+}
+
+static inline int hybris_mutex_unlock(pthread_mutex_t *mutex)
+{
+    volatile int *m = (volatile int *) mutex;
+    int value = *m;
+
+    if ((value & MUTEX_TYPE_MASK) == MUTEX_TYPE_NORMAL)
+        return hybris_mutex_unlock_normal(m,
+                                          value & ANDROID_MUTEX_SHARED_MASK);
+
+    return hybris_mutex_unlock_owned(m, value);
+}
+
+static int __attribute__((noinline))
+hybris_mutex_unlock_slow(pthread_mutex_t *mutex)
+{
+    if (nvidia_hack)
+        return 0;
+
+    if (!mutex) {
+        LOGD("Null mutex lock, not unlocking.");
         return 0;
     }
 
-    pthread_mutex_t *realmutex = (pthread_mutex_t *) value;
-    return pthread_mutex_unlock(realmutex);
+    return hybris_mutex_unlock(mutex);
+}
+
+static int my_pthread_mutex_unlock(pthread_mutex_t *__mutex)
+{
+    if (mutex_fast_path && __mutex != NULL &&
+        __sync_bool_compare_and_swap((volatile int *) __mutex,
+                                     MUTEX_TYPE_NORMAL | MUTEX_LOCKED,
+                                     MUTEX_TYPE_NORMAL))
+        return 0;
+
+    return hybris_mutex_unlock_slow(__mutex);
 }
 
 static int my_pthread_mutexattr_setpshared(pthread_mutexattr_t *__attr,
@@ -448,122 +854,149 @@ static int my_pthread_mutexattr_setpshared(pthread_mutexattr_t *__attr,
  *
  * */
 
-static int my_pthread_cond_init(pthread_cond_t *cond,
-                                const pthread_condattr_t *attr)
+/* Condition variables live in the bionic pthread_cond_t too: bit 0 is
+ * ANDROID_COND_SHARED_MASK and the rest is a counter that every signal
+ * and broadcast bumps. A waiter sleeps on the value it read before
+ * unlocking the mutex, so that it can't miss a wakeup in between. */
+#define COND_COUNTER_STEP 2
+
+static void hybris_cond_pulse(pthread_cond_t *cond, int count)
 {
-    pthread_cond_t *realcond = malloc(sizeof(pthread_cond_t));
-    *((int *) cond) = (int) realcond;
+    volatile int *c = (volatile int *) cond;
 
-    return pthread_cond_init(realcond, attr);
+    __sync_fetch_and_add(c, COND_COUNTER_STEP);
+    hybris_futex_wake(c, count, *c & ANDROID_COND_SHARED_MASK);
 }
 
-static int my_pthread_cond_destroy(pthread_cond_t *cond)
+/* Waits until signalled, or until clock reaches abstime if it isn't NULL */
+static int hybris_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                            const struct timespec *abstime, clockid_t clock)
 {
+    volatile int *c = (volatile int *) cond;
+    int value = *c;
+    int locked = !nvidia_hack && mutex != NULL;
     int ret;
-    pthread_cond_t *realcond = (pthread_cond_t *) *(int *) cond;
 
-    ret = pthread_cond_destroy(realcond);
-    free(realcond);
+    if (abstime != NULL && !hybris_timespec_valid(abstime))
+        return EINVAL;
 
-    return ret;
+    /* Not through the shims, so that the lock profile doesn't count
+     * taking the mutex back as a lock taken by libhybris */
+    if (locked)
+        hybris_mutex_unlock(mutex);
+    ret = hybris_futex_wait(c, value, value & ANDROID_COND_SHARED_MASK,
+                            abstime, clock);
+    if (locked)
+        hybris_mutex_lock(mutex);
+
+    return ret == -ETIMEDOUT ? ETIMEDOUT : 0;
 }
 
-static int my_pthread_cond_broadcast(pthread_cond_t *cond)
+static int __attribute__((noinline))
+lockprof_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                   const struct timespec *abstime, clockid_t clock,
+                   void *caller)
 {
-    if (nvidia_hack)
-        return 0;
+    unsigned long long start = lockprof_now();
+    int ret = hybris_cond_wait(cond, mutex, abstime, clock);
 
-    int value = (*(int *) cond);
-    if (hybris_check_android_shared_cond(value)) {
-        LOGD("shared condition with Android, not broadcasting.");
-        return 0;
-    }
+    lockprof_record(cond, LOCKPROF_COND, caller, 0, lockprof_now() - start);
+    return ret;
+}
 
-    pthread_cond_t *realcond = (pthread_cond_t *) value;
+static int my_pthread_cond_init(pthread_cond_t *cond,
+                                const pthread_condattr_t *attr)
+{
+    int pshared = PTHREAD_PROCESS_PRIVATE;
 
-    if (value <= ANDROID_TOP_ADDR_VALUE_COND) {
-        realcond = hybris_alloc_init_cond();
-        *((int *) cond) = (int) realcond;
-    }
+    if (attr != NULL)
+        pthread_condattr_getpshared(attr, &pshared);
 
-    return pthread_cond_broadcast(realcond);
+    *(volatile int *) cond = pshared == PTHREAD_PROCESS_SHARED ?
+                             ANDROID_COND_SHARED_MASK : 0;
+    return 0;
 }
 
-static int my_pthread_cond_signal(pthread_cond_t *cond)
+static int my_pthread_cond_destroy(pthread_cond_t *cond)
 {
-    int value = (*(int *) cond);
+    return 0;
+}
 
-    if (hybris_check_android_shared_cond(value)) {
-        LOGD("Shared condition with Android, not signaling.");
+static int my_pthread_cond_broadcast(pthread_cond_t *cond)
+{
+    if (nvidia_hack)
         return 0;
-    }
 
-    pthread_cond_t *realcond = (pthread_cond_t *) value;
-
-    if (value <= ANDROID_TOP_ADDR_VALUE_COND) {
-        realcond = hybris_alloc_init_cond();
-        *((int *) cond) = (int) realcond;
-    }
+    hybris_cond_pulse(cond, INT_MAX);
+    return 0;
+}
 
-    return pthread_cond_signal(realcond);
+static int my_pthread_cond_signal(pthread_cond_t *cond)
+{
+    hybris_cond_pulse(cond, 1);
+    return 0;
 }
 
 static int my_pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
 {
-    /* Both cond and mutex can be statically initialized, check for both */
-    int cvalue = (*(int *) cond);
-    int mvalue = (*(int *) mutex);
+    if (unlikely(lockprof_enabled))
+        return lockprof_cond_wait(cond, mutex, NULL, CLOCK_MONOTONIC,
+                                  __builtin_return_address(0));
 
-    if (hybris_check_android_shared_cond(cvalue) ||
-         hybris_check_android_shared_mutex(mvalue)) {
-        LOGD("Shared condition/mutex with Android, not waiting.");
-        return 0;
-    }
+    return hybris_cond_wait(cond, mutex, NULL, CLOCK_MONOTONIC);
+}
 
-    pthread_cond_t *realcond = (pthread_cond_t *) cvalue;
-    if (cvalue <= ANDROID_TOP_ADDR_VALUE_COND) {
-        realcond = hybris_alloc_init_cond();
-        *((int *) cond) = (int) realcond;
-    }
+static int my_pthread_cond_timedwait(pthread_cond_t *cond,
+                pthread_mutex_t *mutex, const struct timespec *abstime)
+{
+    if (nvidia_hack)
+        return 0;
 
-    pthread_mutex_t *realmutex = (pthread_mutex_t *) mvalue;
-    if (mvalue <= ANDROID_TOP_ADDR_VALUE_MUTEX) {
-        realmutex = hybris_alloc_init_mutex(mvalue);
-        *((int *) mutex) = (int) realmutex;
-    }
+    if (unlikely(lockprof_enabled))
+        return lockprof_cond_wait(cond, mutex, abstime, CLOCK_REALTIME,
+                                  __builtin_return_address(0));
 
-    return pthread_cond_wait(realcond, realmutex);
+    return hybris_cond_wait(cond, mutex, abstime, CLOCK_REALTIME);
 }
 
-static int my_pthread_cond_timedwait(pthread_cond_t *cond,
+/* Bionic extensions, used by android::Condition among others */
+static int my_pthread_cond_timedwait_monotonic(pthread_cond_t *cond,
                 pthread_mutex_t *mutex, const struct timespec *abstime)
 {
     if (nvidia_hack)
         return 0;
 
-    /* Both cond and mutex can be statically initialized, check for both */
-    int cvalue = (*(int *) cond);
-    int mvalue = (*(int *) mutex);
+    if (unlikely(lockprof_enabled))
+        return lockprof_cond_wait(cond, mutex, abstime, CLOCK_MONOTONIC,
+                                  __builtin_return_address(0));
+
+    return hybris_cond_wait(cond, mutex, abstime, CLOCK_MONOTONIC);
+}
+
+static int my_pthread_cond_timedwait_relative_np(pthread_cond_t *cond,
+                pthread_mutex_t *mutex, const struct timespec *reltime)
+{
+    struct timespec abstime;
 
-    if (hybris_check_android_shared_cond(cvalue) ||
-         hybris_check_android_shared_mutex(mvalue)) {
-        LOGD("Shared condition/mutex with Android, not waiting.");
+    if (nvidia_hack)
         return 0;
-    }
 
-    pthread_cond_t *realcond = (pthread_cond_t *) cvalue;
-    if (cvalue <= ANDROID_TOP_ADDR_VALUE_COND) {
-        realcond = hybris_alloc_init_cond();
-        *((int *) cond) = (int) realcond;
-    }
+    if (!hybris_timespec_valid(reltime))
+        return EINVAL;
 
-    pthread_mutex_t *realmutex = (pthread_mutex_t *) mvalue;
-    if (mvalue <= ANDROID_TOP_ADDR_VALUE_MUTEX) {
-        realmutex = hybris_alloc_init_mutex(mvalue);
-        *((int *) mutex) = (int) realmutex;
+    clock_gettime(CLOCK_MONOTONIC, &abstime);
+    abstime.tv_sec += reltime->tv_sec;
+    abstime.tv_nsec += reltime->tv_nsec;
+    if (abstime.tv_nsec >= 1000000000) {
+        abstime.tv_sec++;
+        abstime.tv_nsec -= 1000000000;
     }
 
-    return pthread_cond_timedwait(realcond, realmutex, abstime);
+    if (unlikely(lockprof_enabled))
+        return lockprof_cond_wait(cond, mutex, &abstime, CLOCK_MONOTONIC,
+                                  __builtin_return_address(0));
+
+    return hybris_cond_wait(cond, mutex, &abstime, CLOCK_MONOTONIC);
 }
 
 /*
@@ -617,87 +1050,317 @@ static int my_pthread_rwlockattr_getpshared(pthread_rwlockattr_t *__attr,
  *
  * */
 
-static int my_pthread_rwlock_init(pthread_rwlock_t *__rwlock,
-                                  __const pthread_rwlockattr_t *__attr)
+/* Reader/writer locks live in the bionic pthread_rwlock_t itself, which is
+ *
+ *   struct { pthread_mutex_t lock; pthread_cond_t cond; int numLocks;
+ *            int writerThreadId; int pendingReaders; int pendingWriters;
+ *            void *reserved[4]; }
+ *
+ * and is all zeroes when statically initialized. Only that size and
+ * initializer are bionic's: the words mean something else here, so such
+ * a rwlock can't be shared with a process using bionic's own code, and
+ * pthread_rwlock_init() refuses process shared rwlocks with ENOTSUP
+ * rather than handing out one that only works within a process. The lock
+ * word is unused, and every sleeper waits on the cond word, which is
+ * bumped to wake them all. numLocks holds the whole state, so that a
+ * reader takes the lock with a single atomic add when there is no writer:
+ *
+ *   bit   0     held by a writer
+ *   bits  1-15  writers waiting, which keep new readers out
+ *   bits 16-31  readers holding the lock
+ *
+ * A reader that finds a writer in the way takes its add back before going
+ * to sleep. writerThreadId is the writer's tid, and pendingReaders counts
+ * the readers asleep, so that unlocking only makes a syscall when someone
+ * may be waiting. pendingWriters is left alone, since the waiting writers
+ * are counted in numLocks.
+ *
+ * As in bionic, the writer may lock the rwlock again, for reading or
+ * writing, and each of those takes an unlock; reserved[0] counts them.
+ * Bionic makes even the writer wait while other writers are waiting for
+ * a read lock, and so deadlocks; the shims don't.
+ */
+#define RWLOCK_WRITER           0x00000001
+#define RWLOCK_WRITER_WAITING   0x00000002
+#define RWLOCK_WRITERS_MASK     0x0000fffe
+#define RWLOCK_BLOCKS_READERS   0x0000ffff
+#define RWLOCK_READER           0x00010000
+#define RWLOCK_READERS_SHIFT    16
+
+struct hybris_rwlock {
+    int unused_lock;                /* lock */
+    volatile int seq;               /* cond */
+    volatile unsigned state;        /* numLocks */
+    volatile int writer;            /* writerThreadId */
+    volatile int pending_readers;   /* pendingReaders */
+    int unused;                     /* pendingWriters */
+    int write_depth;                /* reserved[0] */
+};
+
+static inline int hybris_rwlock_owned(struct hybris_rwlock *rw)
 {
-    pthread_rwlock_t *realrwlock = malloc(sizeof(pthread_rwlock_t));
-    pthread_rwlockattr_t *realattr = (pthread_rwlockattr_t *) *(int *) __attr;
-    *((int *)__rwlock) = (int) realrwlock;
-    return pthread_rwlock_init(realrwlock, realattr);
+    return (rw->state & RWLOCK_WRITER) && rw->writer == hybris_gettid();
 }
 
-static int my_pthread_rwlock_destroy(pthread_rwlock_t *__rwlock)
+/* Called after changing the state: wakes everyone up if anyone may be
+ * waiting for the change */
+static void hybris_rwlock_wake(struct hybris_rwlock *rw, unsigned state)
 {
-    int ret;
-    pthread_rwlock_t *realrwlock = (pthread_rwlock_t *) *(int *) __rwlock;
+    if ((state & RWLOCK_WRITERS_MASK) == 0 && rw->pending_readers == 0)
+        return;
+    __sync_fetch_and_add(&rw->seq, 1);
+    hybris_futex_wake(&rw->seq, INT_MAX, 0);
+}
 
-    ret = pthread_rwlock_destroy(realrwlock);
-    free(realrwlock);
+static inline void hybris_rwlock_read_release(struct hybris_rwlock *rw)
+{
+    unsigned state = __sync_sub_and_fetch(&rw->state, RWLOCK_READER);
 
-    return ret;
+    /* Only a writer can have been waiting for the last reader to leave */
+    if ((state >> RWLOCK_READERS_SHIFT) == 0 &&
+        (state & RWLOCK_WRITERS_MASK) != 0)
+        hybris_rwlock_wake(rw, state);
 }
 
-static pthread_rwlock_t* hybris_set_realrwlock(pthread_rwlock_t *rwlock)
+static int __attribute__((noinline))
+hybris_rwlock_rdlock_slow(struct hybris_rwlock *rw,
+                          const struct timespec *abstime)
 {
-    int value = (*(int *) rwlock);
-    pthread_rwlock_t *realrwlock = (pthread_rwlock_t *) value;
-    if (value <= ANDROID_TOP_ADDR_VALUE_RWLOCK) {
-        realrwlock = hybris_alloc_init_rwlock();
-        *((int *)rwlock) = (int) realrwlock;
+    unsigned state;
+    int seq, ret;
+
+    /* Take back the add of the fast path */
+    hybris_rwlock_read_release(rw);
+
+    if (hybris_rwlock_owned(rw)) {
+        rw->write_depth++;
+        return 0;
+    }
+    for (;;) {
+        state = rw->state;
+        if ((state & RWLOCK_BLOCKS_READERS) == 0) {
+            if (__sync_bool_compare_and_swap(&rw->state, state,
+                                             state + RWLOCK_READER))
+                return 0;
+            continue;
+        }
+
+        /* Whoever changes the state after this sees us and bumps seq */
+        __sync_fetch_and_add(&rw->pending_readers, 1);
+        seq = rw->seq;
+        __sync_synchronize();
+        ret = 0;
+        if (rw->state & RWLOCK_BLOCKS_READERS)
+            ret = hybris_futex_wait(&rw->seq, seq, 0, abstime,
+                                    CLOCK_REALTIME);
+        __sync_fetch_and_sub(&rw->pending_readers, 1);
+        if (ret == -ETIMEDOUT)
+            return ETIMEDOUT;
     }
-    return realrwlock;
 }
 
-static int my_pthread_rwlock_rdlock(pthread_rwlock_t *__rwlock)
+static int __attribute__((noinline))
+hybris_rwlock_wrlock_slow(struct hybris_rwlock *rw,
+                          const struct timespec *abstime)
+{
+    int tid = hybris_gettid();
+    unsigned state;
+    int seq;
+
+    if ((rw->state & RWLOCK_WRITER) && rw->writer == tid) {
+        rw->write_depth++;
+        return 0;
+    }
+
+    __sync_fetch_and_add(&rw->state, RWLOCK_WRITER_WAITING);
+    for (;;) {
+        seq = rw->seq;
+        __sync_synchronize();
+        state = rw->state;
+        if ((state & RWLOCK_WRITER) == 0 &&
+            (state >> RWLOCK_READERS_SHIFT) == 0) {
+            if (__sync_bool_compare_and_swap(&rw->state, state,
+                    (state - RWLOCK_WRITER_WAITING) | RWLOCK_WRITER)) {
+                rw->writer = tid;
+                return 0;
+            }
+            continue;
+        }
+
+        if (hybris_futex_wait(&rw->seq, seq, 0, abstime,
+                              CLOCK_REALTIME) == -ETIMEDOUT) {
+            /* The readers we were keeping out may go ahead */
+            state = __sync_sub_and_fetch(&rw->state, RWLOCK_WRITER_WAITING);
+            hybris_rwlock_wake(rw, state);
+            return ETIMEDOUT;
+        }
+    }
+}
+
+static inline int hybris_rwlock_rdlock(pthread_rwlock_t *rwlock,
+                                       const struct timespec *abstime)
+{
+    struct hybris_rwlock *rw = (struct hybris_rwlock *) rwlock;
+
+    if ((__sync_fetch_and_add(&rw->state, RWLOCK_READER) &
+         RWLOCK_BLOCKS_READERS) == 0)
+        return 0;
+    return hybris_rwlock_rdlock_slow(rw, abstime);
+}
+
+static inline int hybris_rwlock_wrlock(pthread_rwlock_t *rwlock,
+                                       const struct timespec *abstime)
+{
+    struct hybris_rwlock *rw = (struct hybris_rwlock *) rwlock;
+
+    if (__sync_bool_compare_and_swap(&rw->state, 0, RWLOCK_WRITER)) {
+        rw->writer = hybris_gettid();
+        return 0;
+    }
+    return hybris_rwlock_wrlock_slow(rw, abstime);
+}
+
+static int my_pthread_rwlock_init(pthread_rwlock_t *__rwlock,
+                                  __const pthread_rwlockattr_t *__attr)
 {
-    pthread_rwlock_t *realrwlock = hybris_set_realrwlock(__rwlock);
-    return pthread_rwlock_rdlock(realrwlock);
+    struct hybris_rwlock *rw = (struct hybris_rwlock *) __rwlock;
+    pthread_rwlockattr_t *realattr;
+    int pshared = PTHREAD_PROCESS_PRIVATE;
+
+    if (__attr != NULL) {
+        realattr = (pthread_rwlockattr_t *) *(int *) __attr;
+        pthread_rwlockattr_getpshared(realattr, &pshared);
+    }
+
+    if (pshared == PTHREAD_PROCESS_SHARED)
+        return ENOTSUP;
+
+    rw->seq = 0;
+    rw->state = 0;
+    rw->writer = 0;
+    rw->pending_readers = 0;
+    rw->write_depth = 0;
+    return 0;
+}
+
+static int my_pthread_rwlock_destroy(pthread_rwlock_t *__rwlock)
+{
+    struct hybris_rwlock *rw = (struct hybris_rwlock *) __rwlock;
+
+    if (rw->state != 0)
+        return EBUSY;
+    return 0;
 }
 
 static int my_pthread_rwlock_tryrdlock(pthread_rwlock_t *__rwlock)
 {
-    pthread_rwlock_t *realrwlock = hybris_set_realrwlock(__rwlock);
-    return pthread_rwlock_tryrdlock(realrwlock);
+    struct hybris_rwlock *rw = (struct hybris_rwlock *) __rwlock;
+    unsigned state;
+
+    do {
+        state = rw->state;
+        if (state & RWLOCK_BLOCKS_READERS) {
+            if (!hybris_rwlock_owned(rw))
+                return EBUSY;
+            rw->write_depth++;
+            return 0;
+        }
+    } while (!__sync_bool_compare_and_swap(&rw->state, state,
+                                           state + RWLOCK_READER));
+    return 0;
+}
+
+static int my_pthread_rwlock_rdlock(pthread_rwlock_t *__rwlock)
+{
+    if (unlikely(lockprof_enabled))
+        return lockprof_acquire(__rwlock, LOCKPROF_RWLOCK,
+                    (lockprof_trylock_fn) my_pthread_rwlock_tryrdlock,
+                    (lockprof_lock_fn) hybris_rwlock_rdlock, NULL,
+                    __builtin_return_address(0));
+
+    return hybris_rwlock_rdlock(__rwlock, NULL);
 }
 
 static int my_pthread_rwlock_timedrdlock(pthread_rwlock_t *__rwlock,
                                          __const struct timespec *abs_timeout)
 {
-    pthread_rwlock_t *realrwlock = hybris_set_realrwlock(__rwlock);
-    return pthread_rwlock_timedrdlock(realrwlock, abs_timeout);
+    if (!hybris_timespec_valid(abs_timeout))
+        return EINVAL;
+
+    if (unlikely(lockprof_enabled))
+        return lockprof_acquire(__rwlock, LOCKPROF_RWLOCK,
+                    (lockprof_trylock_fn) my_pthread_rwlock_tryrdlock,
+                    (lockprof_lock_fn) hybris_rwlock_rdlock, abs_timeout,
+                    __builtin_return_address(0));
+
+    return hybris_rwlock_rdlock(__rwlock, abs_timeout);
 }
 
-static int my_pthread_rwlock_wrlock(pthread_rwlock_t *__rwlock)
+static int my_pthread_rwlock_trywrlock(pthread_rwlock_t *__rwlock)
 {
-    pthread_rwlock_t *realrwlock = hybris_set_realrwlock(__rwlock);
-    return pthread_rwlock_wrlock(realrwlock);
+    struct hybris_rwlock *rw = (struct hybris_rwlock *) __rwlock;
+
+    if (!__sync_bool_compare_and_swap(&rw->state, 0, RWLOCK_WRITER)) {
+        if (!hybris_rwlock_owned(rw))
+            return EBUSY;
+        rw->write_depth++;
+        return 0;
+    }
+    rw->writer = hybris_gettid();
+    return 0;
 }
 
-static int my_pthread_rwlock_trywrlock(pthread_rwlock_t *__rwlock)
+static int my_pthread_rwlock_wrlock(pthread_rwlock_t *__rwlock)
 {
-    pthread_rwlock_t *realrwlock = hybris_set_realrwlock(__rwlock);
-    return pthread_rwlock_trywrlock(realrwlock);
+    if (unlikely(lockprof_enabled))
+        return lockprof_acquire(__rwlock, LOCKPROF_RWLOCK,
+                    (lockprof_trylock_fn) my_pthread_rwlock_trywrlock,
+                    (lockprof_lock_fn) hybris_rwlock_wrlock, NULL,
+                    __builtin_return_address(0));
+
+    return hybris_rwlock_wrlock(__rwlock, NULL);
 }
 
 static int my_pthread_rwlock_timedwrlock(pthread_rwlock_t *__rwlock,
                                          __const struct timespec *abs_timeout)
 {
-    pthread_rwlock_t *realrwlock = hybris_set_realrwlock(__rwlock);
-    return pthread_rwlock_timedwrlock(realrwlock, abs_timeout);
+    if (!hybris_timespec_valid(abs_timeout))
+        return EINVAL;
+
+    if (unlikely(lockprof_enabled))
+        return lockprof_acquire(__rwlock, LOCKPROF_RWLOCK,
+                    (lockprof_trylock_fn) my_pthread_rwlock_trywrlock,
+                    (lockprof_lock_fn) hybris_rwlock_wrlock, abs_timeout,
+                    __builtin_return_address(0));
+
+    return hybris_rwlock_wrlock(__rwlock, abs_timeout);
 }
 
 static int my_pthread_rwlock_unlock(pthread_rwlock_t *__rwlock)
 {
-    int value = (*(int *) __rwlock);
-    if (value <= ANDROID_TOP_ADDR_VALUE_RWLOCK) {
-        LOGD("Trying to unlock a rwlock that's not locked/initialized"
-               " by Hybris, not unlocking.");
+    struct hybris_rwlock *rw = (struct hybris_rwlock *) __rwlock;
+    unsigned state = rw->state;
+
+    if (state & RWLOCK_WRITER) {
+        if (rw->writer != hybris_gettid())
+            return EPERM;
+        if (rw->write_depth > 0) {
+            rw->write_depth--;
+            return 0;
+        }
+        rw->writer = 0;
+        state = __sync_sub_and_fetch(&rw->state, RWLOCK_WRITER);
+        hybris_rwlock_wake(rw, state);
         return 0;
     }
-    pthread_rwlock_t *realrwlock = (pthread_rwlock_t *) value;
-    return pthread_rwlock_unlock(realrwlock);
-}
 
+    if ((state >> RWLOCK_READERS_SHIFT) == 0) {
+        LOGD("Trying to unlock a rwlock that's not locked, not unlocking.");
+        return EPERM;
+    }
+    hybris_rwlock_read_release(rw);
+    return 0;
+}
 
 static int my_set_errno(int oi_errno)
 {
@@ -705,193 +1368,34 @@ static int my_set_errno(int oi_errno)
     return -1;
 }
 
-static struct _hook hooks[] = {
-    {"property_get", property_get },
-    {"property_set", property_set },
-    {"getenv", getenv },
-    {"printf", printf },
-    {"malloc", my_malloc },
-    {"free", free },
-    {"calloc", calloc },
-    {"cfree", cfree },
-    {"realloc", realloc },
-    {"memalign", memalign },
-    {"valloc", valloc },
-    {"pvalloc", pvalloc },
-    {"fread", fread },
-    {"getxattr", getxattr},
-    /* string.h */
-    {"memccpy",memccpy}, 
-    {"memchr",memchr}, 
-    {"memrchr",memrchr}, 
-    {"memcmp",memcmp}, 
-    {"memcpy",my_memcpy}, 
-    {"memmove",memmove}, 
-    {"memset",memset}, 
-    {"memmem",memmem}, 
-    //  {"memswap",memswap}, 
-    {"index",index}, 
-    {"rindex",rindex}, 
-    {"strchr",strchr}, 
-    {"strrchr",strrchr}, 
-    {"strlen",my_strlen}, 
-    {"strcmp",strcmp}, 
-    {"strcpy",strcpy}, 
-    {"strcat",strcat}, 
-    {"strcasecmp",strcasecmp}, 
-    {"strncasecmp",strncasecmp}, 
-    {"strdup",strdup}, 
-    {"strstr",strstr}, 
-    {"strcasestr",strcasestr}, 
-    {"strtok",strtok}, 
-    {"strtok_r",strtok_r}, 
-    {"strerror",strerror}, 
-    {"strerror_r",strerror_r}, 
-    {"strnlen",strnlen}, 
-    {"strncat",strncat}, 
-    {"strndup",strndup}, 
-    {"strncmp",strncmp}, 
-    {"strncpy",strncpy}, 
-    //{"strlcat",strlcat}, 
-    //{"strlcpy",strlcpy}, 
-    {"strcspn",strcspn}, 
-    {"strpbrk",strpbrk}, 
-    {"strsep",strsep}, 
-    {"strspn",strspn}, 
-    {"strsignal",strsignal}, 
-    {"strcoll",strcoll}, 
-    {"strxfrm",strxfrm}, 
-    /* strings.h */
-    {"bcmp",bcmp}, 
-    {"bcopy",bcopy}, 
-    {"bzero",bzero}, 
-    {"ffs",ffs}, 
-    {"index",index}, 
-    {"rindex",rindex}, 
-    {"strcasecmp",strcasecmp}, 
-    {"strncasecmp",strncasecmp},
-    /* dirent.h */
-    {"opendir", opendir},
-    {"closedir", closedir},
-    /* pthread.h */
-    {"pthread_atfork", pthread_atfork},
-    {"pthread_create", my_pthread_create},
-    {"pthread_kill", pthread_kill},
-    {"pthread_exit", pthread_exit},
-    {"pthread_join", pthread_join},
-    {"pthread_detach", pthread_detach},
-    {"pthread_self", pthread_self},
-    {"pthread_equal", pthread_equal},
-    {"pthread_getschedparam", pthread_getschedparam},
-    {"pthread_setschedparam", pthread_setschedparam},
-    {"pthread_mutex_init", my_pthread_mutex_init},
-    {"pthread_mutex_destroy", my_pthread_mutex_destroy},
-    {"pthread_mutex_lock", my_pthread_mutex_lock},
-    {"pthread_mutex_unlock", my_pthread_mutex_unlock},
-    {"pthread_mutex_trylock", my_pthread_mutex_trylock},
-    {"pthread_mutexattr_init", pthread_mutexattr_init},
-    {"pthread_mutexattr_destroy", pthread_mutexattr_destroy},
-    {"pthread_mutexattr_getttype", pthread_mutexattr_gettype},
-    {"pthread_mutexattr_settype", pthread_mutexattr_settype},
-    {"pthread_mutexattr_getpshared", pthread_mutexattr_getpshared},
-    {"pthread_mutexattr_setpshared", my_pthread_mutexattr_setpshared},
-    {"pthread_condattr_init", pthread_condattr_init},
-    {"pthread_condattr_getpshared", pthread_condattr_getpshared},
-    {"pthread_condattr_setpshared", pthread_condattr_setpshared},
-    {"pthread_condattr_destroy", pthread_condattr_destroy},
-    {"pthread_cond_init", my_pthread_cond_init},
-    {"pthread_cond_destroy", my_pthread_cond_destroy},
-    {"pthread_cond_broadcast", my_pthread_cond_broadcast},
-    {"pthread_cond_signal", my_pthread_cond_signal},
-    {"pthread_cond_wait", my_pthread_cond_wait},
-    {"pthread_cond_timedwait", my_pthread_cond_timedwait},
-    {"pthread_cond_timedwait_monotonic", my_pthread_cond_timedwait},
-    {"pthread_cond_timedwait_relative_np", my_pthread_cond_timedwait},
-    {"pthread_key_delete", pthread_key_delete},
-    {"pthread_setname_np", pthread_setname_np},
-    {"pthread_once", pthread_once},
-    {"pthread_key_create", pthread_key_create},
-    {"pthread_setspecific", pthread_setspecific},
-    {"pthread_getspecific", pthread_getspecific},
-    {"pthread_attr_init", my_pthread_attr_init},
-    {"pthread_attr_destroy", my_pthread_attr_destroy},
-    {"pthread_attr_setdetachstate", my_pthread_attr_setdetachstate},
-    {"pthread_attr_getdetachstate", my_pthread_attr_getdetachstate},
-    {"pthread_attr_setschedpolicy", my_pthread_attr_setschedpolicy},
-    {"pthread_attr_getschedpolicy", my_pthread_attr_getschedpolicy},
-    {"pthread_attr_setschedparam", my_pthread_attr_setschedparam},
-    {"pthread_attr_getschedparam", my_pthread_attr_getschedparam},
-    {"pthread_attr_setstacksize", my_pthread_attr_setstacksize},
-    {"pthread_attr_getstacksize", my_pthread_attr_getstacksize},
-    {"pthread_attr_setstackaddr", my_pthread_attr_setstackaddr},
-    {"pthread_attr_getstackaddr", my_pthread_attr_getstackaddr},
-    {"pthread_attr_setstack", my_pthread_attr_setstack},
-    {"pthread_attr_getstack", my_pthread_attr_getstack},
-    {"pthread_attr_setguardsize", my_pthread_attr_setguardsize},
-    {"pthread_attr_getguardsize", my_pthread_attr_getguardsize},
-    {"pthread_attr_setscope", my_pthread_attr_setscope},
-    {"pthread_attr_setscope", my_pthread_attr_getscope},
-    {"pthread_getattr_np", my_pthread_getattr_np},
-    {"pthread_rwlockattr_init", my_pthread_rwlockattr_init},
-    {"pthread_rwlockattr_destroy", my_pthread_rwlockattr_destroy},
-    {"pthread_rwlockattr_setpshared", my_pthread_rwlockattr_setpshared},
-    {"pthread_rwlockattr_getpshared", my_pthread_rwlockattr_getpshared},
-    {"pthread_rwlock_init", my_pthread_rwlock_init},
-    {"pthread_rwlock_destroy", my_pthread_rwlock_destroy},
-    {"pthread_rwlock_unlock", my_pthread_rwlock_unlock},
-    {"pthread_rwlock_wrlock", my_pthread_rwlock_wrlock},
-    {"pthread_rwlock_rdlock", my_pthread_rwlock_rdlock},
-    {"pthread_rwlock_tryrdlock", my_pthread_rwlock_tryrdlock},
-    {"pthread_rwlock_trywrlock", my_pthread_rwlock_trywrlock},
-    {"pthread_rwlock_timedrdlock", my_pthread_rwlock_timedrdlock},
-    {"pthread_rwlock_timedwrlock", my_pthread_rwlock_timedwrlock},
-    /* stdio.h */
-    {"fopen", fopen},
-    {"fgets", fgets},
-    {"fclose", fclose},
-    {"fputs", fputs},
-    {"fseeko", fseeko},
-    {"fwrite", fwrite},
-    {"puts", puts},
-    {"putw", putw},
-    {"sprintf", sprintf},
-    {"snprintf", snprintf},
-    {"vasprintf", vasprintf},
-    {"vfprintf", vfprintf},
-    {"vsprintf", vsprintf},
-    {"vsnprintf", vsnprintf},
-    {"__errno", __errno_location},
-    {"__set_errno", my_set_errno},
-    /* net specifics, to avoid __res_get_state */
-    {"getaddrinfo", getaddrinfo},
-    {"gethostbyaddr", gethostbyaddr},
-    {"gethostbyname", gethostbyname},
-    {"gethostbyname2", gethostbyname2},
-    {"gethostent", gethostent},
-    /* grp.h */
-    {"getgrgid", getgrgid},
-    {NULL, NULL},
-};
+/* Perfect hash over the hooked symbols, generated from hooks.gperf */
+#include "hooks_table.h"
 
-void *get_hooked_symbol(char *sym)
+/* GRAPHICS can't change under us, so check it once when libhybris is
+ * loaded instead of on every symbol the linker asks about. */
+static void __attribute__((constructor)) hybris_hooks_init(void)
 {
-    struct _hook *ptr = &hooks[0];
-    static int counter = -1;
     char *graphics = getenv("GRAPHICS");
 
-    if (graphics == NULL) {
-        nvidia_hack = 0;
-    } else if (strcmp("NVIDIA",graphics) == 0) {
+    if (graphics != NULL && strcmp("NVIDIA", graphics) == 0)
         nvidia_hack = 1;
-    }
 
-    while (ptr->name != NULL)
-    {
-        if (strcmp(sym, ptr->name) == 0){
-            return ptr->func;
-        }
-        ptr++;
-    }
+    pthread_atfork(NULL, NULL, hybris_reset_tid);
+
+    lockprof_init();
+
+    mutex_fast_path = !nvidia_hack && !lockprof_enabled;
+}
+
+void *get_hooked_symbol(char *sym)
+{
+    const struct _hook *hook;
+    static int counter = -1;
+
+    hook = hybris_hook_lookup(sym, strlen(sym));
+    if (hook != NULL)
+        return hook->func;
+
     if (strstr(sym, "pthread") != NULL)
     {
         counter--;
@@ -24,6 +24,8 @@
 #include <dlfcn.h>
 #include <stddef.h>
 
+#include "linker_trace.h"
+
 static void *_libegl = NULL;
 static void *_libui = NULL;
 
@@ -111,9 +113,19 @@ static void _init_androidui()
  _libui = (void *) android_dlopen("/system/lib/libui.so", RTLD_LAZY);
 }
 
-#define EGL_DLSYM(fptr, sym) do { if (_libegl == NULL) { _init_androidegl(); }; if (*(fptr) == NULL) { *(fptr) = (void *) android_dlsym(_libegl, sym); } } while (0) 
+static void *_egl_dlsym(void *handle, const char *sym)
+{
+ void *ret;
+
+ hybris_trace_begin("egl", "android_dlsym", sym);
+ ret = (void *) android_dlsym(handle, sym);
+ hybris_trace_end("egl", "android_dlsym");
+ return ret;
+}
+
+#define EGL_DLSYM(fptr, sym) do { if (_libegl == NULL) { _init_androidegl(); }; if (*(fptr) == NULL) { *(fptr) = _egl_dlsym(_libegl, sym); } } while (0) 
 
-#define UI_DLSYM(fptr, sym) do { if (_libui == NULL) { _init_androidui(); }; if (*(fptr) == NULL) { *(fptr) = (void *) android_dlsym(_libui, sym); } } while (0) 
+#define UI_DLSYM(fptr, sym) do { if (_libui == NULL) { _init_androidui(); }; if (*(fptr) == NULL) { *(fptr) = _egl_dlsym(_libui, sym); } } while (0) 
 
 EGLint eglGetError(void)
 {
@@ -22,6 +22,8 @@
 #include <dlfcn.h>
 #include <stddef.h>
 
+#include "linker_trace.h"
+
 #ifdef __ARM_PCS_VFP
 #define FP_ATTRIB __attribute__((pcs("aapcs")))
 #else
@@ -180,7 +182,17 @@ static void _init_androidglesv2()
 }
 
 
-#define GLES2_DLSYM(sym) do { if (_libglesv2 == NULL) { _init_androidglesv2(); }; if (*(_ ## sym) == NULL) { *(&_ ## sym) = (void *) android_dlsym(_libglesv2, #sym); } } while (0) 
+static void *_gles2_dlsym(const char *sym)
+{
+ void *ret;
+
+ hybris_trace_begin("gles2", "android_dlsym", sym);
+ ret = (void *) android_dlsym(_libglesv2, sym);
+ hybris_trace_end("gles2", "android_dlsym");
+ return ret;
+}
+
+#define GLES2_DLSYM(sym) do { if (_libglesv2 == NULL) { _init_androidglesv2(); }; if (*(_ ## sym) == NULL) { *(&_ ## sym) = _gles2_dlsym(#sym); } } while (0) 
 
 void         glActiveTexture (GLenum texture)
 {
@@ -31,8 +31,9 @@
 #define DL_ERR_SYMBOL_NOT_FOUND       4
 #define DL_ERR_SYMBOL_NOT_GLOBAL      5
 
-static char dl_err_buf[1024];
-static const char *dl_err_str;
+/* As with glibc and bionic, each thread sees the errors of its own calls */
+static __thread char dl_err_buf[1024];
+static __thread const char *dl_err_str;
 
 static const char *dl_errors[] = {
     [DL_ERR_CANNOT_LOAD_LIBRARY] = "Cannot load library",
@@ -45,7 +46,32 @@ static const char *dl_errors[] = {
 #define likely(expr)   __builtin_expect (expr, 1)
 #define unlikely(expr) __builtin_expect (expr, 0)
 
-static pthread_mutex_t dl_lock = PTHREAD_MUTEX_INITIALIZER;
+/* dlopen() and dlclose() hold dl_rwlock for writing, lookups hold it for
+ * reading. dl_writer_depth counts how many times the calling thread has
+ * taken it exclusively, so that it can be taken again from constructors. */
+static pthread_rwlock_t dl_rwlock = PTHREAD_RWLOCK_INITIALIZER;
+static __thread int dl_writer_depth;
+
+void dl_lock_exclusive(void)
+{
+    if (dl_writer_depth++ == 0)
+        pthread_rwlock_wrlock(&dl_rwlock);
+}
+
+void dl_lock_shared(void)
+{
+    if (dl_writer_depth > 0)
+        dl_writer_depth++;
+    else
+        pthread_rwlock_rdlock(&dl_rwlock);
+}
+
+void dl_unlock(void)
+{
+    if (dl_writer_depth > 0 && --dl_writer_depth > 0)
+        return;
+    pthread_rwlock_unlock(&dl_rwlock);
+}
 
 static void set_dlerror(int err)
 {
@@ -58,14 +84,14 @@ void *android_dlopen(const char *filename, int flag)
 {
     soinfo *ret;
 
-    pthread_mutex_lock(&dl_lock);
+    dl_lock_exclusive();
     ret = find_library(filename);
     if (unlikely(ret == NULL)) {
         set_dlerror(DL_ERR_CANNOT_LOAD_LIBRARY);
     } else {
         ret->refcount++;
     }
-    pthread_mutex_unlock(&dl_lock);
+    dl_unlock();
     return ret;
 }
 
@@ -82,7 +108,7 @@ void *android_dlsym(void *handle, const char *symbol)
     Elf_Sym *sym;
     unsigned bind;
 
-    pthread_mutex_lock(&dl_lock);
+    dl_lock_shared();
 
     if(unlikely(handle == 0)) { 
         set_dlerror(DL_ERR_INVALID_LIBRARY_HANDLE);
@@ -113,7 +139,7 @@ void *android_dlsym(void *handle, const char *symbol)
 
         if(likely((bind == STB_GLOBAL) && (sym->st_shndx != 0))) {
             unsigned ret = sym->st_value + found->base;
-            pthread_mutex_unlock(&dl_lock);
+            dl_unlock();
             return (void*)ret;
         }
 
@@ -123,7 +149,7 @@ void *android_dlsym(void *handle, const char *symbol)
         set_dlerror(DL_ERR_SYMBOL_NOT_FOUND);
 
 err:
-    pthread_mutex_unlock(&dl_lock);
+    dl_unlock();
     return 0;
 }
 
@@ -131,7 +157,7 @@ int android_dladdr(const void *addr, Dl_info *info)
 {
     int ret = 0;
 
-    pthread_mutex_lock(&dl_lock);
+    dl_lock_shared();
 
     /* Determine if this address can be found in any library currently mapped */
     soinfo *si = find_containing_library(addr);
@@ -153,16 +179,16 @@ int android_dladdr(const void *addr, Dl_info *info)
         ret = 1;
     }
 
-    pthread_mutex_unlock(&dl_lock);
+    dl_unlock();
 
     return ret;
 }
 
 int android_dlclose(void *handle)
 {
-    pthread_mutex_lock(&dl_lock);
+    dl_lock_exclusive();
     (void)unload_library((soinfo*)handle);
-    pthread_mutex_unlock(&dl_lock);
+    dl_unlock();
     return 0;
 }
 
@@ -268,7 +294,7 @@ static unsigned libdl_chains[7] = { 0, 2, 3, 4, 5, 6, 0 };
 
 soinfo libdl_info = {
     name: "libdl.so",
-    flags: FLAG_LINKED,
+    flags: FLAG_LINKED | FLAG_SYMCACHE,
 
     strtab: ANDROID_LIBDL_STRTAB,
     symtab: libdl_symtab,
@@ -26,6 +26,7 @@
  * SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
 #include <linux/auxvec.h>
 
 #include <stdio.h>
@@ -36,8 +37,10 @@
 #include <errno.h>
 #include <dlfcn.h>
 #include <sys/stat.h>
+#include <limits.h>
 
 #include <pthread.h>
+#include <sched.h>
 
 #include <sys/mman.h>
 
@@ -48,9 +51,15 @@
 #include "linker_debug.h"
 #include "linker_environ.h"
 #include "linker_format.h"
+#include "linker_objects.h"
+#include "linker_reloc.h"
 
 #define ALLOW_SYMBOLS_FROM_MAIN 1
-#define SO_MAX 128
+
+/* soinfo records come from mmap()ed slabs of this many entries */
+#define SOINFO_PER_SLAB 32
+/* Buckets in the basename -> soinfo index used by find_library() */
+#define SONAME_HASH_SIZE 256
 
 /* Assume average path length of 64 and max 8 paths */
 #define LDPATH_BUFSIZE 512
@@ -82,9 +91,24 @@
 
 static int link_image(soinfo *si, unsigned wr_offset);
 
-static int socount = 0;
-static soinfo sopool[SO_MAX];
+/* common/hooks.c */
+extern void *get_hooked_symbol(char *sym);
+
+struct soinfo_slab {
+    struct soinfo_slab *next;
+    unsigned used;
+    soinfo info[SOINFO_PER_SLAB];
+};
+
+static struct soinfo_slab *soslabs = NULL;
 static soinfo *freelist = NULL;
+static soinfo *soname_hash[SONAME_HASH_SIZE];
+
+/* Guards the parallel loading jobs (see load_job_queue()) and, since the
+ * loader threads look names up in it, changes to soname_hash. The thread
+ * holding the dl lock is the only one to change it, so it reads it
+ * without. */
+static pthread_mutex_t load_job_lock = PTHREAD_MUTEX_INITIALIZER;
 static soinfo *solist = &libdl_info;
 static soinfo *sonext = &libdl_info;
 #if ALLOW_SYMBOLS_FROM_MAIN
@@ -94,8 +118,15 @@ static soinfo *somain; /* main process, always the one after libdl_info */
 
 static inline int validate_soinfo(soinfo *si)
 {
-    return (si >= sopool && si < sopool + SO_MAX) ||
-        si == &libdl_info;
+    struct soinfo_slab *slab;
+
+    if (si == &libdl_info)
+        return 1;
+    for (slab = soslabs; slab != NULL; slab = slab->next) {
+        if (si >= slab->info && si < slab->info + slab->used)
+            return 1;
+    }
+    return 0;
 }
 
 static char ldpaths_buf[LDPATH_BUFSIZE];
@@ -116,9 +147,17 @@ static int pid;
 /* This boolean is set if the program being loaded is setuid */
 static int program_is_setuid;
 
-#if STATS
-struct _link_stats linker_stats;
-#endif
+/* Set from HYBRIS_LD_BIND_LAZY, see setup_lazy_plt() */
+static int bind_lazy;
+
+/* Set from HYBRIS_LD_CACHE_DIR, see ldcache_open() */
+static const char *ldcache_dir;
+
+/* Set from HYBRIS_LD_RELRO_DIR, see relro_share() */
+static const char *relro_dir;
+
+/* Set from HYBRIS_PERF_MAP, see perf_map_add() */
+static int perf_map;
 
 #if COUNT_PAGES
 unsigned bitmask[4096];
@@ -129,9 +168,16 @@ unsigned bitmask[4096];
 #endif
 
 static char tmp_err_buf[768];
-static char __linker_dl_err_buf[768];
+/* Per thread, so that a failing dlsym() doesn't report another thread's
+ * error */
+static __thread char __linker_dl_err_buf[768];
+/* Set in the loader threads, see load_worker(). Their errors are reported
+ * when the library is loaded again by the thread that needs it. */
+static __thread int dl_err_quiet;
 #define DL_ERR(fmt, x...)                                                     \
     do {                                                                      \
+        if (dl_err_quiet)                                                     \
+            break;                                                            \
         format_buffer(__linker_dl_err_buf, sizeof(__linker_dl_err_buf),            \
                  "%s[%d]: " fmt, __func__, __LINE__, ##x);                    \
         ERROR(fmt "\n", ##x);                                                      \
@@ -241,6 +287,529 @@ void notify_gdb_of_libraries()
     rtld_db_dlactivity();
 }
 
+/* Host tools (perf, unwinders) only see what glibc loaded; tell them about
+ * our objects too. See linker_objects.h. */
+#ifndef PT_GNU_EH_FRAME
+#define PT_GNU_EH_FRAME 0x6474e550
+#endif
+
+#define OBJECT_CALLBACKS_MAX 8
+
+static struct {
+    hybris_object_callback cb;
+    void *data;
+} object_callbacks[OBJECT_CALLBACKS_MAX];
+static int object_callback_count;
+
+static int is_host_visible(soinfo *si)
+{
+    return si != &libdl_info && !(si->flags & FLAG_EXE) &&
+           (si->flags & FLAG_LINKED);
+}
+
+static void get_object_info(soinfo *si, struct hybris_object_info *info)
+{
+    const Elf_Phdr *phdr = si->phdr;
+    int i;
+
+    memset(info, 0, sizeof(*info));
+    info->name = si->name;
+    info->base = si->base;
+    info->phdr = si->phdr;
+    info->phnum = si->phnum;
+    for (i = 0; i < si->phnum; i++, phdr++) {
+        if (phdr->p_type == PT_LOAD && (phdr->p_flags & PF_X)) {
+            if (info->text_end == 0 ||
+                si->base + phdr->p_vaddr < info->text_start)
+                info->text_start = si->base + phdr->p_vaddr;
+            if (si->base + phdr->p_vaddr + phdr->p_memsz > info->text_end)
+                info->text_end = si->base + phdr->p_vaddr + phdr->p_memsz;
+        } else if (phdr->p_type == PT_GNU_EH_FRAME)
+            info->eh_frame_hdr = (void *)(si->base + phdr->p_vaddr);
+    }
+#ifdef ANDROID_ARM_LINKER
+    if (si->ARM_exidx) {
+        info->exidx = (void *)(si->base + (unsigned)si->ARM_exidx);
+        info->exidx_count = si->ARM_exidx_count;
+    }
+#endif
+}
+
+static void notify_object_callbacks(soinfo *si, int loaded)
+{
+    struct hybris_object_info info;
+    int i;
+
+    if (object_callback_count == 0)
+        return;
+    get_object_info(si, &info);
+    for (i = 0; i < object_callback_count; i++)
+        object_callbacks[i].cb(&info, loaded, object_callbacks[i].data);
+}
+
+int hybris_register_object_callback(hybris_object_callback cb, void *data)
+{
+    struct hybris_object_info info;
+    soinfo *si;
+    int ret = -1;
+
+    dl_lock_exclusive();
+    if (object_callback_count < OBJECT_CALLBACKS_MAX) {
+        object_callbacks[object_callback_count].cb = cb;
+        object_callbacks[object_callback_count].data = data;
+        object_callback_count++;
+        for (si = solist; si != NULL; si = si->next) {
+            if (!is_host_visible(si))
+                continue;
+            get_object_info(si, &info);
+            cb(&info, 1, data);
+        }
+        ret = 0;
+    }
+    dl_unlock();
+    return ret;
+}
+
+int hybris_dl_iterate_phdr(int (*cb)(struct dl_phdr_info *info, size_t size,
+                                     void *data), void *data)
+{
+    struct dl_phdr_info dl_info;
+    soinfo *si;
+    int rv = 0;
+
+    dl_lock_shared();
+    for (si = solist; si != NULL; si = si->next) {
+        if (!is_host_visible(si))
+            continue;
+        dl_info.dlpi_addr = si->base;
+        dl_info.dlpi_name = si->name;
+        dl_info.dlpi_phdr = si->phdr;
+        dl_info.dlpi_phnum = si->phnum;
+        rv = cb(&dl_info, sizeof(dl_info), data);
+        if (rv != 0)
+            break;
+    }
+    dl_unlock();
+    return rv;
+}
+
+/* perf map
+ *
+ * perf names addresses in mappings it has no symbols for from
+ * /tmp/perf-<pid>.map, one "start size name" line per symbol. Libraries are
+ * appended as they are loaded; on unload the file is rewritten without the
+ * library, through a temporary file so perf never sees half of it.
+ *
+ * Both paths are predictable and in a world writable directory, so
+ * neither is opened through a symlink or used if someone else owns it,
+ * and setuid programs don't write a map at all.
+ */
+struct perf_map_out {
+    int fd;
+    int len;
+    char buf[4096];
+};
+
+static void perf_map_flush(struct perf_map_out *out)
+{
+    if (out->len > 0)
+        write(out->fd, out->buf, out->len);
+    out->len = 0;
+}
+
+static void perf_map_write_library(struct perf_map_out *out, soinfo *si)
+{
+    Elf_Sym *s;
+    unsigned i;
+    int len;
+
+    for (i = 1; i < si->nchain; i++) {
+        s = si->symtab + i;
+        if (s->st_shndx == SHN_UNDEF || s->st_size == 0 ||
+            ELF32_ST_TYPE(s->st_info) != STT_FUNC)
+            continue;
+        if (out->len > (int)sizeof(out->buf) - 256)
+            perf_map_flush(out);
+        /* The Thumb bit isn't part of the address */
+        len = format_buffer(out->buf + out->len, sizeof(out->buf) - out->len,
+                            "%x %x %s\n", (si->base + s->st_value) & ~1,
+                            s->st_size, si->strtab + s->st_name);
+        if (len < (int)sizeof(out->buf) - out->len)
+            out->len += len;
+    }
+}
+
+static void perf_map_path(char *path, size_t size, const char *suffix)
+{
+    format_buffer(path, size, "/tmp/perf-%d.map%s", getpid(), suffix);
+}
+
+static void perf_map_add(soinfo *si)
+{
+    struct perf_map_out out;
+    struct stat st;
+    char path[64];
+
+    perf_map_path(path, sizeof(path), "");
+    out.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_NOFOLLOW, 0644);
+    if (out.fd < 0)
+        return;
+    if (fstat(out.fd, &st) < 0 || st.st_uid != geteuid()) {
+        close(out.fd);
+        return;
+    }
+    out.len = 0;
+    perf_map_write_library(&out, si);
+    perf_map_flush(&out);
+    close(out.fd);
+}
+
+static void perf_map_remove(soinfo *gone)
+{
+    struct perf_map_out out;
+    char path[64], tmp[64];
+    soinfo *si;
+
+    perf_map_path(path, sizeof(path), "");
+    perf_map_path(tmp, sizeof(tmp), ".tmp");
+    /* A temporary file left behind by a crash of ours can go; anyone
+     * else's stays, and makes the O_EXCL open fail. */
+    unlink(tmp);
+    out.fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0644);
+    if (out.fd < 0)
+        return;
+    out.len = 0;
+    for (si = solist; si != NULL; si = si->next) {
+        if (si != gone && is_host_visible(si))
+            perf_map_write_library(&out, si);
+    }
+    perf_map_flush(&out);
+    close(out.fd);
+    if (rename(tmp, path) < 0)
+        unlink(tmp);
+}
+
+static void notify_host_of_load(soinfo *si)
+{
+    if (!is_host_visible(si))
+        return;
+    if (perf_map && !program_is_setuid)
+        perf_map_add(si);
+    notify_object_callbacks(si, 1);
+}
+
+static void notify_host_of_unload(soinfo *si)
+{
+    if (!is_host_visible(si))
+        return;
+    notify_object_callbacks(si, 0);
+    if (perf_map && !program_is_setuid)
+        perf_map_remove(si);
+}
+
+/* Index of solist by name, so that find_library() doesn't have to strcmp
+ * its way through every loaded library. libdl_info is added the first time
+ * the index is used, since it isn't allocated through alloc_info(). */
+static unsigned elfhash(const char *name);
+
+static void soname_insert(soinfo *si)
+{
+    unsigned h = elfhash(si->name) % SONAME_HASH_SIZE;
+
+    si->name_next = soname_hash[h];
+    soname_hash[h] = si;
+}
+
+static void soname_init(void)
+{
+    static int done;
+
+    if (!done) {
+        soname_insert(&libdl_info);
+        done = 1;
+    }
+}
+
+static void soname_remove(soinfo *si)
+{
+    soinfo **p = &soname_hash[elfhash(si->name) % SONAME_HASH_SIZE];
+
+    for (; *p != NULL; p = &(*p)->name_next) {
+        if (*p == si) {
+            *p = si->name_next;
+            break;
+        }
+    }
+    si->name_next = NULL;
+}
+
+static soinfo *soname_lookup(const char *name)
+{
+    soinfo *si;
+
+    soname_init();
+    for (si = soname_hash[elfhash(name) % SONAME_HASH_SIZE]; si != NULL;
+         si = si->name_next) {
+        if (!strcmp(name, si->name))
+            return si;
+    }
+    return NULL;
+}
+
+/* Address index
+ *
+ * The [base, base + size) ranges of the loaded objects sorted by base, so
+ * that find_containing_library(), addr_to_name() and dl_unwind_find_exidx()
+ * are a binary search instead of a walk of solist; the unwinder asks for
+ * every frame. Updated by link_image() and free_info() under the exclusive
+ * dl lock. Objects don't overlap, so there is at most one candidate: the
+ * last range starting at or below the address.
+ *
+ * addr_to_name() and dl_unwind_find_exidx() don't take the dl lock: an
+ * exception thrown while dlopen() runs constructors must not wait for
+ * them. They read the index under addr_index_seq instead, which writers
+ * make odd while they change it, and retry if it moved. The count is
+ * published after the array it fits in, and arrays that were grown out of
+ * are never unmapped, so a reader racing with a writer never reads out of
+ * bounds, only something it then throws away.
+ */
+struct addr_range {
+    unsigned start;
+    unsigned size;
+    soinfo *si;
+};
+
+static struct addr_range * volatile addr_index;
+static volatile unsigned addr_index_count;
+static unsigned addr_index_alloc;
+static volatile unsigned addr_index_seq;
+
+/* Index of the last range starting at or below addr in the count ranges,
+ * or -1 */
+static int addr_index_find(const struct addr_range *ranges, unsigned count,
+                           unsigned addr)
+{
+    int lo = 0, hi = (int)count - 1, mid, found = -1;
+
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        if (ranges[mid].start <= addr) {
+            found = mid;
+            lo = mid + 1;
+        } else
+            hi = mid - 1;
+    }
+    return found;
+}
+
+static soinfo *addr_index_lookup(unsigned addr)
+{
+    unsigned count = addr_index_count;
+    const struct addr_range *ranges;
+    int i;
+
+    __sync_synchronize();
+    ranges = addr_index;
+    i = addr_index_find(ranges, count, addr);
+    if (i >= 0 && addr - ranges[i].start < ranges[i].size)
+        return ranges[i].si;
+    return NULL;
+}
+
+/* For readers without the dl lock: whatever they read between
+ * addr_index_read_begin() and a false addr_index_read_retry() was
+ * consistent. */
+static unsigned addr_index_read_begin(void)
+{
+    unsigned seq;
+
+    while ((seq = addr_index_seq) & 1)
+        sched_yield();
+    __sync_synchronize();
+    return seq;
+}
+
+static int addr_index_read_retry(unsigned seq)
+{
+    __sync_synchronize();
+    return addr_index_seq != seq;
+}
+
+static void addr_index_write_begin(void)
+{
+    addr_index_seq++;
+    __sync_synchronize();
+}
+
+static void addr_index_write_end(void)
+{
+    __sync_synchronize();
+    addr_index_seq++;
+}
+
+static int addr_index_insert(soinfo *si)
+{
+    struct addr_range *ranges;
+    unsigned alloc;
+    int i;
+
+    if (si->size == 0)
+        return 0;
+
+    if (addr_index_count == addr_index_alloc) {
+        alloc = addr_index_alloc ? addr_index_alloc * 2
+                                 : PAGE_SIZE / sizeof(struct addr_range);
+        ranges = mmap(NULL, alloc * sizeof(struct addr_range),
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1, 0);
+        if (ranges == MAP_FAILED) {
+            DL_ERR("%5d cannot grow the address index for %s: %d (%s)",
+                   pid, si->name, errno, strerror(errno));
+            return -1;
+        }
+        /* The old array stays mapped for the readers still in it */
+        if (addr_index)
+            memcpy(ranges, addr_index,
+                   addr_index_count * sizeof(struct addr_range));
+        __sync_synchronize();
+        addr_index = ranges;
+        addr_index_alloc = alloc;
+    }
+
+    addr_index_write_begin();
+    i = addr_index_find(addr_index, addr_index_count, si->base) + 1;
+    memmove(&addr_index[i + 1], &addr_index[i],
+            (addr_index_count - i) * sizeof(struct addr_range));
+    addr_index[i].start = si->base;
+    addr_index[i].size = si->size;
+    addr_index[i].si = si;
+    __sync_synchronize();
+    addr_index_count++;
+    addr_index_write_end();
+    return 0;
+}
+
+static void addr_index_remove(soinfo *si)
+{
+    int i = addr_index_find(addr_index, addr_index_count, si->base);
+
+    if (i < 0 || addr_index[i].si != si)
+        return;
+    addr_index_write_begin();
+    memmove(&addr_index[i], &addr_index[i + 1],
+            (addr_index_count - i - 1) * sizeof(struct addr_range));
+    addr_index_count--;
+    addr_index_write_end();
+}
+
+/* Symbol address index
+ *
+ * For dladdr(): the defined symbols of a library with a size, sorted by
+ * st_value. end is the highest st_value + st_size of this entry and all
+ * the ones before it, which bounds how far back a containing symbol can
+ * start. Built on first use; dladdr() only holds the dl lock shared, so
+ * building is serialized by symaddr_lock and the result published after a
+ * barrier. Freed by free_info().
+ */
+struct symaddr {
+    unsigned start;
+    unsigned end;
+    unsigned sym;
+};
+
+static pthread_mutex_t symaddr_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Heapsort by start; qsort() may malloc() */
+static void symaddr_sift(struct symaddr *sa, unsigned root, unsigned n)
+{
+    struct symaddr tmp;
+    unsigned child;
+
+    while ((child = 2 * root + 1) < n) {
+        if (child + 1 < n && sa[child + 1].start > sa[child].start)
+            child++;
+        if (sa[root].start >= sa[child].start)
+            return;
+        tmp = sa[root];
+        sa[root] = sa[child];
+        sa[child] = tmp;
+        root = child;
+    }
+}
+
+static void symaddr_sort(struct symaddr *sa, unsigned n)
+{
+    struct symaddr tmp;
+    unsigned i;
+
+    for (i = n / 2; i > 0; i--)
+        symaddr_sift(sa, i - 1, n);
+    for (i = n; i > 1; i--) {
+        tmp = sa[0];
+        sa[0] = sa[i - 1];
+        sa[i - 1] = tmp;
+        symaddr_sift(sa, 0, i - 1);
+    }
+}
+
+static struct symaddr *symaddr_build(soinfo *si, unsigned *count)
+{
+    struct symaddr *sa;
+    unsigned i, n = 0, end = 0;
+    Elf_Sym *sym;
+
+    for (i = 0; i < si->nchain; i++) {
+        sym = &si->symtab[i];
+        if (sym->st_shndx != SHN_UNDEF && sym->st_size != 0)
+            n++;
+    }
+    if (n == 0)
+        return NULL;
+
+    sa = mmap(NULL, n * sizeof(struct symaddr), PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (sa == MAP_FAILED)
+        return NULL;
+
+    for (i = 0, n = 0; i < si->nchain; i++) {
+        sym = &si->symtab[i];
+        if (sym->st_shndx == SHN_UNDEF || sym->st_size == 0)
+            continue;
+        sa[n].start = sym->st_value;
+        sa[n].sym = i;
+        n++;
+    }
+    symaddr_sort(sa, n);
+    for (i = 0; i < n; i++) {
+        sym = &si->symtab[sa[i].sym];
+        if (sym->st_value + sym->st_size > end)
+            end = sym->st_value + sym->st_size;
+        sa[i].end = end;
+    }
+
+    *count = n;
+    return sa;
+}
+
+static struct symaddr *symaddr_index(soinfo *si, unsigned *count)
+{
+    struct symaddr *sa = si->symaddr;
+
+    if (sa == NULL) {
+        pthread_mutex_lock(&symaddr_lock);
+        sa = si->symaddr;
+        if (sa == NULL && (sa = symaddr_build(si, count)) != NULL) {
+            si->symaddr_count = *count;
+            __sync_synchronize();
+            si->symaddr = sa;
+        }
+        pthread_mutex_unlock(&symaddr_lock);
+    }
+    __sync_synchronize();
+    *count = si->symaddr_count;
+    return sa;
+}
+
 static soinfo *alloc_info(const char *name)
 {
     soinfo *si;
@@ -254,11 +823,21 @@ static soinfo *alloc_info(const char *name)
        done only by dlclose(), which is not likely to be used.
     */
     if (!freelist) {
-        if(socount == SO_MAX) {
-            DL_ERR("%5d too many libraries when loading %s", pid, name);
-            return NULL;
+        if (soslabs == NULL || soslabs->used == SOINFO_PER_SLAB) {
+            struct soinfo_slab *slab;
+            slab = mmap(NULL, sizeof(struct soinfo_slab),
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (slab == MAP_FAILED) {
+                DL_ERR("%5d cannot allocate soinfo for %s: %d (%s)",
+                       pid, name, errno, strerror(errno));
+                return NULL;
+            }
+            slab->next = soslabs;
+            slab->used = 0;
+            soslabs = slab;
         }
-        freelist = sopool + socount++;
+        freelist = soslabs->info + soslabs->used++;
         freelist->next = NULL;
     }
 
@@ -272,6 +851,9 @@ static soinfo *alloc_info(const char *name)
     si->next = NULL;
     si->refcount = 0;
     sonext = si;
+    pthread_mutex_lock(&load_job_lock);
+    soname_insert(si);
+    pthread_mutex_unlock(&load_job_lock);
 
     TRACE("%5d name %s: allocated soinfo @ %p\n", pid, name, si);
     return si;
@@ -299,21 +881,31 @@ static void free_info(soinfo *si)
     */
     prev->next = si->next;
     if (si == sonext) sonext = prev;
+    pthread_mutex_lock(&load_job_lock);
+    soname_remove(si);
+    pthread_mutex_unlock(&load_job_lock);
+    addr_index_remove(si);
+    if (si->symaddr)
+        munmap(si->symaddr, si->symaddr_count * sizeof(struct symaddr));
+    if (si->scope && si->scope != si->scope_buf)
+        munmap(si->scope, si->scope_count * sizeof(soinfo *));
     si->next = freelist;
     freelist = si;
 }
 
 const char *addr_to_name(unsigned addr)
 {
+    const char *name;
+    unsigned seq;
     soinfo *si;
 
-    for(si = solist; si != 0; si = si->next){
-        if((addr >= si->base) && (addr < (si->base + si->size))) {
-            return si->name;
-        }
-    }
+    do {
+        seq = addr_index_read_begin();
+        si = addr_index_lookup(addr);
+        name = si ? si->name : "";
+    } while (addr_index_read_retry(seq));
 
-    return "";
+    return name;
 }
 
 /* For a given PC, find the .so that it belongs to.
@@ -330,15 +922,25 @@ _Unwind_Ptr android_dl_unwind_find_exidx(_Unwind_Ptr pc, int *pcount)
 {
     soinfo *si;
     unsigned addr = (unsigned)pc;
-
-    for (si = solist; si != 0; si = si->next){
-        if ((addr >= si->base) && (addr < (si->base + si->size))) {
-            *pcount = si->ARM_exidx_count;
-            return (_Unwind_Ptr)(si->base + (unsigned long)si->ARM_exidx);
+    _Unwind_Ptr exidx;
+    unsigned seq;
+    int count;
+
+    /* Without the dl lock, see "Address index" */
+    do {
+        seq = addr_index_read_begin();
+        si = addr_index_lookup(addr);
+        if (si) {
+            count = si->ARM_exidx_count;
+            exidx = (_Unwind_Ptr)(si->base + (unsigned long)si->ARM_exidx);
+        } else {
+            count = 0;
+            exidx = NULL;
         }
-    }
-   *pcount = 0;
-    return NULL;
+    } while (addr_index_read_retry(seq));
+
+    *pcount = count;
+    return exidx;
 }
 #elif defined(ANDROID_X86_LINKER)
 /* Here, we only have to provide a callback to iterate across all the
@@ -364,7 +966,7 @@ android_dl_iterate_phdr(int (*cb)(struct dl_phdr_info *info, size_t size, void *
 }
 #endif
 
-static Elf_Sym *_elf_lookup(soinfo *si, unsigned hash, const char *name)
+static Elf_Sym *_elf_lookup_sysv(soinfo *si, unsigned hash, const char *name)
 {
     Elf_Sym *s;
     Elf_Sym *symtab = si->symtab;
@@ -395,6 +997,61 @@ static Elf_Sym *_elf_lookup(soinfo *si, unsigned hash, const char *name)
     return NULL;
 }
 
+/* DT_GNU_HASH lookup. The bloom filter rejects most symbols that are not
+ * defined in this library without touching the hash table at all, and the
+ * chain stores the upper 31 bits of each symbol's hash so that strcmp() is
+ * only reached for a likely match. */
+static Elf_Sym *_elf_lookup_gnu(soinfo *si, unsigned hash, const char *name)
+{
+    Elf_Sym *s;
+    Elf_Sym *symtab = si->symtab;
+    const char *strtab = si->strtab;
+    unsigned h2 = hash >> si->gnu_shift2;
+    unsigned bloom_word = si->gnu_bloom_filter[(hash / 32) & si->gnu_maskwords];
+    unsigned n;
+
+    TRACE_TYPE(LOOKUP, "%5d SEARCH %s in %s@0x%08x %08x %d (gnu)\n", pid,
+               name, si->name, si->base, hash, hash % si->gnu_nbucket);
+
+    if (((bloom_word >> (hash % 32)) & (bloom_word >> (h2 % 32)) & 1) == 0)
+        return NULL;
+
+    n = si->gnu_bucket[hash % si->gnu_nbucket];
+    if (n == 0)
+        return NULL;
+
+    do {
+        if (((si->gnu_chain[n] ^ hash) >> 1) != 0)
+            continue;
+
+        s = symtab + n;
+        if(strcmp(strtab + s->st_name, name)) continue;
+
+            /* only concern ourselves with global and weak symbol definitions */
+        switch(ELF32_ST_BIND(s->st_info)){
+        case STB_GLOBAL:
+        case STB_WEAK:
+                /* no section == undefined */
+            if(s->st_shndx == 0) continue;
+
+            TRACE_TYPE(LOOKUP, "%5d FOUND %s in %s (%08x) %d\n", pid,
+                       name, si->name, s->st_value, s->st_size);
+            return s;
+        }
+    } while ((si->gnu_chain[n++] & 1) == 0);
+
+    return NULL;
+}
+
+static Elf_Sym *_elf_lookup(soinfo *si, unsigned elf_hash, unsigned gnu_hash,
+                            const char *name)
+{
+    if (si->flags & FLAG_GNU_HASH)
+        return _elf_lookup_gnu(si, gnu_hash, name);
+
+    return _elf_lookup_sysv(si, elf_hash, name);
+}
+
 static unsigned elfhash(const char *_name)
 {
     const unsigned char *name = (const unsigned char *) _name;
@@ -409,63 +1066,359 @@ static unsigned elfhash(const char *_name)
     return h;
 }
 
-static Elf_Sym *
-_do_lookup(soinfo *si, const char *name, unsigned *base)
+static unsigned gnuhash(const char *_name)
 {
-    unsigned elf_hash = elfhash(name);
-    Elf_Sym *s;
-    unsigned *d;
-    soinfo *lsi = si;
-    int i;
+    const unsigned char *name = (const unsigned char *) _name;
+    unsigned h = 5381;
 
-    /* Look for symbols in the local scope first (the object who is
-     * searching). This happens with C++ templates on i386 for some
-     * reason.
-     *
-     * Notes on weak symbols:
-     * The ELF specs are ambigious about treatment of weak definitions in
-     * dynamic linking.  Some systems return the first definition found
-     * and some the first non-weak definition.   This is system dependent.
-     * Here we return the first definition found for simplicity.  */
-    s = _elf_lookup(si, elf_hash, name);
-    if(s != NULL)
-        goto done;
+    while(*name)
+        h += (h << 5) + *name++; /* h * 33 + c */
+    return h;
+}
+
+/* Process-wide symbol resolution cache.
+ *
+ * The same names (memcpy, pthread_mutex_lock, the GL entry points, ...) are
+ * looked up again by every library that imports them. The cache maps an
+ * interned symbol name to every loaded library that defines it, together
+ * with the Elf_Sym that _elf_lookup() returns for it there. Resolving a
+ * symbol for a given lookup scope is then a matter of finding the first
+ * scope entry that appears in that (usually one element) list, so results
+ * still depend on the scope of the library asking.
+ *
+ * Libraries enter the cache through symcache_register() once their dynamic
+ * section has been parsed (libdl_info is flagged statically). Their
+ * definitions of names that are already cached are appended at that point,
+ * and names cached later probe every registered library. unload_library()
+ * flushes the whole cache.
+ *
+ * Only relocations use the cache, and they run with the dl lock held
+ * exclusively, so it needs no lock of its own. dlsym() holds the dl lock
+ * shared and linker_plt_bind() not at all; they walk the libraries instead.
+ * HYBRIS_LD_SYMCACHE=0 turns the cache off, to compare.
+ *
+ * Everything lives in anonymous mappings since the linker can't malloc().
+ */
+#define SYMCACHE_MIN_SIZE     1024
+#define SYMCACHE_CHUNK_SIZE   (64 * 1024)
+
+struct symcache_def {
+    soinfo *si;
+    Elf_Sym *sym;
+    struct symcache_def *next;
+};
+
+struct symcache_entry {
+    const char *name;           /* NULL for an empty slot */
+    unsigned hash;              /* gnuhash(name) */
+    struct symcache_def *defs;
+};
+
+struct symcache_chunk {
+    struct symcache_chunk *next;
+    unsigned used;
+};
+
+static struct symcache_entry *symcache;
+static unsigned symcache_size;
+static unsigned symcache_count;
+static struct symcache_chunk *symcache_chunks;
+static int symcache_enabled = 1;
 
-    /* Next, look for it in the preloads list */
-    for(i = 0; preloads[i] != NULL; i++) {
-        lsi = preloads[i];
-        s = _elf_lookup(lsi, elf_hash, name);
-        if(s != NULL)
-            goto done;
+static void *symcache_alloc(unsigned size)
+{
+    struct symcache_chunk *chunk = symcache_chunks;
+    void *ret;
+
+    size = (size + 3) & ~3;
+    if (size > SYMCACHE_CHUNK_SIZE - sizeof(struct symcache_chunk))
+        return NULL;
+
+    if (chunk == NULL || chunk->used + size > SYMCACHE_CHUNK_SIZE) {
+        chunk = mmap(NULL, SYMCACHE_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk == MAP_FAILED)
+            return NULL;
+        chunk->next = symcache_chunks;
+        chunk->used = sizeof(struct symcache_chunk);
+        symcache_chunks = chunk;
     }
 
-    for(d = si->dynamic; *d; d += 2) {
-        if(d[0] == DT_NEEDED){
-            lsi = (soinfo *)d[1];
-            if (!validate_soinfo(lsi)) {
-                DL_ERR("%5d bad DT_NEEDED pointer in %s",
-                       pid, si->name);
-                return NULL;
-            }
+    ret = (char *)chunk + chunk->used;
+    chunk->used += size;
+    return ret;
+}
+
+static void symcache_flush(void)
+{
+    struct symcache_chunk *chunk, *next;
+
+    for (chunk = symcache_chunks; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        munmap(chunk, SYMCACHE_CHUNK_SIZE);
+    }
+    symcache_chunks = NULL;
+
+    if (symcache)
+        munmap(symcache, symcache_size * sizeof(struct symcache_entry));
+    symcache = NULL;
+    symcache_size = 0;
+    symcache_count = 0;
+}
+
+static struct symcache_entry *
+symcache_slot(struct symcache_entry *table, unsigned size,
+              const char *name, unsigned hash)
+{
+    unsigned i = hash & (size - 1);
+
+    while (table[i].name != NULL) {
+        if (table[i].hash == hash && !strcmp(table[i].name, name))
+            break;
+        i = (i + 1) & (size - 1);
+    }
+    return &table[i];
+}
+
+/* Keeps the table at most half full. */
+static int symcache_grow(void)
+{
+    struct symcache_entry *table;
+    unsigned size = symcache_size ? symcache_size * 2 : SYMCACHE_MIN_SIZE;
+    unsigned i;
+
+    table = mmap(NULL, size * sizeof(struct symcache_entry),
+                 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED)
+        return -1;
+
+    for (i = 0; i < symcache_size; i++) {
+        if (symcache[i].name != NULL)
+            *symcache_slot(table, size, symcache[i].name,
+                           symcache[i].hash) = symcache[i];
+    }
+
+    if (symcache)
+        munmap(symcache, symcache_size * sizeof(struct symcache_entry));
+    symcache = table;
+    symcache_size = size;
+    return 0;
+}
+
+static int symcache_add_def(struct symcache_entry *e, soinfo *si, Elf_Sym *s)
+{
+    struct symcache_def *def, **tail;
+
+    for (tail = &e->defs; *tail != NULL; tail = &(*tail)->next) {
+        if ((*tail)->si == si)
+            return 0;
+    }
+
+    def = symcache_alloc(sizeof(*def));
+    if (def == NULL)
+        return -1;
+    def->si = si;
+    def->sym = s;
+    def->next = NULL;
+    *tail = def;
+    return 0;
+}
+
+/* Returns the cache entry for name, creating it by probing every registered
+ * library if needed. Returns NULL if we ran out of memory, in which case
+ * callers fall back to searching the libraries directly. */
+static struct symcache_entry *
+symcache_get(const char *name, unsigned elf_hash, unsigned gnu_hash)
+{
+    struct symcache_entry *e;
+    soinfo *si;
+    Elf_Sym *s;
+    char *copy;
+    unsigned len;
+
+    if (symcache_size) {
+        e = symcache_slot(symcache, symcache_size, name, gnu_hash);
+        if (e->name != NULL) {
+            COUNT_SYMCACHE_HIT();
+            return e;
+        }
+    }
+    COUNT_SYMCACHE_MISS();
+
+    if ((symcache_count + 1) * 2 > symcache_size && symcache_grow() < 0)
+        return NULL;
+
+    len = strlen(name) + 1;
+    copy = symcache_alloc(len);
+    if (copy == NULL)
+        return NULL;
+    memcpy(copy, name, len);
+
+    e = symcache_slot(symcache, symcache_size, name, gnu_hash);
+    e->name = copy;
+    e->hash = gnu_hash;
+    e->defs = NULL;
+    symcache_count++;
+
+    for (si = solist; si != NULL; si = si->next) {
+        /* Libraries that failed to link may already be unmapped. */
+        if (!(si->flags & FLAG_SYMCACHE) || (si->flags & FLAG_ERROR))
+            continue;
+        s = _elf_lookup(si, elf_hash, gnu_hash, name);
+        if (s != NULL && symcache_add_def(e, si, s) < 0) {
+            /* Don't keep an entry that misses a definition. Nothing was
+             * inserted after e, so its slot can be emptied without
+             * breaking any probe sequence. */
+            e->name = NULL;
+            symcache_count--;
+            return NULL;
+        }
+    }
+
+    return e;
+}
+
+/* Looks name up in the cache, adding it if needed, and stores the list of
+ * libraries that define it in *defs. Returns -1 if the cache can't be used.
+ * Callers hold the dl lock exclusively. */
+static int symcache_lookup(const char *name, unsigned elf_hash,
+                           unsigned gnu_hash, struct symcache_def **defs)
+{
+    struct symcache_entry *e;
+
+    if (!symcache_enabled)
+        return -1;
+    e = symcache_get(name, elf_hash, gnu_hash);
+    if (e != NULL)
+        *defs = e->defs;
+    return e != NULL ? 0 : -1;
+}
+
+static Elf_Sym *symcache_find_def(struct symcache_def *defs, soinfo *si)
+{
+    struct symcache_def *def;
+
+    for (def = defs; def != NULL; def = def->next) {
+        if (def->si == si)
+            return def->sym;
+    }
+    return NULL;
+}
+
+/* Makes the symbols defined by si visible to the cache. Called by
+ * link_image() once the symbol and hash tables have been located. */
+static void symcache_register(soinfo *si)
+{
+    struct symcache_entry *e;
+    Elf_Sym *s;
+    const char *name;
+    unsigned i;
+
+    si->flags |= FLAG_SYMCACHE;
+    if (symcache_count == 0)
+        return;
+
+    for (i = 1; i < si->nchain; i++) {
+        s = &si->symtab[i];
+        if (s->st_shndx == SHN_UNDEF)
+            continue;
+        if (ELF32_ST_BIND(s->st_info) != STB_GLOBAL &&
+            ELF32_ST_BIND(s->st_info) != STB_WEAK)
+            continue;
+
+        name = si->strtab + s->st_name;
+        e = symcache_slot(symcache, symcache_size, name, gnuhash(name));
+        if (e->name == NULL)
+            continue;
+
+        /* Let the hash table decide which of several definitions of the
+         * same name wins, exactly as an uncached lookup would. */
+        s = _elf_lookup(si, elfhash(name), e->hash, name);
+        if (s != NULL && symcache_add_def(e, si, s) < 0) {
+            symcache_flush();
+            return;
+        }
+    }
+}
+
+/* Search the lookup scope of si (see build_lookup_scope()) in order. A
+ * library that has not been linked yet has no scope; only search itself.
+ * The symbol cache is only used if use_cache is set, which needs the dl
+ * lock held exclusively.
+ *
+ * Notes on weak symbols:
+ * The ELF specs are ambigious about treatment of weak definitions in
+ * dynamic linking.  Some systems return the first definition found
+ * and some the first non-weak definition.   This is system dependent.
+ * Here we return the first definition found for simplicity.  */
+static Elf_Sym *
+_scope_lookup(soinfo *si, unsigned elf_hash, unsigned gnu_hash,
+              const char *name, soinfo **found, int use_cache)
+{
+    struct symcache_def *defs;
+    Elf_Sym *s;
+    soinfo *lsi;
+    unsigned i;
+    int cached;
+
+    if (si->scope_count == 0) {
+        *found = si;
+        return _elf_lookup(si, elf_hash, gnu_hash, name);
+    }
+
+    cached = use_cache &&
+             symcache_lookup(name, elf_hash, gnu_hash, &defs) == 0;
 
-            DEBUG("%5d %s: looking up %s in %s\n",
-                  pid, si->name, name, lsi->name);
-            s = _elf_lookup(lsi, elf_hash, name);
-            if ((s != NULL) && (s->st_shndx != SHN_UNDEF))
-                goto done;
+    for(i = 0; i < si->scope_count; i++) {
+        lsi = si->scope[i];
+        COUNT_SCOPE_PROBE();
+        DEBUG("%5d %s: looking up %s in %s\n",
+              pid, si->name, name, lsi->name);
+        if (cached && (lsi->flags & FLAG_SYMCACHE))
+            s = symcache_find_def(defs, lsi);
+        else
+            s = _elf_lookup(lsi, elf_hash, gnu_hash, name);
+        if(s != NULL) {
+            *found = lsi;
+            return s;
         }
     }
 
+    return NULL;
+}
+
+static Elf_Sym *
+__do_lookup(soinfo *si, const char *name, unsigned *base, int use_cache)
+{
+    unsigned elf_hash = elfhash(name);
+    unsigned gnu_hash = gnuhash(name);
+    Elf_Sym *s;
+    soinfo *lsi = si;
+
+    COUNT_LOOKUP(si);
+
+    /* The scope starts with the local scope (the object who is
+     * searching). This happens with C++ templates on i386 for some
+     * reason. It is followed by the preloads list and then the
+     * DT_NEEDED libraries. */
+    s = _scope_lookup(si, elf_hash, gnu_hash, name, &lsi, use_cache);
+    if(s != NULL)
+        goto done;
+
 #if ALLOW_SYMBOLS_FROM_MAIN
     /* If we are resolving relocations while dlopen()ing a library, it's OK for
      * the library to resolve a symbol that's defined in the executable itself,
      * although this is rare and is generally a bad idea.
+     *
+     * somain is only set once the executable has been linked, so it is not
+     * part of the precomputed scope.
      */
     if (somain) {
         lsi = somain;
+        COUNT_SCOPE_PROBE();
         DEBUG("%5d %s: looking up %s in executable %s\n",
               pid, si->name, name, lsi->name);
-        s = _elf_lookup(lsi, elf_hash, name);
+        s = _elf_lookup(lsi, elf_hash, gnu_hash, name);
     }
 #endif
 
@@ -481,12 +1434,18 @@ done:
     return NULL;
 }
 
+static Elf_Sym *
+_do_lookup(soinfo *si, const char *name, unsigned *base)
+{
+    return __do_lookup(si, name, base, 1);
+}
+
 /* This is used by dl_sym().  It performs symbol lookup only within the
    specified soinfo object and not in any of its dependencies.
  */
 Elf_Sym *lookup_in_library(soinfo *si, const char *name)
 {
-    return _elf_lookup(si, elfhash(name), name);
+    return _elf_lookup(si, elfhash(name), gnuhash(name), name);
 }
 
 /* This is used by dl_sym().  It performs a global symbol lookup.
@@ -494,6 +1453,7 @@ Elf_Sym *lookup_in_library(soinfo *si, const char *name)
 Elf_Sym *lookup(const char *name, soinfo **found, soinfo *start)
 {
     unsigned elf_hash = elfhash(name);
+    unsigned gnu_hash = gnuhash(name);
     Elf_Sym *s = NULL;
     soinfo *si;
 
@@ -507,7 +1467,7 @@ Elf_Sym *lookup(const char *name, soinfo **found, soinfo *start)
     {
         if(si->flags & FLAG_ERROR)
             continue;
-        s = _elf_lookup(si, elf_hash, name);
+        s = _elf_lookup(si, elf_hash, gnu_hash, name);
         if (s != NULL) {
             *found = si;
             break;
@@ -523,24 +1483,39 @@ Elf_Sym *lookup(const char *name, soinfo **found, soinfo *start)
     return NULL;
 }
 
+/* Callers hold the dl lock */
 soinfo *find_containing_library(const void *addr)
 {
-    soinfo *si;
-
-    for(si = solist; si != NULL; si = si->next)
-    {
-        if((unsigned)addr >= si->base && (unsigned)addr - si->base < si->size) {
-            return si;
-        }
-    }
-
-    return NULL;
+    return addr_index_lookup((unsigned)addr);
 }
 
 Elf_Sym *find_containing_symbol(const void *addr, soinfo *si)
 {
     unsigned int i;
     unsigned soaddr = (unsigned)addr - si->base;
+    struct symaddr *sa;
+    unsigned count;
+    int lo, hi, mid, found = -1;
+
+    sa = symaddr_index(si, &count);
+    if (sa != NULL) {
+        lo = 0;
+        hi = (int)count - 1;
+        while (lo <= hi) {
+            mid = (lo + hi) / 2;
+            if (sa[mid].start <= soaddr) {
+                found = mid;
+                lo = mid + 1;
+            } else
+                hi = mid - 1;
+        }
+        for (; found >= 0 && soaddr < sa[found].end; found--) {
+            Elf_Sym *sym = &si->symtab[sa[found].sym];
+            if (soaddr < sym->st_value + sym->st_size)
+                return sym;
+        }
+        return NULL;
+    }
 
     /* Search the library's symbol table for any defined symbol which
      * contains this address */
@@ -628,10 +1603,6 @@ static int open_library(const char *name)
     return -1;
 }
 
-/* temporary space for holding the first page of the shared lib
- * which contains the elf header (with the pht). */
-static unsigned char __header[PAGE_SIZE];
-
 typedef struct {
     long mmap_addr;
     char tag[4]; /* 'P', 'R', 'E', ' ' */
@@ -664,6 +1635,33 @@ is_prelinked(int fd, const char *name)
     return (unsigned long)info.mmap_addr;
 }
 
+/* hybris-prelink (tools/prelink.c) also applies the leading DT_RELCOUNT
+ * R_*_RELATIVE relocations for the base it assigns, and records how many
+ * it did right before the prelink_info_t. */
+typedef struct {
+    unsigned relative_count;
+    char tag[4]; /* 'H', 'Y', 'B', ' ' */
+} prelink_relative_info_t;
+
+/* Returns the number of RELATIVE relocations applied by hybris-prelink,
+ * or 0 if the library was not prelinked by it. */
+static unsigned
+prelinked_relative_count(int fd)
+{
+    prelink_relative_info_t info;
+    off_t off;
+
+    off = lseek(fd, 0, SEEK_END) -
+          (off_t)(sizeof(prelink_info_t) + sizeof(info));
+    if (off < 0 || pread(fd, &info, sizeof(info), off) != sizeof(info))
+        return 0;
+
+    if (strncmp(info.tag, "HYB ", 4))
+        return 0;
+
+    return info.relative_count;
+}
+
 /* verify_elf_object
  *      Verifies if the object @ base is a valid ELF object
  *
@@ -769,6 +1767,159 @@ get_lib_extents(int fd, const char *name, void *__hdr, unsigned *total_sz)
     return (unsigned)req_base;
 }
 
+/* Anonymous mapping of size bytes at a multiple of align */
+static void *mmap_aligned(unsigned size, unsigned align, int prot)
+{
+    unsigned char *p, *aligned;
+
+    if (align <= PAGE_SIZE)
+        return mmap(NULL, size, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    p = mmap(NULL, size + align - PAGE_SIZE, prot,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return p;
+    aligned = (unsigned char *)(((unsigned)p + align - 1) & ~(align - 1));
+    if (aligned > p)
+        munmap(p, aligned - p);
+    if (aligned + size < p + size + align - PAGE_SIZE)
+        munmap(aligned + size, p + size + align - PAGE_SIZE - (aligned + size));
+    return aligned;
+}
+
+/* Huge page text
+ *
+ * With HYBRIS_LD_HUGE_TEXT set to a size in bytes, libraries whose text is
+ * at least that big get their region reserved at a huge page boundary
+ * (FLAG_HUGE_TEXT). Once they are relocated, the huge page aligned part of
+ * each read-only executable segment is copied into an anonymous
+ * MADV_HUGEPAGE mapping, which is then moved over the file mapping with
+ * mremap(), and link_image() applies the final protections as usual. The
+ * text is no longer shared with other processes through the page cache;
+ * what it buys is far fewer iTLB misses. The number of huge pages each
+ * library got is logged and counted in its statistics. Prelinked
+ * libraries, whose base is fixed, are left alone.
+ */
+#define HUGE_PAGE_SIZE 0x200000
+
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 14
+#endif
+
+static unsigned huge_text_min;
+
+static unsigned text_size(void *header)
+{
+    Elf_Ehdr *ehdr = (Elf_Ehdr *)header;
+    Elf_Phdr *phdr = (Elf_Phdr *)((unsigned char *)header + ehdr->e_phoff);
+    unsigned size = 0;
+    int i;
+
+    for (i = 0; i < ehdr->e_phnum; i++, phdr++) {
+        if (phdr->p_type == PT_LOAD && (phdr->p_flags & PF_X) &&
+            !(phdr->p_flags & PF_W))
+            size += phdr->p_memsz;
+    }
+    return size;
+}
+
+static const char *parse_hex(const char *s, unsigned long long *v)
+{
+    unsigned d;
+
+    for (*v = 0; ; s++) {
+        if (*s >= '0' && *s <= '9')
+            d = *s - '0';
+        else if (*s >= 'a' && *s <= 'f')
+            d = *s - 'a' + 10;
+        else
+            return s;
+        *v = *v * 16 + d;
+    }
+}
+
+/* Sums a kB field of /proc/self/smaps, e.g. "Private_Dirty:", over the
+ * mappings that overlap [start, end) */
+static unsigned smaps_kb(unsigned start, unsigned end, const char *field)
+{
+    unsigned field_len = strlen(field);
+    unsigned long long vm_start, vm_end;
+    int in_range = 0, fd, len = 0, n;
+    unsigned kb = 0;
+    char buf[4096];
+    char *line, *eol;
+    const char *p;
+
+    fd = open("/proc/self/smaps", O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    while ((n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0) {
+        len += n;
+        buf[len] = '\0';
+        for (line = buf; (eol = strchr(line, '\n')) != NULL; line = eol + 1) {
+            *eol = '\0';
+            p = parse_hex(line, &vm_start);
+            if (p != line && *p == '-') {
+                /* "start-end perms offset dev inode path" */
+                p = parse_hex(p + 1, &vm_end);
+                if (*p == ' ')
+                    in_range = vm_start < end && vm_end > start;
+            } else if (in_range && !strncmp(line, field, field_len)) {
+                kb += atoi(line + field_len);
+            }
+        }
+        len -= line - buf;
+        if (len == (int)sizeof(buf) - 1)
+            len = 0;        /* a line longer than buf, drop it */
+        memmove(buf, line, len);
+    }
+    close(fd);
+    return kb;
+}
+
+static void huge_text_remap(soinfo *si)
+{
+    Elf_Phdr *phdr = si->phdr;
+    unsigned start, end, len;
+    unsigned pages = 0;
+    void *copy;
+    int i;
+
+    for (i = 0; i < si->phnum; i++, phdr++) {
+        if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_X) ||
+            (phdr->p_flags & PF_W))
+            continue;
+        start = (si->base + phdr->p_vaddr + HUGE_PAGE_SIZE - 1) &
+                ~(HUGE_PAGE_SIZE - 1);
+        end = (si->base + phdr->p_vaddr + phdr->p_memsz) &
+              ~(HUGE_PAGE_SIZE - 1);
+        if (end <= start)
+            continue;
+        len = end - start;
+
+        copy = mmap_aligned(len, HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE);
+        if (copy == MAP_FAILED)
+            continue;
+        madvise(copy, len, MADV_HUGEPAGE);
+        memcpy(copy, (void *)start, len);
+        if (mremap(copy, len, len, MREMAP_MAYMOVE | MREMAP_FIXED,
+                   (void *)start) == MAP_FAILED) {
+            WARN("%5d cannot remap the text of '%s' to huge pages: %d (%s)\n",
+                 pid, si->name, errno, strerror(errno));
+            munmap(copy, len);
+            continue;
+        }
+        __builtin___clear_cache((char *)start, (char *)end);
+        pages += smaps_kb(start, end, "AnonHugePages:") /
+                 (HUGE_PAGE_SIZE / 1024);
+    }
+
+    INFO("[ %5d %s: %d huge pages of text ]\n", pid, si->name, pages);
+    if (si->stats)
+        si->stats->huge_pages = pages;
+}
+
 /* alloc_mem_region
  *
  *     This function reserves a chunk of memory to be used for mapping in
@@ -788,18 +1939,19 @@ get_lib_extents(int fd, const char *name, void *__hdr, unsigned *total_sz)
 
 static int reserve_mem_region(soinfo *si)
 {
+    /* Only a hint: MAP_FIXED would silently replace whatever else already
+     * lives there. */
     void *base = mmap((void *)si->base, si->size, PROT_READ | PROT_EXEC,
-                      MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     if (base == MAP_FAILED) {
-        DL_ERR("%5d can NOT map (%sprelinked) library '%s' at 0x%08x "
-              "as requested, will try general pool: %d (%s)",
-              pid, (si->base ? "" : "non-"), si->name, si->base,
-              errno, strerror(errno));
+        WARN("%5d can NOT map prelinked library '%s' at 0x%08x "
+             "as requested, will try general pool: %d (%s)\n",
+             pid, si->name, si->base, errno, strerror(errno));
         return -1;
     } else if (base != (void *)si->base) {
-        DL_ERR("OOPS: %5d %sprelinked library '%s' mapped at 0x%08x, "
-              "not at 0x%08x", pid, (si->base ? "" : "non-"),
-              si->name, (unsigned)base, si->base);
+        WARN("%5d prelinked library '%s' would be mapped at 0x%08x, "
+             "not at 0x%08x, will try general pool\n", pid,
+             si->name, (unsigned)base, si->base);
         munmap(base, si->size);
         return -1;
     }
@@ -811,15 +1963,23 @@ alloc_mem_region(soinfo *si)
 {
     if (si->base) {
         /* Attempt to mmap a prelinked library. */
-        return reserve_mem_region(si);
+        if (reserve_mem_region(si) == 0)
+            return 0;
+
+        /* Its range is taken: load it like any other library. The
+         * RELATIVE relocations hybris-prelink applied are moved to the
+         * new base by link_image(). */
+        si->flags &= ~FLAG_PRELINKED;
+        si->base = 0;
     }
 
     /* This is not a prelinked library, so we use the kernel's default
        allocator.
     */
 
-    void *base = mmap(NULL, si->size, PROT_READ | PROT_EXEC,
-                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void *base = mmap_aligned(si->size, (si->flags & FLAG_HUGE_TEXT) ?
+                              HUGE_PAGE_SIZE : PAGE_SIZE,
+                              PROT_READ | PROT_EXEC);
     if (base == MAP_FAILED) {
         DL_ERR("%5d mmap of library '%s' failed: %d (%s)\n",
               pid, si->name,
@@ -837,6 +1997,165 @@ err:
     return -1;
 }
 
+/* Prefault policies
+ *
+ * How much of a library to bring in while mapping it, rather than a page
+ * fault at a time during relocation and the first calls into it:
+ *
+ *   readahead   readahead() the whole file before mapping it
+ *   populate    MAP_POPULATE the writable segments, which relocation dirties
+ *   willneed    madvise(MADV_WILLNEED) every segment
+ *   sequential  madvise(MADV_SEQUENTIAL) every segment
+ *   none
+ *
+ * HYBRIS_LD_PREFAULT is a comma separated list of these for all libraries.
+ * HYBRIS_LD_PREFAULT_CONFIG names a file of "<library> <policies>" lines
+ * that overrides it per library, with "*" standing for the libraries that
+ * don't have a line of their own and '#' starting a comment. To compare
+ * policies, run with HYBRIS_LINKER_STATS, which reports the page faults
+ * taken while loading and linking each library, or hybris-prefaultbench
+ * (tools/prefaultbench.c), which loads them under each policy in turn.
+ */
+#define PREFAULT_READAHEAD  0x1
+#define PREFAULT_POPULATE   0x2
+#define PREFAULT_WILLNEED   0x4
+#define PREFAULT_SEQUENTIAL 0x8
+
+static const struct {
+    const char *name;
+    unsigned flag;
+} prefault_names[] = {
+    { "readahead", PREFAULT_READAHEAD },
+    { "populate", PREFAULT_POPULATE },
+    { "willneed", PREFAULT_WILLNEED },
+    { "sequential", PREFAULT_SEQUENTIAL },
+    { "none", 0 },
+};
+
+static unsigned prefault_default;
+static const char *prefault_config;
+static unsigned prefault_config_len;
+static int prefault_ready;
+
+static int is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+/* Parses the policies in [s, end) */
+static unsigned prefault_parse(const char *s, const char *end)
+{
+    const char *tok;
+    unsigned flags = 0;
+    unsigned i;
+
+    while (s < end) {
+        while (s < end && (*s == ',' || is_blank(*s)))
+            s++;
+        tok = s;
+        while (s < end && *s != ',' && !is_blank(*s))
+            s++;
+        if (tok == s)
+            break;
+        for (i = 0; i < sizeof(prefault_names) / sizeof(prefault_names[0]);
+             i++) {
+            if (strlen(prefault_names[i].name) == (unsigned)(s - tok) &&
+                !strncmp(prefault_names[i].name, tok, s - tok))
+                break;
+        }
+        if (i == sizeof(prefault_names) / sizeof(prefault_names[0]))
+            WARN("Ignoring unknown prefault policy\n");
+        else
+            flags |= prefault_names[i].flag;
+    }
+    return flags;
+}
+
+/* Reads the settings map_library() goes by; called before any loader thread
+ * is started, see find_library() */
+static void prefault_init(void)
+{
+    const char *env;
+    struct stat st;
+    void *map;
+    int fd;
+
+    if (prefault_ready)
+        return;
+    prefault_ready = 1;
+
+    env = getenv("HYBRIS_LD_PREFAULT");
+    if (env)
+        prefault_default = prefault_parse(env, env + strlen(env));
+
+    env = getenv("HYBRIS_LD_HUGE_TEXT");
+    if (env)
+        huge_text_min = atoi(env);
+
+    env = getenv("HYBRIS_LD_PREFAULT_CONFIG");
+    if (env == NULL)
+        return;
+    fd = open(env, O_RDONLY);
+    if (fd < 0) {
+        WARN("Cannot open prefault config %s\n", env);
+        return;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            prefault_config = map;
+            prefault_config_len = st.st_size;
+        }
+    }
+    close(fd);
+}
+
+static unsigned prefault_policy(const char *name)
+{
+    const char *p = prefault_config;
+    const char *end = p + prefault_config_len;
+    const char *eol, *field, *comment;
+    unsigned flags = prefault_default;
+    unsigned len = strlen(name);
+
+    while (p < end) {
+        eol = memchr(p, '\n', end - p);
+        if (eol == NULL)
+            eol = end;
+        comment = memchr(p, '#', eol - p);
+        if (comment == NULL)
+            comment = eol;
+
+        while (p < comment && is_blank(*p))
+            p++;
+        field = p;
+        while (p < comment && !is_blank(*p))
+            p++;
+        if (p - field == (int)len && !strncmp(field, name, len))
+            return prefault_parse(p, comment);
+        if (p - field == 1 && *field == '*')
+            flags = prefault_parse(p, comment);
+
+        p = eol + 1;
+    }
+    return flags;
+}
+
+static int prefault_map_flags(soinfo *si, Elf_Phdr *phdr)
+{
+    if ((si->prefault & PREFAULT_POPULATE) && (phdr->p_flags & PF_W))
+        return MAP_POPULATE;
+    return 0;
+}
+
+static void prefault_advise(soinfo *si, void *addr, unsigned len)
+{
+    if (si->prefault & PREFAULT_WILLNEED)
+        madvise(addr, len, MADV_WILLNEED);
+    if (si->prefault & PREFAULT_SEQUENTIAL)
+        madvise(addr, len, MADV_SEQUENTIAL);
+}
+
 #define MAYBE_MAP_FLAG(x,from,to)    (((x) & (from)) ? (to) : 0)
 #define PFLAGS_TO_PROT(x)            (MAYBE_MAP_FLAG((x), PF_X, PROT_EXEC) | \
                                       MAYBE_MAP_FLAG((x), PF_R, PROT_READ) | \
@@ -888,8 +2207,8 @@ load_segments(int fd, void *header, soinfo *si)
                   "(0x%08x). p_vaddr=0x%08x p_offset=0x%08x ]\n", pid, si->name,
                   (unsigned)tmp, len, phdr->p_vaddr, phdr->p_offset);
             pbase = mmap(tmp, len, PFLAGS_TO_PROT(phdr->p_flags),
-                         MAP_PRIVATE | MAP_FIXED, fd,
-                         phdr->p_offset & (~PAGE_MASK));
+                         MAP_PRIVATE | MAP_FIXED | prefault_map_flags(si, phdr),
+                         fd, phdr->p_offset & (~PAGE_MASK));
             if (pbase == MAP_FAILED) {
                 DL_ERR("%d failed to map segment from '%s' @ 0x%08x (0x%08x). "
                       "p_vaddr=0x%08x p_offset=0x%08x", pid, si->name,
@@ -897,6 +2216,8 @@ load_segments(int fd, void *header, soinfo *si)
                 goto fail;
             }
 
+            prefault_advise(si, pbase, len);
+
             /* If 'len' didn't end on page boundary, and it's a writable
              * segment, zero-fill the rest. */
             if ((len & PAGE_MASK) && (phdr->p_flags & PF_W))
@@ -967,23 +2288,24 @@ load_segments(int fd, void *header, soinfo *si)
                   "(0x%08x). p_vaddr=0x%08x p_offset=0x%08x\n", pid, si->name,
                   (unsigned)pbase, len, phdr->p_vaddr, phdr->p_offset);
             total_sz += len;
-            /* Make the section writable just in case we'll have to write to
-             * it during relocation (i.e. text segment). However, we will
-             * remember what range of addresses should be write protected.
-             *
-             */
+            /* Remember what range of addresses is read-only. Only the
+             * pages that text relocations write to are made writable, by
+             * textrel_unprotect(), and only for the duration of linking;
+             * the rest stay clean pages shared with the page cache. */
             if (!(phdr->p_flags & PF_W)) {
                 if ((unsigned)pbase < si->wrprotect_start)
                     si->wrprotect_start = (unsigned)pbase;
                 if (((unsigned)pbase + len) > si->wrprotect_end)
                     si->wrprotect_end = (unsigned)pbase + len;
-                mprotect(pbase, len,
-                         PFLAGS_TO_PROT(phdr->p_flags) | PROT_WRITE);
             }
         } else if (phdr->p_type == PT_DYNAMIC) {
             DEBUG_DUMP_PHDR(phdr, "PT_DYNAMIC", pid);
             /* this segment contains the dynamic linking information */
             si->dynamic = (unsigned *)(base + phdr->p_vaddr);
+        } else if (phdr->p_type == PT_GNU_RELRO) {
+            DEBUG_DUMP_PHDR(phdr, "PT_GNU_RELRO", pid);
+            si->gnu_relro_start = (unsigned)base + phdr->p_vaddr;
+            si->gnu_relro_len = phdr->p_memsz;
         } else {
 #ifdef ANDROID_ARM_LINKER
             if (phdr->p_type == PT_ARM_EXIDX) {
@@ -1057,92 +2379,393 @@ get_wr_offset(int fd, const char *name, Elf_Ehdr *ehdr)
 }
 #endif
 
-static soinfo *
-load_library(const char *name)
+/* map_library
+ *
+ *     Opens a library and maps its segments, filling in the load time fields
+ *     of img (base, size, dynamic, phdr, ...). img must be zeroed with only
+ *     its name set, and isn't on solist, so this can run in a loader thread.
+ *     Times and page faults go to stats when HYBRIS_LINKER_STATS is set.
+ *
+ * Returns:
+ *     0 on success, -1 on failure.
+ */
+static int
+map_library(const char *name, soinfo *img,
+            struct hybris_linker_lib_stats *stats)
 {
-    int fd = open_library(name);
-    int cnt;
+    unsigned long long t0 = STATS_ENABLED() ? linker_stats_now() : 0;
+    int fd;
+    unsigned char header[PAGE_SIZE];
     unsigned ext_sz;
     unsigned req_base;
-    const char *bname;
-    soinfo *si = NULL;
     Elf_Ehdr *hdr;
+    struct stat st;
 
+    if (STATS_ENABLED())
+        linker_stats_faults(&stats->minflt, &stats->majflt, -1);
+    fd = open_library(name);
+    stats->open_ns = STATS_ENABLED() ? linker_stats_now() - t0 : 0;
     if(fd == -1) {
         DL_ERR("Library '%s' not found", name);
-        return NULL;
+        return -1;
     }
 
     /* We have to read the ELF header to figure out what to do with this image
      */
-    if (lseek(fd, 0, SEEK_SET) < 0) {
-        DL_ERR("lseek() failed!");
+    if (pread(fd, header, PAGE_SIZE, 0) < 0) {
+        DL_ERR("read() failed!");
         goto fail;
     }
 
-    if ((cnt = read(fd, &__header[0], PAGE_SIZE)) < 0) {
-        DL_ERR("read() failed!");
+    if (fstat(fd, &st) < 0) {
+        DL_ERR("fstat() failed!");
         goto fail;
     }
 
     /* Parse the ELF header and get the size of the memory footprint for
      * the library */
-    req_base = get_lib_extents(fd, name, &__header[0], &ext_sz);
+    req_base = get_lib_extents(fd, name, header, &ext_sz);
     if (req_base == (unsigned)-1)
         goto fail;
     TRACE("[ %5d - '%s' (%s) wants base=0x%08x sz=0x%08x ]\n", pid, name,
           (req_base ? "prelinked" : "not pre-linked"), req_base, ext_sz);
 
-    /* Now configure the soinfo struct where we'll store all of our data
-     * for the ELF object. If the loading fails, we waste the entry, but
-     * same thing would happen if we failed during linking. Configuring the
-     * soinfo struct here is a lot more convenient.
-     */
-    bname = strrchr(name, '/');
-    si = alloc_info(bname ? bname + 1 : name);
-    if (si == NULL)
-        goto fail;
-
     /* Carve out a chunk of memory where we will map in the individual
      * segments */
-    si->base = req_base;
-    si->size = ext_sz;
-    si->flags = 0;
-    si->entry = 0;
-    si->dynamic = (unsigned *)-1;
-    if (alloc_mem_region(si) < 0)
+    img->base = req_base;
+    img->size = ext_sz;
+    img->flags = req_base ? FLAG_PRELINKED : 0;
+    if (huge_text_min && !req_base && text_size(header) >= huge_text_min)
+        img->flags |= FLAG_HUGE_TEXT;
+    if (req_base) {
+        img->prelink_relcount = prelinked_relative_count(fd);
+        img->prelink_base = req_base;
+    }
+    img->file_dev = st.st_dev;
+    img->file_ino = st.st_ino;
+    img->file_mtime = st.st_mtime;
+    img->file_size = st.st_size;
+    img->entry = 0;
+    img->dynamic = (unsigned *)-1;
+    img->prefault = prefault_policy(img->name);
+    if (img->prefault & PREFAULT_READAHEAD)
+        readahead(fd, 0, st.st_size);
+    if (alloc_mem_region(img) < 0)
         goto fail;
 
     TRACE("[ %5d allocated memory for %s @ %p (0x%08x) ]\n",
-          pid, name, (void *)si->base, (unsigned) ext_sz);
+          pid, name, (void *)img->base, (unsigned) ext_sz);
 
     /* Now actually load the library's segments into right places in memory */
-    if (load_segments(fd, &__header[0], si) < 0) {
+    t0 = STATS_ENABLED() ? linker_stats_now() : 0;
+    if (load_segments(fd, header, img) < 0) {
         goto fail;
     }
+    if (STATS_ENABLED()) {
+        stats->load_ns = linker_stats_now() - t0;
+        linker_stats_faults(&stats->minflt, &stats->majflt, 1);
+    }
 
     /* this might not be right. Technically, we don't even need this info
      * once we go through 'load_segments'. */
-    hdr = (Elf_Ehdr *)si->base;
-    si->phdr = (Elf_Phdr *)((unsigned char *)si->base + hdr->e_phoff);
-    si->phnum = hdr->e_phnum;
+    hdr = (Elf_Ehdr *)img->base;
+    img->phdr = (Elf_Phdr *)((unsigned char *)img->base + hdr->e_phoff);
+    img->phnum = hdr->e_phnum;
     /**/
 
     close(fd);
-    return si;
+    return 0;
 
 fail:
-    if (si) free_info(si);
     close(fd);
-    return NULL;
+    return -1;
 }
 
+/* Moves a library mapped by map_library() into a new soinfo on solist.
+ * alloc_info() leaves everything but the list links zero, which is what
+ * map_library() starts from as well, so the whole img is copied. */
 static soinfo *
-init_library(soinfo *si)
+adopt_library(const char *name, soinfo *img,
+              const struct hybris_linker_lib_stats *stats)
 {
-    unsigned wr_offset = 0xffffffff;
+    const char *bname = strrchr(name, '/');
+    soinfo *si, *next, *name_next;
+
+    si = alloc_info(bname ? bname + 1 : name);
+    if (si == NULL) {
+        munmap((void *)img->base, img->size);
+        return NULL;
+    }
+
+    next = si->next;
+    name_next = si->name_next;
+    memcpy(si, img, sizeof(soinfo));
+    si->next = next;
+    si->name_next = name_next;
+
+    if (STATS_ENABLED() && (si->stats = linker_stats_new(si->name)) != NULL) {
+        si->stats->open_ns = stats->open_ns;
+        si->stats->load_ns = stats->load_ns;
+        si->stats->minflt = stats->minflt;
+        si->stats->majflt = stats->majflt;
+    }
+    return si;
+}
+
+static soinfo *
+load_library(const char *name)
+{
+    const char *bname = strrchr(name, '/');
+    struct hybris_linker_lib_stats stats;
+    soinfo img;
+
+    memset(&img, 0, sizeof(img));
+    memset(&stats, 0, sizeof(stats));
+    strlcpy((char *)img.name, bname ? bname + 1 : name, sizeof(img.name));
+    if (map_library(name, &img, &stats) < 0)
+        return NULL;
+    return adopt_library(name, &img, &stats);
+}
+
+/* Parallel loading
+ *
+ * Opening, reading the headers of and mapping a library doesn't touch any
+ * linker state, so the DT_NEEDED libraries of whatever is being loaded are
+ * handed to a few loader threads as soon as their parent is mapped. The
+ * threads queue the DT_NEEDED entries of what they map in turn, so the
+ * whole dependency graph is discovered and mapped ahead of link_image(),
+ * which still links and runs constructors in order, one library at a time,
+ * in the thread that called dlopen(). When find_library() gets to a library
+ * it takes the mapped image from its job, waiting for it if need be; if the
+ * job failed it loads the library itself so the error is reported as usual.
+ *
+ * The jobs and threads live for one outermost find_library() call. Images
+ * nobody took, because linking failed half way, are unmapped at the end.
+ * Parallel loading is opt-in: HYBRIS_LD_LOAD_THREADS sets the number of
+ * threads, up to LOAD_WORKERS_MAX. Unset or 0 loads everything serially
+ * as before.
+ */
+#define LOAD_JOBS_MAX    64
+#define LOAD_WORKERS_MAX 4
+#define LOAD_WORKER_STACK (128 * 1024)
+
+enum {
+    LOAD_JOB_QUEUED,
+    LOAD_JOB_RUNNING,
+    LOAD_JOB_DONE,
+    LOAD_JOB_FAILED,
+    LOAD_JOB_TAKEN,
+};
+
+struct load_job {
+    char name[SOINFO_NAME_LEN];     /* as in DT_NEEDED */
+    int state;
+    struct hybris_linker_lib_stats stats;
+    soinfo img;
+};
+
+static struct load_job *load_jobs;
+static unsigned load_job_count;
+static unsigned load_job_next;          /* first job that may be QUEUED */
+static int load_jobs_stop;
+static pthread_t load_workers[LOAD_WORKERS_MAX];
+static int load_worker_count;
+static int load_threads = -1;
+static int find_depth;
+static pthread_cond_t load_job_cond = PTHREAD_COND_INITIALIZER;
+
+static void *load_worker(void *arg);
+
+/* Called with load_job_lock held */
+static void load_job_queue(const char *name)
+{
+    const char *bname = strrchr(name, '/');
+    struct load_job *job;
+    pthread_attr_t attr;
+    unsigned i;
+
+    if (strlen(name) >= SOINFO_NAME_LEN ||
+        soname_lookup(bname ? bname + 1 : name) != NULL)
+        return;
+    for (i = 0; i < load_job_count; i++) {
+        if (!strcmp(load_jobs[i].name, name))
+            return;
+    }
+
+    if (load_jobs == NULL) {
+        load_jobs = mmap(NULL, LOAD_JOBS_MAX * sizeof(struct load_job),
+                         PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                         -1, 0);
+        if (load_jobs == MAP_FAILED) {
+            load_jobs = NULL;
+            return;
+        }
+    }
+    if (load_job_count == LOAD_JOBS_MAX)
+        return;
+
+    job = &load_jobs[load_job_count++];
+    memset(job, 0, sizeof(*job));
+    strlcpy(job->name, name, sizeof(job->name));
+    job->state = LOAD_JOB_QUEUED;
+    pthread_cond_broadcast(&load_job_cond);
+
+    if (load_worker_count < load_threads) {
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, LOAD_WORKER_STACK);
+        if (pthread_create(&load_workers[load_worker_count], &attr,
+                           load_worker, NULL) == 0)
+            load_worker_count++;
+        pthread_attr_destroy(&attr);
+    }
+}
+
+/* Queues the DT_NEEDED entries of a library that has just been mapped,
+ * before link_image() replaces them with soinfo pointers. */
+static void load_jobs_queue_needed(soinfo *img)
+{
+    const char *strtab = NULL;
+    unsigned *d;
+
+    if (load_threads <= 0 || img->dynamic == (unsigned *)-1)
+        return;
+
+    for (d = img->dynamic; *d; d += 2) {
+        if (d[0] == DT_STRTAB)
+            strtab = (const char *)(img->base + d[1]);
+    }
+    if (strtab == NULL)
+        return;
+
+    pthread_mutex_lock(&load_job_lock);
+    for (d = img->dynamic; *d && !load_jobs_stop; d += 2) {
+        if (d[0] == DT_NEEDED)
+            load_job_queue(strtab + d[1]);
+    }
+    pthread_mutex_unlock(&load_job_lock);
+}
+
+static void *load_worker(void *arg)
+{
+    struct load_job *job;
+    unsigned i;
+    int ret;
+
+    dl_err_quiet = 1;
+    pthread_mutex_lock(&load_job_lock);
+    for (;;) {
+        job = NULL;
+        for (i = load_job_next; i < load_job_count; i++) {
+            if (load_jobs[i].state == LOAD_JOB_QUEUED) {
+                job = &load_jobs[i];
+                break;
+            }
+        }
+        if (job == NULL) {
+            if (load_jobs_stop)
+                break;
+            pthread_cond_wait(&load_job_cond, &load_job_lock);
+            continue;
+        }
+        load_job_next = i + 1;
+        job->state = LOAD_JOB_RUNNING;
+        pthread_mutex_unlock(&load_job_lock);
+
+        TRACE_BEGIN("load_library", job->name);
+        strlcpy((char *)job->img.name, job->name, sizeof(job->img.name));
+        ret = map_library(job->name, &job->img, &job->stats);
+        TRACE_END("load_library");
+        if (ret == 0)
+            load_jobs_queue_needed(&job->img);
+
+        pthread_mutex_lock(&load_job_lock);
+        job->state = ret == 0 ? LOAD_JOB_DONE : LOAD_JOB_FAILED;
+        pthread_cond_broadcast(&load_job_cond);
+    }
+    pthread_mutex_unlock(&load_job_lock);
+    return arg;
+}
+
+/* Returns the library mapped for name by a loader thread, or NULL if there
+ * is none and the caller has to load it itself. */
+static soinfo *load_job_take(const char *name)
+{
+    struct load_job *job = NULL;
+    soinfo *si = NULL;
+    unsigned i;
+
+    if (load_jobs == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&load_job_lock);
+    for (i = 0; i < load_job_count; i++) {
+        if (!strcmp(load_jobs[i].name, name)) {
+            job = &load_jobs[i];
+            break;
+        }
+    }
+    if (job != NULL) {
+        while (job->state == LOAD_JOB_RUNNING)
+            pthread_cond_wait(&load_job_cond, &load_job_lock);
+        if (job->state == LOAD_JOB_DONE)
+            si = &job->img;
+        job->state = LOAD_JOB_TAKEN;
+    }
+    pthread_mutex_unlock(&load_job_lock);
+
+    if (si != NULL)
+        si = adopt_library(name, si, &job->stats);
+    return si;
+}
+
+static void load_jobs_start(void)
+{
+    const char *env;
+
+    if (load_threads < 0) {
+        env = getenv("HYBRIS_LD_LOAD_THREADS");
+        load_threads = env ? atoi(env) : 0;
+        if (load_threads < 0)
+            load_threads = 0;
+        if (load_threads > LOAD_WORKERS_MAX)
+            load_threads = LOAD_WORKERS_MAX;
+    }
+    load_jobs_stop = 0;
+}
+
+static void load_jobs_finish(void)
+{
+    unsigned i;
+    int n;
+
+    pthread_mutex_lock(&load_job_lock);
+    load_jobs_stop = 1;
+    pthread_cond_broadcast(&load_job_cond);
+    pthread_mutex_unlock(&load_job_lock);
+
+    for (n = 0; n < load_worker_count; n++)
+        pthread_join(load_workers[n], NULL);
+    load_worker_count = 0;
+
+    for (i = 0; i < load_job_count; i++) {
+        if (load_jobs[i].state == LOAD_JOB_DONE)
+            munmap((void *)load_jobs[i].img.base, load_jobs[i].img.size);
+    }
+    load_job_count = 0;
+    load_job_next = 0;
+}
+
+/* Reads the HYBRIS_* settings of the linker itself; called with
+ * prefault_init(), see find_library() */
+static void linker_settings_init(void)
+{
+    static int ready;
+    const char *env;
+
+    if (ready)
+        return;
+    ready = 1;
 
-    const char* env;
     env = getenv("HYBRIS_DEBUG");
     if (env)
         debug_verbosity = atoi(env);
@@ -1150,6 +2773,29 @@ init_library(soinfo *si)
     if (getenv("HYBRIS_STDOUT"))
         debug_stdout = 1;
 
+    env = getenv("HYBRIS_LD_BIND_LAZY");
+    bind_lazy = env && atoi(env);
+
+    ldcache_dir = getenv("HYBRIS_LD_CACHE_DIR");
+    relro_dir = getenv("HYBRIS_LD_RELRO_DIR");
+
+    env = getenv("HYBRIS_PERF_MAP");
+    perf_map = env && atoi(env);
+
+    env = getenv("HYBRIS_LD_SYMCACHE");
+    if (env)
+        symcache_enabled = atoi(env) != 0;
+
+    /* We don't get to see the aux vector of the program, and glibc keeps
+     * HYBRIS_* in the environment of setuid programs */
+    program_is_setuid = getuid() != geteuid() || getgid() != getegid();
+}
+
+static soinfo *
+init_library(soinfo *si)
+{
+    unsigned wr_offset = 0xffffffff;
+
     INFO("[ HYBRIS: initializing library '%s']\n", si->name);
 
     /* At this point we know that whatever is loaded @ base is a valid ELF
@@ -1157,98 +2803,536 @@ init_library(soinfo *si)
     TRACE("[ %5d init_library base=0x%08x sz=0x%08x name='%s') ]\n",
           pid, si->base, si->size, si->name);
 
+    TRACE_BEGIN("link_image", si->name);
     if(link_image(si, wr_offset)) {
             /* We failed to link.  However, we can only restore libbase
             ** if no additional libraries have moved it since we updated it.
             */
+        TRACE_END("link_image");
         munmap((void *)si->base, si->size);
         return NULL;
     }
+    TRACE_END("link_image");
+
+    return si;
+}
+
+static soinfo *find_library_internal(const char *name)
+{
+    soinfo *si;
+    const char *bname;
+
+#if ALLOW_SYMBOLS_FROM_MAIN
+    if (name == NULL)
+        return somain;
+#else
+    if (name == NULL)
+        return NULL;
+#endif
+
+    bname = strrchr(name, '/');
+    bname = bname ? bname + 1 : name;
+
+    si = soname_lookup(bname);
+    if (si != NULL) {
+        if(si->flags & FLAG_ERROR) {
+            DL_ERR("%5d '%s' failed to load previously", pid, bname);
+            return NULL;
+        }
+        if(si->flags & FLAG_LINKED) return si;
+        DL_ERR("OOPS: %5d recursive link to '%s'", pid, si->name);
+        return NULL;
+    }
+
+    TRACE("[ %5d '%s' has not been loaded yet.  Locating...]\n", pid, name);
+    si = load_job_take(name);
+    if (si == NULL) {
+        TRACE_BEGIN("load_library", name);
+        si = load_library(name);
+        TRACE_END("load_library");
+        if(si == NULL)
+            return NULL;
+        load_jobs_queue_needed(si);
+    }
+    return init_library(si);
+}
 
+soinfo *find_library(const char *name)
+{
+    soinfo *si;
+
+    TRACE_BEGIN("find_library", name);
+    if (find_depth++ == 0) {
+        linker_settings_init();
+        prefault_init();
+        load_jobs_start();
+    }
+    si = find_library_internal(name);
+    if (--find_depth == 0)
+        load_jobs_finish();
+    TRACE_END("find_library");
     return si;
 }
 
-soinfo *find_library(const char *name)
+/* TODO:
+ *   notify gdb of unload
+ *   for non-prelinked libraries, find a way to decrement libbase
+ */
+static void call_destructors(soinfo *si);
+unsigned unload_library(soinfo *si)
+{
+    unsigned *d;
+    if (si->refcount == 1) {
+        TRACE("%5d unloading '%s'\n", pid, si->name);
+        call_destructors(si);
+
+
+        for(d = si->dynamic; *d; d += 2) {
+            if(d[0] == DT_NEEDED){
+                soinfo *lsi = (soinfo *)d[1];
+                d[1] = 0;
+                if (validate_soinfo(lsi)) {
+                    TRACE("%5d %s needs to unload %s\n", pid,
+                          si->name, lsi->name);
+                    unload_library(lsi);
+                }
+                else
+                    DL_ERR("%5d %s: could not unload dependent library",
+                           pid, si->name);
+            }
+        }
+
+        notify_host_of_unload(si);
+        munmap((char *)si->base, si->size);
+        notify_gdb_of_unload(si);
+        free_info(si);
+        symcache_flush();
+        si->refcount = 0;
+    }
+    else {
+        si->refcount--;
+        PRINT("%5d not unloading '%s', decrementing refcount to %d\n",
+              pid, si->name, si->refcount);
+    }
+    return si->refcount;
+}
+
+/* Persistent resolution cache.
+ *
+ * If HYBRIS_LD_CACHE_DIR is set, the outcome of every symbol lookup done
+ * while relocating a library is saved to <dir>/<name>.ldcache as the
+ * position of the defining library in the lookup scope plus the index of
+ * the symbol in its symtab. The next process to link the library maps that
+ * file read-only and, provided that every library in the scope is still the
+ * same file (device, inode, mtime and size), takes the definitions from it
+ * instead of calling _do_lookup().
+ *
+ * Hooks are always checked before the cache, and cached definitions are
+ * checked against the symbol name before use, so a changed hook table or a
+ * stale entry never produces a wrong binding. Files are replaced with
+ * rename(), so a file that is mapped is never truncated under us.
+ */
+#define LDCACHE_MAGIC   0x43444c48 /* "HLDC" */
+#define LDCACHE_VERSION 1
+#define LDCACHE_NONE    0xffffffff /* not cached, do a real lookup */
+#define LDCACHE_MAX_SCOPE 0xff
+#define LDCACHE_MAX_SYM   0xffffff
+
+struct ldcache_header {
+    unsigned magic;
+    unsigned version;
+    unsigned nscope;
+    unsigned nbinding;
+    /* followed by struct ldcache_ident[nscope], unsigned[nbinding] */
+};
+
+struct ldcache_ident {
+    unsigned dev;
+    unsigned ino;
+    unsigned mtime;
+    unsigned size;
+};
+
+struct ldcache {
+    void *map;                  /* validated cache file, or NULL */
+    unsigned map_size;
+    const unsigned *bindings;
+    unsigned *record;           /* bindings being recorded, or NULL */
+    unsigned record_size;
+};
+
+static int ldcache_path(soinfo *si, char *buf, size_t size)
+{
+    int n = format_buffer(buf, size, "%s/%s.ldcache", ldcache_dir, si->name);
+    return (n < 0 || (size_t)n >= size) ? -1 : 0;
+}
+
+/* One binding per relocation, numbered DT_REL first, then DT_JMPREL and
+ * then DT_ANDROID_REL. */
+static unsigned ldcache_slots(soinfo *si)
+{
+    return si->rel_count + si->plt_rel_count + si->packed_rel_count;
+}
+
+static unsigned ldcache_file_size(soinfo *si)
+{
+    return sizeof(struct ldcache_header) +
+           si->scope_count * sizeof(struct ldcache_ident) +
+           ldcache_slots(si) * sizeof(unsigned);
+}
+
+static int ldcache_valid(soinfo *si, const struct ldcache_header *hdr)
+{
+    const struct ldcache_ident *id = (const struct ldcache_ident *)(hdr + 1);
+    unsigned i;
+
+    if (hdr->magic != LDCACHE_MAGIC || hdr->version != LDCACHE_VERSION ||
+        hdr->nscope != si->scope_count ||
+        hdr->nbinding != ldcache_slots(si))
+        return 0;
+
+    for (i = 0; i < si->scope_count; i++, id++) {
+        soinfo *lsi = si->scope[i];
+        if (id->dev != lsi->file_dev || id->ino != lsi->file_ino ||
+            id->mtime != lsi->file_mtime || id->size != lsi->file_size)
+            return 0;
+    }
+    return 1;
+}
+
+/* Map and validate the cache file for si, or prepare to record a new one */
+static void ldcache_open(soinfo *si, struct ldcache *lc)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    unsigned size;
+    int fd;
+
+    memset(lc, 0, sizeof(*lc));
+    if (ldcache_dir == NULL || program_is_setuid || si->file_ino == 0 ||
+        si->scope_count > LDCACHE_MAX_SCOPE ||
+        ldcache_slots(si) == 0 ||
+        ldcache_path(si, path, sizeof(path)) < 0)
+        return;
+
+    size = ldcache_file_size(si);
+    fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        if (fstat(fd, &st) == 0 && st.st_size == (off_t)size) {
+            lc->map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (lc->map == MAP_FAILED)
+                lc->map = NULL;
+        }
+        close(fd);
+    }
+
+    if (lc->map != NULL) {
+        if (ldcache_valid(si, lc->map)) {
+            lc->map_size = size;
+            lc->bindings = (const unsigned *)
+                ((const struct ldcache_ident *)
+                 ((const struct ldcache_header *)lc->map + 1) +
+                 si->scope_count);
+            TRACE("[ %5d %s: using resolution cache %s ]\n", pid,
+                  si->name, path);
+            return;
+        }
+        munmap(lc->map, size);
+        lc->map = NULL;
+        TRACE("[ %5d %s: resolution cache %s is stale ]\n", pid,
+              si->name, path);
+    }
+
+    lc->record_size = ldcache_slots(si) * sizeof(unsigned);
+    lc->record = mmap(NULL, lc->record_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (lc->record == MAP_FAILED) {
+        lc->record = NULL;
+        return;
+    }
+    memset(lc->record, 0xff, lc->record_size);
+}
+
+/* Look up a cached definition. Returns NULL if there is none, in which
+ * case the caller has to do a real lookup. */
+static Elf_Sym *ldcache_lookup(soinfo *si, const struct ldcache *lc,
+                               unsigned slot, const char *name,
+                               unsigned *base)
+{
+    unsigned b = lc->bindings[slot];
+    unsigned idx = b & LDCACHE_MAX_SYM;
+    soinfo *lsi;
+    Elf_Sym *s;
+
+    if (b == LDCACHE_NONE || (b >> 24) >= si->scope_count)
+        return NULL;
+
+    lsi = si->scope[b >> 24];
+    if (idx >= lsi->nchain)
+        return NULL;
+    s = &lsi->symtab[idx];
+    if (s->st_shndx == SHN_UNDEF || strcmp(lsi->strtab + s->st_name, name))
+        return NULL;
+
+    *base = lsi->base;
+    return s;
+}
+
+static void ldcache_record(soinfo *si, struct ldcache *lc, unsigned slot,
+                           Elf_Sym *s)
+{
+    unsigned i;
+
+    for (i = 0; i < si->scope_count; i++) {
+        soinfo *lsi = si->scope[i];
+        if (s >= lsi->symtab && s < lsi->symtab + lsi->nchain) {
+            /* Definitions from the linker itself are not cached, since
+             * libdl_info has no file identity to validate. */
+            if (lsi->file_ino != 0 &&
+                (unsigned)(s - lsi->symtab) <= LDCACHE_MAX_SYM)
+                lc->record[slot] = (i << 24) | (unsigned)(s - lsi->symtab);
+            return;
+        }
+    }
+}
+
+/* Write out what was recorded during relocation and release the cache */
+static void ldcache_close(soinfo *si, struct ldcache *lc, int success)
+{
+    struct ldcache_header hdr;
+    struct ldcache_ident id;
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    unsigned i;
+    int fd;
+
+    if (lc->map != NULL)
+        munmap(lc->map, lc->map_size);
+
+    if (lc->record == NULL)
+        return;
+
+    if (!success ||
+        ldcache_path(si, path, sizeof(path)) < 0 ||
+        format_buffer(tmp, sizeof(tmp), "%s.%d", path, pid) >= (int)sizeof(tmp))
+        goto done;
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        goto done;
+
+    hdr.magic = LDCACHE_MAGIC;
+    hdr.version = LDCACHE_VERSION;
+    hdr.nscope = si->scope_count;
+    hdr.nbinding = ldcache_slots(si);
+    if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+        goto fail;
+    for (i = 0; i < si->scope_count; i++) {
+        id.dev = si->scope[i]->file_dev;
+        id.ino = si->scope[i]->file_ino;
+        id.mtime = si->scope[i]->file_mtime;
+        id.size = si->scope[i]->file_size;
+        if (write(fd, &id, sizeof(id)) != sizeof(id))
+            goto fail;
+    }
+    if (write(fd, lc->record, lc->record_size) != (ssize_t)lc->record_size)
+        goto fail;
+
+    close(fd);
+    if (rename(tmp, path) == 0)
+        TRACE("[ %5d %s: wrote resolution cache %s ]\n", pid, si->name, path);
+    else
+        unlink(tmp);
+    goto done;
+
+fail:
+    close(fd);
+    unlink(tmp);
+done:
+    munmap(lc->record, lc->record_size);
+}
+
+/* RELRO sharing.
+ *
+ * After relocation the PT_GNU_RELRO pages of a library (GOT, vtables and
+ * other relocated constants) are private dirty memory in every process,
+ * even though they come out the same whenever the library is loaded at the
+ * same base. If HYBRIS_LD_RELRO_DIR is set, the first process to load a
+ * library at a given base writes its relocated RELRO to
+ * <dir>/<name>@<base>.relro. Later processes compare their own RELRO
+ * against that file page by page and map the file read-only over every
+ * page that is identical, so those pages come from the page cache and are
+ * shared. Pages that differ stay private, so a stale file costs memory but
+ * can never change what the library sees. Files are only used if they
+ * belong to us or to root and nobody else can write to them.
+ *
+ * Either way the RELRO region is made read-only afterwards. Like glibc, we
+ * only touch the pages that lie entirely inside PT_GNU_RELRO.
+ */
+static int relro_path(soinfo *si, char *buf, size_t size)
+{
+    int n = format_buffer(buf, size, "%s/%s@%08x.relro", relro_dir,
+                          si->name, si->base);
+    return (n < 0 || (size_t)n >= size) ? -1 : 0;
+}
+
+static int relro_serialize(const char *path, unsigned start, unsigned size)
+{
+    char tmp[PATH_MAX];
+    int fd;
+
+    if (format_buffer(tmp, sizeof(tmp), "%s.%d", path, pid) >= (int)sizeof(tmp))
+        return -1;
+
+    /* Only replaces what a process of ours with the same pid left */
+    unlink(tmp);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0644);
+    if (fd < 0)
+        return -1;
+    if (write(fd, (void *)start, size) != (ssize_t)size) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+
+    if (rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* Pages mapped from the file are never copied, so whoever can write to it
+ * can change the GOT of every process using it. */
+static int relro_file_trusted(const struct stat *st)
 {
-    soinfo *si;
-    const char *bname;
+    return S_ISREG(st->st_mode) &&
+           (st->st_uid == geteuid() || st->st_uid == 0) &&
+           !(st->st_mode & (S_IWGRP | S_IWOTH));
+}
 
-#if ALLOW_SYMBOLS_FROM_MAIN
-    if (name == NULL)
-        return somain;
-#else
-    if (name == NULL)
-        return NULL;
-#endif
+/* Map every page of [start, start + size) that is identical in the file
+ * over our copy. Returns the number of pages shared, -1 if the file can't
+ * be used, or -2 if mapping it failed half way and the library is lost. */
+static int relro_map_file(const char *path, unsigned start, unsigned size)
+{
+    struct stat st;
+    unsigned char *file;
+    unsigned off, run = 0;
+    int shared = 0;
+    int fd;
 
-    bname = strrchr(name, '/');
-    bname = bname ? bname + 1 : name;
+    fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || st.st_size != (off_t)size ||
+        !relro_file_trusted(&st)) {
+        close(fd);
+        return -1;
+    }
+    file = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
 
-    for(si = solist; si != 0; si = si->next){
-        if(!strcmp(bname, si->name)) {
-            if(si->flags & FLAG_ERROR) {
-                DL_ERR("%5d '%s' failed to load previously", pid, bname);
-                return NULL;
+    /* Pages [run, off) are identical and not mapped yet */
+    for (off = 0; off <= size; off += PAGE_SIZE) {
+        if (off < size &&
+            !memcmp((void *)(start + off), file + off, PAGE_SIZE))
+            continue;
+        if (off > run) {
+            if (mmap((void *)(start + run), off - run, PROT_READ,
+                     MAP_PRIVATE | MAP_FIXED, fd, run) == MAP_FAILED) {
+                DL_ERR("%5d cannot map shared RELRO from %s: %d (%s)",
+                       pid, path, errno, strerror(errno));
+                shared = -2;
+                break;
             }
-            if(si->flags & FLAG_LINKED) return si;
-            DL_ERR("OOPS: %5d recursive link to '%s'", pid, si->name);
-            return NULL;
+            shared += (off - run) / PAGE_SIZE;
         }
+        run = off + PAGE_SIZE;
     }
 
-    TRACE("[ %5d '%s' has not been loaded yet.  Locating...]\n", pid, name);
-    si = load_library(name);
-    if(si == NULL)
-        return NULL;
-    return init_library(si);
+    munmap(file, size);
+    close(fd);
+    return shared;
 }
 
-/* TODO:
- *   notify gdb of unload
- *   for non-prelinked libraries, find a way to decrement libbase
- */
-static void call_destructors(soinfo *si);
-unsigned unload_library(soinfo *si)
+static int relro_share(soinfo *si)
 {
-    unsigned *d;
-    if (si->refcount == 1) {
-        TRACE("%5d unloading '%s'\n", pid, si->name);
-        call_destructors(si);
+    unsigned start = si->gnu_relro_start & ~PAGE_MASK;
+    unsigned end = (si->gnu_relro_start + si->gnu_relro_len) & ~PAGE_MASK;
+    char path[PATH_MAX];
+    int shared;
 
+    if (end <= start)
+        return 0;
 
-        for(d = si->dynamic; *d; d += 2) {
-            if(d[0] == DT_NEEDED){
-                soinfo *lsi = (soinfo *)d[1];
-                d[1] = 0;
-                if (validate_soinfo(lsi)) {
-                    TRACE("%5d %s needs to unload %s\n", pid,
-                          si->name, lsi->name);
-                    unload_library(lsi);
-                }
-                else
-                    DL_ERR("%5d %s: could not unload dependent library",
-                           pid, si->name);
-            }
-        }
+    if (relro_path(si, path, sizeof(path)) == 0) {
+        shared = relro_map_file(path, start, end - start);
+        /* Missing, or written for a different build of the library */
+        if ((shared == -1 || shared == 0) &&
+            relro_serialize(path, start, end - start) == 0)
+            shared = relro_map_file(path, start, end - start);
+        if (shared == -2)
+            return -1;
 
-        munmap((char *)si->base, si->size);
-        notify_gdb_of_unload(si);
-        free_info(si);
-        si->refcount = 0;
+        if (shared < 0)
+            shared = 0;
+        INFO("[ %5d RELRO %s: %d of %d pages shared, %d KB less PSS ]\n",
+             pid, si->name, shared, (end - start) / PAGE_SIZE,
+             shared * (PAGE_SIZE / 1024));
+        if (si->stats)
+            si->stats->relro_kb = shared * (PAGE_SIZE / 1024);
     }
-    else {
-        si->refcount--;
-        PRINT("%5d not unloading '%s', decrementing refcount to %d\n",
-              pid, si->name, si->refcount);
+
+    mprotect((void *)start, end - start, PROT_READ);
+    return 0;
+}
+
+#if defined(ANDROID_ARM_LINKER)
+#define R_RELATIVE R_ARM_RELATIVE
+#elif defined(ANDROID_X86_LINKER)
+#define R_RELATIVE R_386_RELATIVE
+#endif
+
+#ifdef R_RELATIVE
+/* Applies the leading DT_RELCOUNT relocations of DT_REL, which are all
+ * RELATIVE, without going through reloc_library(): bias is added to each
+ * target, which is si->base unless hybris-prelink already added another
+ * base. Returns how many were applied; should the table not hold what
+ * DT_RELCOUNT says, the rest are left to reloc_library(). */
+static unsigned reloc_relative(soinfo *si, Elf_Rel *rel, unsigned count,
+                               unsigned bias)
+{
+    unsigned long long start = 0;
+    unsigned done;
+
+    TRACE("[ %5d %s: %d RELATIVE relocations <- +%08x ]\n", pid, si->name,
+          count, bias);
+    if (si->stats)
+        start = linker_stats_now();
+    done = relative_relocs_apply(si->base, bias, rel, count, R_RELATIVE);
+    if (si->stats) {
+        si->stats->reloc_count[HYBRIS_RELOC_RELATIVE] += done;
+        si->stats->reloc_ns[HYBRIS_RELOC_RELATIVE] +=
+            linker_stats_now() - start;
     }
-    return si->refcount;
+    if (done != count)
+        WARN("%5d %s: DT_RELCOUNT is %d, but relocation %d isn't RELATIVE\n",
+             pid, si->name, count, done);
+    return done;
 }
+#endif
 
 /* TODO: don't use unsigned for addrs below. It works, but is not
  * ideal. They should probably be either uint32_t, Elf_Addr, or unsigned
  * long.
  */
-static int reloc_library(soinfo *si, Elf_Rel *rel, unsigned count)
+static int reloc_library(soinfo *si, Elf_Rel *rel, unsigned count,
+                         struct ldcache *lc, unsigned slot)
 {
     Elf_Sym *symtab = si->symtab;
     const char *strtab = si->strtab;
@@ -1256,6 +3340,10 @@ static int reloc_library(soinfo *si, Elf_Rel *rel, unsigned count)
     unsigned base;
     Elf_Rel *start = rel;
     unsigned idx;
+    /* With stats on, time runs of relocations of the same class, so that
+     * the clock is only read when the class changes. */
+    int stat_class = -1;
+    unsigned long long stat_start = 0;
 
     for (idx = 0; idx < count; ++idx) {
         unsigned type = ELF32_R_TYPE(rel->r_info);
@@ -1264,19 +3352,38 @@ static int reloc_library(soinfo *si, Elf_Rel *rel, unsigned count)
         unsigned sym_addr = 0;
         char *sym_name = NULL;
 
+        if (si->stats) {
+            int cls = linker_stats_reloc_class(type);
+            si->stats->reloc_count[cls]++;
+            if (cls != stat_class) {
+                unsigned long long now = linker_stats_now();
+                if (stat_class >= 0)
+                    si->stats->reloc_ns[stat_class] += now - stat_start;
+                stat_class = cls;
+                stat_start = now;
+            }
+        }
+
         if(sym != 0) {
             sym_name = (char *)(strtab + symtab[sym].st_name);
             INFO("HYBRIS: '%s' checking hooks for sym '%s'\n", si->name, sym_name);
             sym_addr = NULL;
-              if ((sym_addr = get_hooked_symbol(sym_name)) != NULL) {
+              if ((sym_addr = (unsigned) get_hooked_symbol(sym_name)) != 0) {
                 INFO("HYBRIS: '%s' hooked symbol %s to %x\n", si->name,
 				                  sym_name, sym_addr);
+                COUNT_HOOK(si);
               }
               else
                 {
-                  s = _do_lookup(si, sym_name, &base);
+                  s = NULL;
+                  if (lc->bindings)
+                      s = ldcache_lookup(si, lc, slot + idx, sym_name, &base);
+                  if (s == NULL)
+                      s = _do_lookup(si, sym_name, &base);
+                  if (s != NULL && lc->record)
+                      ldcache_record(si, lc, slot + idx, s);
                 }
-            if(sym_addr != NULL)
+            if(sym_addr != 0)
             {
             } else
             if(s == NULL) {
@@ -1347,7 +3454,6 @@ static int reloc_library(soinfo *si, Elf_Rel *rel, unsigned count)
 #endif
                 sym_addr = (unsigned)(s->st_value + base);
 	    }
-            COUNT_RELOC(RELOC_SYMBOL);
         } else {
             s = NULL;
         }
@@ -1358,28 +3464,24 @@ static int reloc_library(soinfo *si, Elf_Rel *rel, unsigned count)
         switch(type){
 #if defined(ANDROID_ARM_LINKER)
         case R_ARM_JUMP_SLOT:
-            COUNT_RELOC(RELOC_ABSOLUTE);
             MARK(rel->r_offset);
             TRACE_TYPE(RELO, "%5d RELO JMP_SLOT %08x <- %08x %s\n", pid,
                        reloc, sym_addr, sym_name);
             *((unsigned*)reloc) = sym_addr;
             break;
         case R_ARM_GLOB_DAT:
-            COUNT_RELOC(RELOC_ABSOLUTE);
             MARK(rel->r_offset);
             TRACE_TYPE(RELO, "%5d RELO GLOB_DAT %08x <- %08x %s\n", pid,
                        reloc, sym_addr, sym_name);
             *((unsigned*)reloc) = sym_addr;
             break;
         case R_ARM_ABS32:
-            COUNT_RELOC(RELOC_ABSOLUTE);
             MARK(rel->r_offset);
             TRACE_TYPE(RELO, "%5d RELO ABS %08x <- %08x %s\n", pid,
                        reloc, sym_addr, sym_name);
             *((unsigned*)reloc) += sym_addr;
             break;
         case R_ARM_REL32:
-            COUNT_RELOC(RELOC_RELATIVE);
             MARK(rel->r_offset);
             TRACE_TYPE(RELO, "%5d RELO REL32 %08x <- %08x - %08x %s\n", pid,
                        reloc, sym_addr, rel->r_offset, sym_name);
@@ -1387,14 +3489,12 @@ static int reloc_library(soinfo *si, Elf_Rel *rel, unsigned count)
             break;
 #elif defined(ANDROID_X86_LINKER)
         case R_386_JUMP_SLOT:
-            COUNT_RELOC(RELOC_ABSOLUTE);
             MARK(rel->r_offset);
             TRACE_TYPE(RELO, "%5d RELO JMP_SLOT %08x <- %08x %s\n", pid,
                        reloc, sym_addr, sym_name);
             *((unsigned*)reloc) = sym_addr;
             break;
         case R_386_GLOB_DAT:
-            COUNT_RELOC(RELOC_ABSOLUTE);
             MARK(rel->r_offset);
             TRACE_TYPE(RELO, "%5d RELO GLOB_DAT %08x <- %08x %s\n", pid,
                        reloc, sym_addr, sym_name);
@@ -1407,7 +3507,6 @@ static int reloc_library(soinfo *si, Elf_Rel *rel, unsigned count)
 #elif defined(ANDROID_X86_LINKER)
         case R_386_RELATIVE:
 #endif /* ANDROID_*_LINKER */
-            COUNT_RELOC(RELOC_RELATIVE);
             MARK(rel->r_offset);
             if(sym){
                 DL_ERR("%5d odd RELATIVE form...", pid);
@@ -1420,7 +3519,6 @@ static int reloc_library(soinfo *si, Elf_Rel *rel, unsigned count)
 
 #if defined(ANDROID_X86_LINKER)
         case R_386_32:
-            COUNT_RELOC(RELOC_RELATIVE);
             MARK(rel->r_offset);
 
             TRACE_TYPE(RELO, "%5d RELO R_386_32 %08x <- +%08x %s\n", pid,
@@ -1429,7 +3527,6 @@ static int reloc_library(soinfo *si, Elf_Rel *rel, unsigned count)
             break;
 
         case R_386_PC32:
-            COUNT_RELOC(RELOC_RELATIVE);
             MARK(rel->r_offset);
             TRACE_TYPE(RELO, "%5d RELO R_386_PC32 %08x <- "
                        "+%08x (%08x - %08x) %s\n", pid, reloc,
@@ -1440,7 +3537,6 @@ static int reloc_library(soinfo *si, Elf_Rel *rel, unsigned count)
 
 #ifdef ANDROID_ARM_LINKER
         case R_ARM_COPY:
-            COUNT_RELOC(RELOC_COPY);
             MARK(rel->r_offset);
             TRACE_TYPE(RELO, "%5d RELO %08x <- %d @ %08x %s\n", pid,
                        reloc, s->st_size, sym_addr, sym_name);
@@ -1457,9 +3553,159 @@ static int reloc_library(soinfo *si, Elf_Rel *rel, unsigned count)
         }
         rel++;
     }
+
+    if (stat_class >= 0)
+        si->stats->reloc_ns[stat_class] += linker_stats_now() - stat_start;
+    return 0;
+}
+
+/* Relocations are decoded from DT_ANDROID_REL this many at a time and
+ * handed to reloc_library() */
+#define PACKED_RELOC_BATCH 64
+
+static int reloc_packed(soinfo *si, struct ldcache *lc)
+{
+    struct packed_reloc_iter it;
+    Elf_Rel batch[PACKED_RELOC_BATCH];
+    unsigned slot = si->rel_count + si->plt_rel_count;
+    unsigned n = 0;
+    int ret;
+
+    /* Checked by link_image() already */
+    packed_reloc_init(&it, si->packed_rel, si->packed_rel_size);
+    while ((ret = packed_reloc_next(&it)) > 0) {
+        batch[n].r_offset = it.rel.r_offset;
+        batch[n++].r_info = it.rel.r_info;
+        if (n < PACKED_RELOC_BATCH)
+            continue;
+        if (reloc_library(si, batch, n, lc, slot))
+            return -1;
+        slot += n;
+        n = 0;
+    }
+    if (ret < 0) {
+        DL_ERR("%5d corrupt packed relocations in '%s' after %d of %d",
+               pid, si->name, slot + n - si->rel_count - si->plt_rel_count,
+               si->packed_rel_count);
+        return -1;
+    }
+    return n != 0 ? reloc_library(si, batch, n, lc, slot) : 0;
+}
+
+static void reloc_relr(soinfo *si)
+{
+    unsigned long long start = 0;
+    unsigned done;
+
+    TRACE("[ %5d %s: %d RELR entries <- +%08x ]\n", pid, si->name,
+          si->relr_count, si->base);
+    if (si->stats)
+        start = linker_stats_now();
+    done = relr_apply(si->base, si->relr, si->relr_count);
+    if (si->stats) {
+        si->stats->reloc_count[HYBRIS_RELOC_RELATIVE] += done;
+        si->stats->reloc_ns[HYBRIS_RELOC_RELATIVE] +=
+            linker_stats_now() - start;
+    }
+}
+
+/* Lazy PLT binding.
+ *
+ * With HYBRIS_LD_BIND_LAZY=1, the DT_JMPREL relocations of a library are
+ * not resolved at load time. Instead GOT[1] is set to the soinfo, GOT[2]
+ * to linker_plt_resolve (arch/<arch>/plt_resolve.S) and each JUMP_SLOT is
+ * left pointing back into the PLT, so that the first call through it ends
+ * up in linker_plt_bind(), which resolves the symbol, patches the slot and
+ * returns the target to jump to.
+ */
+#if defined(ANDROID_ARM_LINKER)
+#define R_JUMP_SLOT R_ARM_JUMP_SLOT
+#elif defined(ANDROID_X86_LINKER)
+#define R_JUMP_SLOT R_386_JUMP_SLOT
+#endif
+
+#ifdef R_JUMP_SLOT
+extern void linker_plt_resolve(void);
+
+/* Returns 0 if the PLT has been set up for lazy binding, or -1 if this
+ * library has to be bound now. */
+static int setup_lazy_plt(soinfo *si)
+{
+    Elf_Rel *rel = si->plt_rel;
+    unsigned idx;
+
+    /* Prelinked libraries may have had their GOT filled in already, and
+     * libraries linked with -z now expect their symbols resolved before
+     * they run. */
+    if (si->plt_got == NULL || (si->flags & (FLAG_PRELINKED | FLAG_BIND_NOW)))
+        return -1;
+
+    for (idx = 0; idx < si->plt_rel_count; ++idx, ++rel) {
+        if (ELF32_R_TYPE(rel->r_info) != R_JUMP_SLOT)
+            return -1;
+#ifdef ANDROID_ARM_LINKER
+        /* The ARM PLT only tells the resolver which GOT slot it came
+         * from, so slot n must belong to relocation n. */
+        if (si->base + rel->r_offset != (unsigned)&si->plt_got[3 + idx])
+            return -1;
+#endif
+    }
+
+    si->plt_got[1] = (unsigned)si;
+    si->plt_got[2] = (unsigned)&linker_plt_resolve;
+    si->flags |= FLAG_LAZY_PLT;
+
+    for (idx = 0, rel = si->plt_rel; idx < si->plt_rel_count; ++idx, ++rel)
+        *((unsigned *)(si->base + rel->r_offset)) += si->base;
+
+    TRACE("[ %5d %s: %d PLT entries will be bound lazily ]\n", pid,
+          si->name, si->plt_rel_count);
     return 0;
 }
 
+/* Called from linker_plt_resolve on the first call through a PLT entry,
+ * possibly from any thread.
+ *
+ * This doesn't take the dl lock: a constructor run by dlopen() with the
+ * lock held may wait for another thread, and that thread must still be
+ * able to call through its PLT. Everything read here stays put while si
+ * can run code: the scope of si is only written by link_image(), the
+ * libraries in it are kept loaded by si, and their symbol tables never
+ * change. The symbol cache is skipped, since dlopen() and dlclose()
+ * change it under the exclusive lock only. Racing writes of the same
+ * value to the slot are harmless. */
+unsigned __attribute__((visibility("hidden")))
+linker_plt_bind(soinfo *si, unsigned reloc_offset)
+{
+    Elf_Rel *rel = (Elf_Rel *)((char *)si->plt_rel + reloc_offset);
+    Elf_Sym *sym = &si->symtab[ELF32_R_SYM(rel->r_info)];
+    char *sym_name = (char *)(si->strtab + sym->st_name);
+    unsigned sym_addr;
+    unsigned base;
+    Elf_Sym *s;
+
+    if ((sym_addr = (unsigned) get_hooked_symbol(sym_name)) != 0) {
+        INFO("HYBRIS: '%s' hooked symbol %s to %x\n", si->name,
+             sym_name, sym_addr);
+        COUNT_HOOK(si);
+    } else if ((s = __do_lookup(si, sym_name, &base, 0)) != NULL) {
+        sym_addr = (unsigned)(s->st_value + base);
+    } else if (ELF32_ST_BIND(sym->st_info) != STB_WEAK) {
+        char errmsg[] = "\n";
+        DL_ERR("%5d cannot locate '%s' for lazy binding in '%s'",
+               pid, sym_name, si->name);
+        write(2, __linker_dl_err_buf, strlen(__linker_dl_err_buf));
+        write(2, errmsg, sizeof(errmsg) - 1);
+        abort();
+    }
+
+    TRACE_TYPE(RELO, "%5d RELO LAZY JMP_SLOT %08x <- %08x %s\n", pid,
+               si->base + rel->r_offset, sym_addr, sym_name);
+    *((unsigned *)(si->base + rel->r_offset)) = sym_addr;
+    return sym_addr;
+}
+#endif /* R_JUMP_SLOT */
+
 #if defined(ANDROID_SH_LINKER)
 static int reloc_library_a(soinfo *si, Elf_Rela *rela, unsigned count)
 {
@@ -1501,7 +3747,6 @@ static int reloc_library_a(soinfo *si, Elf_Rela *rela, unsigned count)
                 return -1;
             }
             sym_addr = (unsigned)(s->st_value + base);
-            COUNT_RELOC(RELOC_SYMBOL);
         } else {
             s = 0;
         }
@@ -1511,28 +3756,24 @@ static int reloc_library_a(soinfo *si, Elf_Rela *rela, unsigned count)
  */
         switch(type){
         case R_SH_JUMP_SLOT:
-            COUNT_RELOC(RELOC_ABSOLUTE);
             MARK(rela->r_offset);
             TRACE_TYPE(RELO, "%5d RELO JMP_SLOT %08x <- %08x %s\n", pid,
                        reloc, sym_addr, sym_name);
             *((unsigned*)reloc) = sym_addr;
             break;
         case R_SH_GLOB_DAT:
-            COUNT_RELOC(RELOC_ABSOLUTE);
             MARK(rela->r_offset);
             TRACE_TYPE(RELO, "%5d RELO GLOB_DAT %08x <- %08x %s\n", pid,
                        reloc, sym_addr, sym_name);
             *((unsigned*)reloc) = sym_addr;
             break;
         case R_SH_DIR32:
-            COUNT_RELOC(RELOC_ABSOLUTE);
             MARK(rela->r_offset);
             TRACE_TYPE(RELO, "%5d RELO DIR32 %08x <- %08x %s\n", pid,
                        reloc, sym_addr, sym_name);
             *((unsigned*)reloc) += sym_addr;
             break;
         case R_SH_RELATIVE:
-            COUNT_RELOC(RELOC_RELATIVE);
             MARK(rela->r_offset);
             if(sym){
                 DL_ERR("%5d odd RELATIVE form...", pid);
@@ -1716,11 +3957,219 @@ static int nullify_closed_stdio (void)
     return return_value;
 }
 
+/* build_lookup_scope
+ *
+ *     Records the order in which symbols referenced by si are searched
+ *     for: si itself, the LD_PRELOADs and then its DT_NEEDED libraries.
+ *     This must run after the DT_NEEDED payloads have been replaced by
+ *     their soinfo pointers (see link_image()).
+ *
+ * Returns:
+ *     0 on success, -1 on failure.
+ */
+static int build_lookup_scope(soinfo *si)
+{
+    unsigned *d;
+    unsigned count = 1;
+    int i;
+
+    for(i = 0; preloads[i] != NULL; i++)
+        count++;
+    for(d = si->dynamic; *d; d += 2) {
+        if(d[0] == DT_NEEDED)
+            count++;
+    }
+
+    if (count <= SOINFO_SCOPE_INLINE) {
+        si->scope = si->scope_buf;
+    } else {
+        si->scope = mmap(NULL, count * sizeof(soinfo *),
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (si->scope == MAP_FAILED) {
+            si->scope = NULL;
+            DL_ERR("%5d cannot allocate lookup scope for '%s': %d (%s)",
+                   pid, si->name, errno, strerror(errno));
+            return -1;
+        }
+    }
+
+    si->scope_count = 0;
+    si->scope[si->scope_count++] = si;
+    for(i = 0; preloads[i] != NULL; i++)
+        si->scope[si->scope_count++] = preloads[i];
+
+    for(d = si->dynamic; *d; d += 2) {
+        if(d[0] == DT_NEEDED){
+            soinfo *lsi = (soinfo *)d[1];
+            if (!validate_soinfo(lsi)) {
+                DL_ERR("%5d bad DT_NEEDED pointer in %s",
+                       pid, si->name);
+                return -1;
+            }
+            si->scope[si->scope_count++] = lsi;
+        }
+    }
+
+    DEBUG("%5d %s: lookup scope has %d entries\n", pid, si->name,
+          si->scope_count);
+    return 0;
+}
+
+/* Parse a DT_GNU_HASH section:
+ *
+ *   nbucket, symndx, maskwords, shift2,
+ *   bloom[maskwords], bucket[nbucket], chain[nsyms - symndx]
+ *
+ * The chain is indexed by symbol number, so we bias it by symndx here.
+ * DT_GNU_HASH does not record the number of symbols, so if we don't
+ * have a DT_HASH we count them by walking to the end of the chain that
+ * starts at the highest bucket; nchain is what dladdr() iterates over.
+ */
+static int gnu_hash_init(soinfo *si, unsigned *hdr)
+{
+    unsigned symndx = hdr[1];
+    unsigned n = 0;
+    unsigned i;
+
+    si->gnu_nbucket = hdr[0];
+    si->gnu_maskwords = hdr[2];
+    si->gnu_shift2 = hdr[3];
+
+    if (si->gnu_nbucket == 0 || si->gnu_maskwords == 0 ||
+        (si->gnu_maskwords & (si->gnu_maskwords - 1)) != 0) {
+        DL_ERR("%5d invalid DT_GNU_HASH in '%s' (nbucket=%d maskwords=%d)",
+               pid, si->name, si->gnu_nbucket, si->gnu_maskwords);
+        return -1;
+    }
+
+    si->gnu_bloom_filter = hdr + 4;
+    si->gnu_bucket = si->gnu_bloom_filter + si->gnu_maskwords;
+    si->gnu_chain = si->gnu_bucket + si->gnu_nbucket - symndx;
+    si->gnu_maskwords--;
+    si->flags |= FLAG_GNU_HASH;
+
+    if (si->nchain == 0) {
+        for (i = 0; i < si->gnu_nbucket; i++) {
+            if (si->gnu_bucket[i] > n)
+                n = si->gnu_bucket[i];
+        }
+        if (n == 0) {
+            si->nchain = symndx;
+        } else {
+            while ((si->gnu_chain[n] & 1) == 0)
+                n++;
+            si->nchain = n + 1;
+        }
+    }
+
+    DEBUG("%5d %s: DT_GNU_HASH nbucket=%d symndx=%d nsyms=%d\n",
+          pid, si->name, si->gnu_nbucket, symndx, si->nchain);
+    return 0;
+}
+
+#ifndef DF_TEXTREL
+#define DF_TEXTREL 0x4
+#endif
+#ifndef DF_BIND_NOW
+#define DF_BIND_NOW 0x8
+#endif
+#ifndef DT_FLAGS_1
+#define DT_FLAGS_1 0x6ffffffb
+#endif
+#ifndef DF_1_NOW
+#define DF_1_NOW 0x1
+#endif
+
+/* Makes the read-only page that a relocation at addr writes to writable,
+ * unless it is the page last made writable. */
+static int textrel_unprotect_addr(soinfo *si, unsigned addr, unsigned *last,
+                                  unsigned *pages)
+{
+    unsigned page;
+
+    if (addr < si->wrprotect_start || addr >= si->wrprotect_end)
+        return 0;
+    page = addr & ~PAGE_MASK;
+    if (page == *last)
+        return 0;
+    if (mprotect((void *)page, PAGE_SIZE,
+                 PROT_READ | PROT_WRITE | PROT_EXEC) < 0) {
+        DL_ERR("%5d cannot make text relocation target 0x%08x in '%s' "
+               "writable: %d (%s)", pid, addr, si->name, errno,
+               strerror(errno));
+        return -1;
+    }
+    *last = page;
+    (*pages)++;
+    return 0;
+}
+
+/* Makes the read-only pages that the relocations in rel write to writable */
+static int textrel_unprotect_rel(soinfo *si, Elf_Rel *rel, unsigned count,
+                                 unsigned *pages)
+{
+    unsigned last = 0;
+
+    for (; count > 0; count--, rel++) {
+        if (textrel_unprotect_addr(si, si->base + rel->r_offset, &last,
+                                   pages) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Called for libraries with DT_TEXTREL or DF_TEXTREL before they are
+ * relocated; the final protections are restored at the end of
+ * link_image(). */
+static int textrel_unprotect(soinfo *si)
+{
+    struct packed_reloc_iter it;
+    unsigned pages = 0;
+    unsigned last = 0;
+
+    if (si->wrprotect_start == 0xffffffff)
+        return 0;
+    if (textrel_unprotect_rel(si, si->rel, si->rel_count, &pages) < 0 ||
+        textrel_unprotect_rel(si, si->plt_rel, si->plt_rel_count, &pages) < 0)
+        return -1;
+
+    if (si->packed_rel) {
+        packed_reloc_init(&it, si->packed_rel, si->packed_rel_size);
+        while (packed_reloc_next(&it) > 0) {
+            if (textrel_unprotect_addr(si, si->base + it.rel.r_offset, &last,
+                                       &pages) < 0)
+                return -1;
+        }
+    }
+
+    /* Not worth decoding the bitmaps for; no toolchain puts RELR
+     * relocations in text that we know of. */
+    if (si->relr) {
+        if (mprotect((void *)si->wrprotect_start,
+                     si->wrprotect_end - si->wrprotect_start,
+                     PROT_READ | PROT_WRITE | PROT_EXEC) < 0) {
+            DL_ERR("%5d cannot make text of '%s' writable: %d (%s)", pid,
+                   si->name, errno, strerror(errno));
+            return -1;
+        }
+        pages = (si->wrprotect_end - si->wrprotect_start) / PAGE_SIZE;
+    }
+
+    INFO("[ %5d %s has text relocations: %d pages made writable ]\n",
+         pid, si->name, pages);
+    if (si->stats)
+        si->stats->textrel_pages = pages;
+    return 0;
+}
+
 static int link_image(soinfo *si, unsigned wr_offset)
 {
     unsigned *d;
     Elf_Phdr *phdr = si->phdr;
     int phnum = si->phnum;
+    struct ldcache lc;
+    int counting_faults = 0;
 
     INFO("[ %5d linking %s ]\n", pid, si->name);
     DEBUG("%5d si->base = 0x%08x si->flags = 0x%08x\n", pid,
@@ -1795,6 +4244,9 @@ static int link_image(soinfo *si, unsigned wr_offset)
 
     DEBUG("%5d dynamic = %p\n", pid, si->dynamic);
 
+    if (addr_index_insert(si) < 0)
+        goto fail;
+
     /* extract useful information from dynamic section */
     for(d = si->dynamic; *d; d++){
         DEBUG("%5d d = %p, d[0] = 0x%08x d[1] = 0x%08x\n", pid, d, d[0], d[1]);
@@ -1805,6 +4257,10 @@ static int link_image(soinfo *si, unsigned wr_offset)
             si->bucket = (unsigned *) (si->base + *d + 8);
             si->chain = (unsigned *) (si->base + *d + 8 + si->nbucket * 4);
             break;
+        case DT_GNU_HASH:
+            if (gnu_hash_init(si, (unsigned *) (si->base + *d)) < 0)
+                goto fail;
+            break;
         case DT_STRTAB:
             si->strtab = (const char *) (si->base + *d);
             break;
@@ -1840,6 +4296,36 @@ static int link_image(soinfo *si, unsigned wr_offset)
         case DT_RELSZ:
             si->rel_count = *d / 8;
             break;
+        case DT_RELCOUNT:
+            si->relcount = *d;
+            break;
+        case DT_RELR:
+        case DT_ANDROID_RELR:
+            si->relr = (unsigned *)(si->base + *d);
+            break;
+        case DT_RELRSZ:
+        case DT_ANDROID_RELRSZ:
+            si->relr_count = *d / 4;
+            break;
+        case DT_RELRENT:
+        case DT_ANDROID_RELRENT:
+            if (*d != 4) {
+                DL_ERR("%5d invalid DT_RELRENT %d in '%s'", pid, *d,
+                       si->name);
+                goto fail;
+            }
+            break;
+#ifndef ANDROID_SH_LINKER
+        case DT_ANDROID_REL:
+            si->packed_rel = (const unsigned char *)(si->base + *d);
+            break;
+        case DT_ANDROID_RELSZ:
+            si->packed_rel_size = *d;
+            break;
+        case DT_ANDROID_RELA:
+            DL_ERR("%5d DT_ANDROID_RELA not supported", pid);
+            goto fail;
+#endif
 #ifdef ANDROID_SH_LINKER
         case DT_RELASZ:
             si->rela_count = *d / sizeof(Elf_Rela);
@@ -1897,13 +4383,25 @@ static int link_image(soinfo *si, unsigned wr_offset)
             si->preinit_array_count = ((unsigned)*d) / sizeof(Elf_Addr);
             break;
         case DT_TEXTREL:
-            /* TODO: make use of this. */
             /* this means that we might have to write into where the text
-             * segment was loaded during relocation... Do something with
-             * it.
+             * segment was loaded during relocation, see textrel_unprotect()
              */
             DEBUG("%5d Text segment should be writable during relocation.\n",
                   pid);
+            si->flags |= FLAG_TEXTREL;
+            break;
+        case DT_FLAGS:
+            if (*d & DF_TEXTREL)
+                si->flags |= FLAG_TEXTREL;
+            if (*d & DF_BIND_NOW)
+                si->flags |= FLAG_BIND_NOW;
+            break;
+        case DT_FLAGS_1:
+            if (*d & DF_1_NOW)
+                si->flags |= FLAG_BIND_NOW;
+            break;
+        case DT_BIND_NOW:
+            si->flags |= FLAG_BIND_NOW;
             break;
         }
     }
@@ -1916,6 +4414,18 @@ static int link_image(soinfo *si, unsigned wr_offset)
         goto fail;
     }
 
+    if (si->packed_rel) {
+        struct packed_reloc_iter it;
+
+        if (packed_reloc_init(&it, si->packed_rel, si->packed_rel_size) < 0) {
+            DL_ERR("%5d invalid packed relocations in '%s'", pid, si->name);
+            goto fail;
+        }
+        si->packed_rel_count = it.remaining;
+    }
+
+    symcache_register(si);
+
     /* if this is the main executable, then load all of the preloads now */
     if(si->flags & FLAG_EXE) {
         int i;
@@ -1955,16 +4465,78 @@ static int link_image(soinfo *si, unsigned wr_offset)
         }
     }
 
+    /* The dependencies loaded above counted their own faults; count ours
+     * from here on, through the constructors. */
+    if (si->stats) {
+        linker_stats_faults(&si->stats->minflt, &si->stats->majflt, -1);
+        counting_faults = 1;
+    }
+
+    if (build_lookup_scope(si) < 0)
+        goto fail;
+
+    if ((si->flags & FLAG_TEXTREL) && textrel_unprotect(si) < 0)
+        goto fail;
+
+    ldcache_open(si, &lc);
     if(si->plt_rel) {
         DEBUG("[ %5d relocating %s plt ]\n", pid, si->name );
-        if(reloc_library(si, si->plt_rel, si->plt_rel_count))
+#ifdef R_JUMP_SLOT
+        if (bind_lazy && setup_lazy_plt(si) == 0)
+            ;
+        else
+#endif
+        if(reloc_library(si, si->plt_rel, si->plt_rel_count, &lc,
+                         si->rel_count)) {
+            ldcache_close(si, &lc, 0);
             goto fail;
+        }
     }
     if(si->rel) {
+        Elf_Rel *rel = si->rel;
+        unsigned count = si->rel_count;
+
+        /* hybris-prelink already applied the RELATIVE relocations for the
+         * base we got, so there is nothing to do for them. */
+        if ((si->flags & FLAG_PRELINKED) && si->relcount != 0 &&
+            si->prelink_relcount == si->relcount &&
+            si->relcount <= count) {
+            TRACE("[ %5d %s: skipping %d prelinked RELATIVE relocations ]\n",
+                  pid, si->name, si->relcount);
+            rel += si->relcount;
+            count -= si->relcount;
+        }
+#ifdef R_RELATIVE
+        else if (si->relcount <= count) {
+            /* Loaded somewhere else than hybris-prelink planned: move
+             * what it applied by the difference. */
+            unsigned bias = si->base;
+            unsigned done;
+
+            if (si->relcount != 0 && si->prelink_relcount == si->relcount)
+                bias -= si->prelink_base;
+            done = reloc_relative(si, rel, si->relcount, bias);
+            rel += done;
+            count -= done;
+        }
+#endif
+
         DEBUG("[ %5d relocating %s ]\n", pid, si->name );
-        if(reloc_library(si, si->rel, si->rel_count))
+        if(reloc_library(si, rel, count, &lc, rel - si->rel)) {
+            ldcache_close(si, &lc, 0);
+            goto fail;
+        }
+    }
+    if (si->packed_rel) {
+        DEBUG("[ %5d relocating %s packed ]\n", pid, si->name);
+        if (reloc_packed(si, &lc)) {
+            ldcache_close(si, &lc, 0);
             goto fail;
+        }
     }
+    ldcache_close(si, &lc, 1);
+    if (si->relr)
+        reloc_relr(si);
 
 #ifdef ANDROID_SH_LINKER
     if(si->plt_rela) {
@@ -2001,12 +4573,26 @@ static int link_image(soinfo *si, unsigned wr_offset)
      * the program headers again and mprotect all the read-only segments.
      * To prevent re-scanning the program header, we would have to build a
      * list of loadable segments in si, and then scan that instead. */
-    if (si->wrprotect_start != 0xffffffff && si->wrprotect_end != 0) {
+    if (si->flags & FLAG_HUGE_TEXT)
+        huge_text_remap(si);
+    if ((si->flags & (FLAG_TEXTREL | FLAG_HUGE_TEXT)) &&
+        si->wrprotect_start != 0xffffffff && si->wrprotect_end != 0) {
         mprotect((void *)si->wrprotect_start,
                  si->wrprotect_end - si->wrprotect_start,
                  PROT_READ | PROT_EXEC);
     }
 #endif
+    /* A lazily bound PLT keeps writing to the GOT, which -z now puts
+     * inside RELRO. */
+    if (relro_dir && !program_is_setuid && si->gnu_relro_len &&
+        si->file_ino != 0 && !(si->flags & FLAG_LAZY_PLT)) {
+        if (relro_share(si) < 0)
+            goto fail;
+    }
+    /* After RELRO sharing, so that the pages it saved don't count */
+    if (si->stats && si->size != 0)
+        si->stats->dirty_kb = smaps_kb(si->base, si->base + si->size,
+                                       "Private_Dirty:");
 
     /* If this is a SET?ID program, dup /dev/null to opened stdin,
        stdout and stderr to close a security hole described in:
@@ -2017,10 +4603,21 @@ static int link_image(soinfo *si, unsigned wr_offset)
     if (program_is_setuid)
         nullify_closed_stdio ();
     notify_gdb_of_load(si);
-    call_constructors(si);
+    notify_host_of_load(si);
+    TRACE_BEGIN("call_constructors", si->name);
+    if (si->stats) {
+        unsigned long long t0 = linker_stats_now();
+        call_constructors(si);
+        si->stats->ctor_ns += linker_stats_now() - t0;
+        linker_stats_faults(&si->stats->minflt, &si->stats->majflt, 1);
+    } else
+        call_constructors(si);
+    TRACE_END("call_constructors");
     return 0;
 
 fail:
+    if (counting_faults)
+        linker_stats_faults(&si->stats->minflt, &si->stats->majflt, 1);
     ERROR("failed to link %s\n", si->name);
     si->flags |= FLAG_ERROR;
     return -1;
@@ -2101,11 +4698,6 @@ unsigned __linker_init(unsigned **elfdata)
 
     pid = getpid();
 
-#if TIMING
-    struct timeval t0, t1;
-    gettimeofday(&t0, 0);
-#endif
-
     /* NOTE: we store the elfdata pointer on a special location
      *       of the temporary TLS area in order to pass it to
      *       the C Library's runtime initializer.
@@ -2120,11 +4712,6 @@ unsigned __linker_init(unsigned **elfdata)
 
     pid = getpid();
 
-#if TIMING
-    struct timeval t0, t1;
-    gettimeofday(&t0, 0);
-#endif
-
     /* Initialize environment functions, and get to the ELF aux vectors table */
     vecs = linker_env_init(vecs);
 
@@ -2225,20 +4812,6 @@ unsigned __linker_init(unsigned **elfdata)
     somain = si;
 #endif
 
-#if TIMING
-    gettimeofday(&t1,NULL);
-    PRINT("LINKER TIME: %s: %d microseconds\n", argv[0], (int) (
-               (((long long)t1.tv_sec * 1000000LL) + (long long)t1.tv_usec) -
-               (((long long)t0.tv_sec * 1000000LL) + (long long)t0.tv_usec)
-               ));
-#endif
-#if STATS
-    PRINT("RELO STATS: %s: %d abs, %d rel, %d copy, %d symbol\n", argv[0],
-           linker_stats.reloc[RELOC_ABSOLUTE],
-           linker_stats.reloc[RELOC_RELATIVE],
-           linker_stats.reloc[RELOC_COPY],
-           linker_stats.reloc[RELOC_SYMBOL]);
-#endif
 #if COUNT_PAGES
     {
         unsigned n;
@@ -2257,7 +4830,7 @@ unsigned __linker_init(unsigned **elfdata)
     }
 #endif
 
-#if TIMING || STATS || COUNT_PAGES
+#if COUNT_PAGES
     fflush(stdout);
 #endif
 
@@ -32,6 +32,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <elf.h>
+#include <pthread.h>
 
 #undef PAGE_MASK
 #undef PAGE_SIZE
@@ -103,9 +104,20 @@ typedef struct soinfo soinfo;
 #define FLAG_LINKED     0x00000001
 #define FLAG_ERROR      0x00000002
 #define FLAG_EXE        0x00000004 // The main executable
+#define FLAG_GNU_HASH   0x00000008 // Symbols are looked up via DT_GNU_HASH
+#define FLAG_SYMCACHE   0x00000020 // Definitions are in the symbol cache
+#define FLAG_PRELINKED  0x00000040 // Loaded at its prelinked base
+#define FLAG_LAZY_PLT   0x00000080 // PLT is bound on first call
+#define FLAG_HUGE_TEXT  0x00000100 // Text is remapped to huge pages
+#define FLAG_TEXTREL    0x00000200 // Has DT_TEXTREL or DF_TEXTREL
+#define FLAG_BIND_NOW   0x00000400 // Asks for DT_BIND_NOW, DF_BIND_NOW or DF_1_NOW
 
 #define SOINFO_NAME_LEN 128
 
+/* Number of lookup scope entries kept inside the soinfo itself. Libraries
+ * with a longer scope get it from a separate anonymous mapping. */
+#define SOINFO_SCOPE_INLINE 16
+
 struct soinfo
 {
     const char name[SOINFO_NAME_LEN];
@@ -141,6 +153,14 @@ struct soinfo
     Elf_Rel *rel;
     unsigned rel_count;
 
+    /* DT_RELR, and Android packed relocations (DT_ANDROID_REL), which are
+     * decoded and applied like rel once rel is done. */
+    unsigned *relr;
+    unsigned relr_count;
+    const unsigned char *packed_rel;
+    unsigned packed_rel_size;
+    unsigned packed_rel_count;
+
 #ifdef ANDROID_SH_LINKER
     Elf_Rela *plt_rela;
     unsigned plt_rela_count;
@@ -168,6 +188,53 @@ struct soinfo
 
     unsigned refcount;
     struct link_map linkmap;
+
+    /* DT_GNU_HASH table, used instead of DT_HASH when FLAG_GNU_HASH is set.
+     * gnu_maskwords is stored as a mask (number of bloom words - 1). */
+    unsigned gnu_nbucket;
+    unsigned gnu_maskwords;
+    unsigned gnu_shift2;
+    unsigned *gnu_bloom_filter;
+    unsigned *gnu_bucket;
+    unsigned *gnu_chain;
+
+    /* Symbol lookup scope, in search order: this library, the LD_PRELOADs
+     * and then its DT_NEEDED libraries. Built once by link_image() before
+     * relocating, so that _do_lookup() doesn't have to rediscover it from
+     * the dynamic section for every symbol. */
+    soinfo **scope;
+    unsigned scope_count;
+    soinfo *scope_buf[SOINFO_SCOPE_INLINE];
+
+    Elf_Addr gnu_relro_start;
+    unsigned gnu_relro_len;
+
+    /* Number of leading R_*_RELATIVE entries in rel (DT_RELCOUNT), how
+     * many of them hybris-prelink applied in the file, and for which
+     * base. */
+    unsigned relcount;
+    unsigned prelink_relcount;
+    unsigned prelink_base;
+
+    /* Next soinfo in the same bucket of the find_library() name index */
+    soinfo *name_next;
+
+    /* Defined symbols sorted by address for dladdr(), built on first use */
+    struct symaddr *symaddr;
+    unsigned symaddr_count;
+
+    /* Per-library statistics, NULL unless HYBRIS_LINKER_STATS is set */
+    struct hybris_linker_lib_stats *stats;
+
+    /* PREFAULT_* policies it was mapped with, see prefault_policy() */
+    unsigned prefault;
+
+    /* Identity of the file the library was loaded from, zero for the
+     * executable and the linker. Used to validate the resolution cache. */
+    unsigned file_dev;
+    unsigned file_ino;
+    unsigned file_mtime;
+    unsigned file_size;
 };
 
 
@@ -229,6 +296,30 @@ extern soinfo libdl_info;
 #define DT_PREINIT_ARRAYSZ 33
 #endif
 
+#ifndef DT_GNU_HASH
+#define DT_GNU_HASH        0x6ffffef5
+#endif
+
+#ifndef DT_RELCOUNT
+#define DT_RELCOUNT        0x6ffffffa
+#endif
+
+#ifndef DT_RELRSZ
+#define DT_RELRSZ          35
+#define DT_RELR            36
+#define DT_RELRENT         37
+#endif
+
+/* Used by Android before DT_RELR was standardised */
+#define DT_ANDROID_RELR    0x6fffe000
+#define DT_ANDROID_RELRSZ  0x6fffe001
+#define DT_ANDROID_RELRENT 0x6fffe003
+
+#define DT_ANDROID_REL     0x6000000f
+#define DT_ANDROID_RELSZ   0x60000010
+#define DT_ANDROID_RELA    0x60000011
+#define DT_ANDROID_RELASZ  0x60000012
+
 soinfo *find_library(const char *name);
 unsigned unload_library(soinfo *si);
 Elf_Sym *lookup_in_library(soinfo *si, const char *name);
@@ -237,6 +328,15 @@ soinfo *find_containing_library(const void *addr);
 Elf_Sym *find_containing_symbol(const void *addr, soinfo *si);
 const char *linker_get_error(void);
 
+/* The dl lock (dlfcn.c). dlopen() and dlclose() take it exclusively;
+ * dlsym() and dladdr() only look at the link map and take it shared. A
+ * thread holding it exclusively may take it again either way, since
+ * constructors may dlopen() or dlsym(). Lazy PLT binding doesn't take it
+ * at all, see linker_plt_bind(). */
+void dl_lock_exclusive(void);
+void dl_lock_shared(void);
+void dl_unlock(void);
+
 #ifdef ANDROID_ARM_LINKER 
 typedef long unsigned int *_Unwind_Ptr;
 _Unwind_Ptr dl_unwind_find_exidx(_Unwind_Ptr pc, int *pcount);
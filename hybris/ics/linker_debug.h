@@ -31,6 +31,9 @@
 
 #include <stdio.h>
 
+#include "linker_stats.h"
+#include "linker_trace.h"
+
 #ifndef LINKER_DEBUG
 #error LINKER_DEBUG should be defined to either 1 or 0 in Android.mk
 #endif
@@ -38,8 +41,6 @@
 #define TRACE_DEBUG          1
 #define DO_TRACE_LOOKUP      1
 #define DO_TRACE_RELO        1
-#define TIMING               0
-#define STATS                0
 #define COUNT_PAGES          0
 
 /*********************************************************************
@@ -98,33 +99,41 @@ extern int format_fd(int, const char *, ...);
 #define TRACE_TYPE(t,x...)   do {} while (0)
 #endif /* LINKER_DEBUG */
 
-#if STATS
-#define RELOC_ABSOLUTE        0
-#define RELOC_RELATIVE        1
-#define RELOC_COPY            2
-#define RELOC_SYMBOL          3
-#define NUM_RELOC_STATS       4
-
-struct _link_stats {
-    int reloc[NUM_RELOC_STATS];
-};
-extern struct _link_stats linker_stats;
-
-#define COUNT_RELOC(type)                                 \
-        do { if (type >= 0 && type < NUM_RELOC_STATS) {   \
-                linker_stats.reloc[type] += 1;            \
-             } else  {                                    \
-                PRINT("Unknown reloc stat requested\n");  \
-             }                                            \
-           } while(0)
-#else /* !STATS */
-#define COUNT_RELOC(type)     do {} while(0)
-#endif /* STATS */
-
-#if TIMING
-#undef WARN
-#define WARN(x...)           do {} while (0)
-#endif /* TIMING */
+/* Statistics are collected at runtime when HYBRIS_LINKER_STATS is set,
+ * see linker_stats.h. */
+extern struct hybris_linker_stats linker_stats;
+
+#define STATS_ENABLED()       __builtin_expect(linker_stats.enabled, 0)
+
+#define COUNT_LOOKUP(si)      do { if (STATS_ENABLED()) {                  \
+                                      linker_stats.lookups++;             \
+                                      if ((si)->stats)                    \
+                                          (si)->stats->lookups++;         \
+                                  } } while(0)
+#define COUNT_SCOPE_PROBE()   do { if (STATS_ENABLED())                    \
+                                      linker_stats.scope_probes++; } while(0)
+#define COUNT_SYMCACHE_HIT()  do { if (STATS_ENABLED())                    \
+                                      linker_stats.symcache_hits++; } while(0)
+#define COUNT_SYMCACHE_MISS() do { if (STATS_ENABLED())                    \
+                                      linker_stats.symcache_misses++; } while(0)
+#define COUNT_HOOK(si)        do { if ((si)->stats)                        \
+                                      (si)->stats->hook_hits++; } while(0)
+
+unsigned long long linker_stats_now(void);
+struct hybris_linker_lib_stats *linker_stats_new(const char *name);
+int linker_stats_reloc_class(unsigned type);
+void linker_stats_faults(unsigned *minflt, unsigned *majflt, int sign);
+
+/* Timeline events are recorded when HYBRIS_TRACE is set, see
+ * linker_trace.h. */
+extern int linker_trace_on;
+
+#define TRACE_BEGIN(name, arg) do { if (__builtin_expect(linker_trace_on, 0)) \
+                                       hybris_trace_begin("linker", (name),   \
+                                                          (arg)); } while(0)
+#define TRACE_END(name)        do { if (__builtin_expect(linker_trace_on, 0)) \
+                                       hybris_trace_end("linker", (name));    \
+                                  } while(0)
 
 #if COUNT_PAGES
 extern unsigned bitmask[];
@@ -132,7 +132,7 @@ buf_out_length(BufOut *bo)
     return bo->total;
 }
 
-static int
+int
 vformat_buffer(char *buff, size_t buffsize, const char *format, va_list args)
 {
     BufOut bo;
@@ -37,5 +37,7 @@
 /* issues (it uses malloc()/free()) and increases code size  */
 
 int format_buffer(char *buffer, size_t bufsize, const char *format, ...);
+int vformat_buffer(char *buffer, size_t bufsize, const char *format,
+                   va_list args);
 
 #endif /* _LINKER_FORMAT_H */
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2013 Canonical Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HYBRIS_LINKER_OBJECTS_H_
+#define _HYBRIS_LINKER_OBJECTS_H_
+
+/* Objects loaded by the hybris linker.
+ *
+ * They are invisible to glibc's dl_iterate_phdr(), and so to libgcc's and
+ * libunwind's unwinders, perf and gdb. To unwind through them, chain
+ * hybris_dl_iterate_phdr() after dl_iterate_phdr() in whatever lookup the
+ * unwinder uses (e.g. __gnu_Unwind_Find_exidx on ARM), or keep a table up
+ * to date with hybris_register_object_callback().
+ *
+ * With HYBRIS_PERF_MAP set, the functions in the .dynsym of each library
+ * are also listed in /tmp/perf-<pid>.map while the library is loaded.
+ */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct dl_phdr_info;
+
+struct hybris_object_info {
+    const char *name;
+    unsigned long base;             /* load bias */
+    const void *phdr;               /* program headers, in memory */
+    unsigned phnum;
+    unsigned long text_start;       /* executable PT_LOAD segments */
+    unsigned long text_end;
+    const void *exidx;              /* PT_ARM_EXIDX, or NULL */
+    unsigned exidx_count;           /* in 8-byte entries */
+    const void *eh_frame_hdr;       /* PT_GNU_EH_FRAME, or NULL */
+};
+
+/* Called with loaded = 1 once an object is relocated, before its
+ * constructors run, and with loaded = 0 just before it is unmapped. Calls
+ * are made with the dl lock held, so the callback must not dlopen() or
+ * dlclose(). */
+typedef void (*hybris_object_callback)(const struct hybris_object_info *info,
+                                       int loaded, void *data);
+
+/* Registers cb and calls it at once for every object already loaded.
+ * Returns 0, or -1 if too many callbacks are registered. */
+int hybris_register_object_callback(hybris_object_callback cb, void *data);
+
+/* Like dl_iterate_phdr(), over the objects loaded by the hybris linker.
+ * Only dlpi_addr, dlpi_name, dlpi_phdr and dlpi_phnum are filled in, and
+ * size is passed accordingly. */
+int hybris_dl_iterate_phdr(int (*cb)(struct dl_phdr_info *info, size_t size,
+                                     void *data), void *data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _HYBRIS_LINKER_OBJECTS_H_ */
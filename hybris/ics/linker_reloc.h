@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2013 Canonical Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LINKER_RELOC_H_
+#define _LINKER_RELOC_H_
+
+#include <elf.h>
+
+/* The linker's Elf_Rel, for the tools, which don't include linker.h */
+#ifndef _LINKER_H_
+#if defined(__x86_64__)
+typedef Elf64_Rel Elf_Rel;
+#else
+typedef Elf32_Rel Elf_Rel;
+#endif
+#endif
+
+/* Relocation loops and decoders that don't depend on soinfo, so that the
+ * tools can use them too.
+ *
+ * The leading DT_RELCOUNT entries of DT_REL are R_*_RELATIVE relocations
+ * without a symbol, which static linkers emit (with -z combreloc, the
+ * default) sorted by r_offset. They are usually most of the relocations of
+ * a library, and need nothing more than adding the load bias to a word, so
+ * the linker applies them here rather than in the per-entry switch of
+ * reloc_library(). tools/relbench.c times this against synthetic tables. */
+
+/* Applies the count entries at rel for as long as they are RELATIVE
+ * relocations of the given type: the word at base + r_offset gets bias
+ * added. bias is the load base too, unless the words already hold another
+ * base. Returns how many were applied; the caller is left to deal with the
+ * rest. */
+static inline unsigned relative_relocs_apply(unsigned long base,
+                                             unsigned long bias,
+                                             const Elf_Rel *rel,
+                                             unsigned count, unsigned type)
+{
+    unsigned done;
+
+    for (done = 0; done < count; done++, rel++) {
+        if (rel->r_info != type)
+            break;
+        *(unsigned *)(base + rel->r_offset) += bias;
+    }
+    return done;
+}
+
+/* DT_RELR: a compact encoding of RELATIVE relocations. An even entry is
+ * the offset of a word to relocate; an odd entry is a bitmap whose bits 1
+ * to 31 stand for the 31 words after the last word relocated or skipped
+ * so far. Returns the number of words relocated. */
+static inline unsigned relr_apply(unsigned long base, const unsigned *relr,
+                                  unsigned count)
+{
+    unsigned *where = 0;
+    unsigned *p;
+    unsigned bits;
+    unsigned done = 0;
+
+    for (; count > 0; count--, relr++) {
+        if ((*relr & 1) == 0) {
+            where = (unsigned *)(base + *relr);
+            *where++ += base;
+            done++;
+        } else {
+            p = where;
+            for (bits = *relr >> 1; bits != 0; bits >>= 1, p++) {
+                if (bits & 1) {
+                    *p += base;
+                    done++;
+                }
+            }
+            where += 31;
+        }
+    }
+    return done;
+}
+
+/* DT_ANDROID_REL: Android's packed relocations. After the "APS2" magic
+ * comes a stream of SLEB128 numbers: the relocation count, the initial
+ * r_offset, and then groups of relocations, each a size and flags, then
+ * whatever the group shares (its r_offset delta, its r_info), and then
+ * what is left of each relocation. Addends are only used by the RELA
+ * variant, which the ARM and x86 linkers don't support. */
+#define PACKED_RELOC_GROUPED_BY_INFO          1
+#define PACKED_RELOC_GROUPED_BY_OFFSET_DELTA  2
+#define PACKED_RELOC_GROUPED_BY_ADDEND        4
+#define PACKED_RELOC_GROUP_HAS_ADDEND         8
+
+struct packed_reloc_iter {
+    const unsigned char *p;
+    const unsigned char *end;
+    unsigned remaining;         /* relocations not yet returned */
+    unsigned group_left;        /* of those, in the current group */
+    unsigned group_flags;
+    unsigned group_offset_delta;
+    Elf32_Rel rel;
+};
+
+/* Reads a SLEB128 number into *v. Returns -1 at the end of the data. */
+static inline int packed_reloc_sleb(struct packed_reloc_iter *it,
+                                    unsigned *v)
+{
+    unsigned shift = 0;
+    unsigned char byte;
+
+    *v = 0;
+    do {
+        if (it->p == it->end)
+            return -1;
+        byte = *it->p++;
+        if (shift < 32)
+            *v |= (unsigned)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+
+    if (shift < 32 && (byte & 0x40))
+        *v |= ~0u << shift;
+    return 0;
+}
+
+/* Returns 0, or -1 if the data doesn't start like packed relocations */
+static inline int packed_reloc_init(struct packed_reloc_iter *it,
+                                    const unsigned char *data,
+                                    unsigned size)
+{
+    it->p = data;
+    it->end = data + size;
+    it->group_left = 0;
+    it->rel.r_offset = 0;
+    it->rel.r_info = 0;
+    if (size < 4 || data[0] != 'A' || data[1] != 'P' || data[2] != 'S' ||
+        data[3] != '2')
+        return -1;
+    it->p += 4;
+    if (packed_reloc_sleb(it, &it->remaining) < 0 ||
+        packed_reloc_sleb(it, &it->rel.r_offset) < 0)
+        return -1;
+    return 0;
+}
+
+/* Decodes the next relocation into it->rel. Returns 1, 0 once there are
+ * no more, or -1 if the data is corrupt. */
+static inline int packed_reloc_next(struct packed_reloc_iter *it)
+{
+    unsigned v;
+
+    if (it->remaining == 0)
+        return 0;
+
+    if (it->group_left == 0) {
+        if (packed_reloc_sleb(it, &it->group_left) < 0 ||
+            packed_reloc_sleb(it, &it->group_flags) < 0 ||
+            it->group_left == 0 || it->group_left > it->remaining ||
+            (it->group_flags & PACKED_RELOC_GROUP_HAS_ADDEND))
+            return -1;
+        if ((it->group_flags & PACKED_RELOC_GROUPED_BY_OFFSET_DELTA) &&
+            packed_reloc_sleb(it, &it->group_offset_delta) < 0)
+            return -1;
+        if ((it->group_flags & PACKED_RELOC_GROUPED_BY_INFO) &&
+            packed_reloc_sleb(it, &it->rel.r_info) < 0)
+            return -1;
+    }
+
+    if (it->group_flags & PACKED_RELOC_GROUPED_BY_OFFSET_DELTA) {
+        it->rel.r_offset += it->group_offset_delta;
+    } else {
+        if (packed_reloc_sleb(it, &v) < 0)
+            return -1;
+        it->rel.r_offset += v;
+    }
+    if (!(it->group_flags & PACKED_RELOC_GROUPED_BY_INFO) &&
+        packed_reloc_sleb(it, &it->rel.r_info) < 0)
+        return -1;
+
+    it->group_left--;
+    it->remaining--;
+    return 1;
+}
+
+#endif /* _LINKER_RELOC_H_ */
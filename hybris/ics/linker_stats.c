@@ -0,0 +1,205 @@
+/*
+ * Copyright (C) 2013 Canonical Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "linker.h"
+#include "linker_debug.h"
+#include "linker_format.h"
+#include "linker_stats.h"
+
+/* Records are carved out of anonymous mappings, since the linker doesn't
+ * malloc(), and are never freed so that hybris_linker_get_stats() callers
+ * can hold on to them. */
+#define STATS_CHUNK_RECORDS 64
+
+struct hybris_linker_stats linker_stats;
+
+static struct hybris_linker_lib_stats *stats_chunk;
+static unsigned stats_chunk_used = STATS_CHUNK_RECORDS;
+static struct hybris_linker_lib_stats *stats_tail;
+static const char *stats_output;
+
+const struct hybris_linker_stats *hybris_linker_get_stats(void)
+{
+    return &linker_stats;
+}
+
+unsigned long long linker_stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Adds sign times the page faults taken so far by the calling thread, so
+ * that a call with -1 before some work and one with 1 after it count the
+ * faults taken in between. */
+void linker_stats_faults(unsigned *minflt, unsigned *majflt, int sign)
+{
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_THREAD, &ru) < 0)
+        return;
+    *minflt += sign * ru.ru_minflt;
+    *majflt += sign * ru.ru_majflt;
+}
+
+struct hybris_linker_lib_stats *linker_stats_new(const char *name)
+{
+    struct hybris_linker_lib_stats *st;
+
+    if (stats_chunk_used == STATS_CHUNK_RECORDS) {
+        st = mmap(NULL, STATS_CHUNK_RECORDS * sizeof(*st),
+                  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (st == MAP_FAILED)
+            return NULL;
+        stats_chunk = st;
+        stats_chunk_used = 0;
+    }
+
+    st = &stats_chunk[stats_chunk_used++];
+    format_buffer(st->name, sizeof(st->name), "%s", name);
+
+    if (stats_tail)
+        stats_tail->next = st;
+    else
+        linker_stats.libs = st;
+    stats_tail = st;
+    linker_stats.libraries++;
+    return st;
+}
+
+int linker_stats_reloc_class(unsigned type)
+{
+    switch (type) {
+#if defined(ANDROID_ARM_LINKER)
+    case R_ARM_JUMP_SLOT:   return HYBRIS_RELOC_JUMP_SLOT;
+    case R_ARM_GLOB_DAT:    return HYBRIS_RELOC_GLOB_DAT;
+    case R_ARM_ABS32:       return HYBRIS_RELOC_ABSOLUTE;
+    case R_ARM_RELATIVE:    return HYBRIS_RELOC_RELATIVE;
+    case R_ARM_REL32:       return HYBRIS_RELOC_PC_RELATIVE;
+    case R_ARM_COPY:        return HYBRIS_RELOC_COPY;
+#elif defined(ANDROID_X86_LINKER)
+    case R_386_JUMP_SLOT:   return HYBRIS_RELOC_JUMP_SLOT;
+    case R_386_GLOB_DAT:    return HYBRIS_RELOC_GLOB_DAT;
+    case R_386_32:          return HYBRIS_RELOC_ABSOLUTE;
+    case R_386_RELATIVE:    return HYBRIS_RELOC_RELATIVE;
+    case R_386_PC32:        return HYBRIS_RELOC_PC_RELATIVE;
+#endif
+    default:                return HYBRIS_RELOC_OTHER;
+    }
+}
+
+static const char *reloc_class_names[HYBRIS_RELOC_NTYPES] = {
+    [HYBRIS_RELOC_JUMP_SLOT] = "jump_slot",
+    [HYBRIS_RELOC_GLOB_DAT] = "glob_dat",
+    [HYBRIS_RELOC_ABSOLUTE] = "abs",
+    [HYBRIS_RELOC_RELATIVE] = "relative",
+    [HYBRIS_RELOC_PC_RELATIVE] = "pc_rel",
+    [HYBRIS_RELOC_COPY] = "copy",
+    [HYBRIS_RELOC_OTHER] = "other",
+};
+
+static void stats_write(int fd, const char *fmt, ...)
+{
+    char buf[512];
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = vformat_buffer(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if (len > (int)sizeof(buf) - 1)
+        len = sizeof(buf) - 1;
+    write(fd, buf, len);
+}
+
+static void linker_stats_dump(void)
+{
+    const struct hybris_linker_lib_stats *st;
+    unsigned long long reloc_ns;
+    unsigned relocs;
+    unsigned dirty_kb = 0, relro_kb = 0;
+    int fd = 2;
+    int i;
+
+    if (stats_output)
+        fd = open(stats_output, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+        return;
+
+    stats_write(fd, "HYBRIS LINKER STATS (pid %d): %d libraries, %d lookups, "
+                "%d scope probes, symcache %d hits / %d misses\n", getpid(),
+                linker_stats.libraries, linker_stats.lookups,
+                linker_stats.scope_probes, linker_stats.symcache_hits,
+                linker_stats.symcache_misses);
+    stats_write(fd, "%-32s %10s %10s %10s %10s %8s %8s %6s %8s %6s %5s %7s "
+                "%8s %8s\n", "library", "open us", "load us", "reloc us",
+                "ctor us", "relocs", "lookups", "hooks", "minflt", "majflt",
+                "huge", "textrel", "dirty kB", "relro kB");
+
+    for (st = linker_stats.libs; st != NULL; st = st->next) {
+        reloc_ns = 0;
+        relocs = 0;
+        for (i = 0; i < HYBRIS_RELOC_NTYPES; i++) {
+            reloc_ns += st->reloc_ns[i];
+            relocs += st->reloc_count[i];
+        }
+        stats_write(fd, "%-32s %10llu %10llu %10llu %10llu %8d %8d %6d %8d "
+                    "%6d %5d %7d %8d %8d\n", st->name, st->open_ns / 1000,
+                    st->load_ns / 1000, reloc_ns / 1000, st->ctor_ns / 1000,
+                    relocs, st->lookups, st->hook_hits, st->minflt,
+                    st->majflt, st->huge_pages, st->textrel_pages,
+                    st->dirty_kb, st->relro_kb);
+        dirty_kb += st->dirty_kb;
+        relro_kb += st->relro_kb;
+        for (i = 0; i < HYBRIS_RELOC_NTYPES; i++) {
+            if (st->reloc_count[i] == 0)
+                continue;
+            stats_write(fd, "    %-28s %10llu us %8d\n", reloc_class_names[i],
+                        st->reloc_ns[i] / 1000, st->reloc_count[i]);
+        }
+    }
+
+    stats_write(fd, "%d kB private dirty in %d libraries, %d kB of RELRO "
+                "shared instead\n", dirty_kb, linker_stats.libraries,
+                relro_kb);
+
+    if (fd != 2)
+        close(fd);
+}
+
+static void __attribute__((constructor)) linker_stats_init(void)
+{
+    const char *env = getenv("HYBRIS_LINKER_STATS");
+
+    if (env == NULL || *env == '\0' || !strcmp(env, "0"))
+        return;
+
+    if (strcmp(env, "1"))
+        stats_output = env;
+    linker_stats.enabled = 1;
+    atexit(linker_stats_dump);
+}
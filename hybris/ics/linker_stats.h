@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2013 Canonical Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HYBRIS_LINKER_STATS_H_
+#define _HYBRIS_LINKER_STATS_H_
+
+/* Linker statistics.
+ *
+ * Collected when libhybris is loaded with HYBRIS_LINKER_STATS set: to 1 to
+ * print a report to stderr at exit, or to a file name to append it there.
+ * Times are in nanoseconds of CLOCK_MONOTONIC and include any nested work,
+ * e.g. a constructor that dlopen()s another library.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HYBRIS_LINKER_STATS_NAME_LEN 128
+
+/* Relocation classes that reloc_ns/reloc_count are split by */
+enum {
+    HYBRIS_RELOC_JUMP_SLOT,     /* R_ARM_JUMP_SLOT, R_386_JUMP_SLOT */
+    HYBRIS_RELOC_GLOB_DAT,      /* R_ARM_GLOB_DAT, R_386_GLOB_DAT */
+    HYBRIS_RELOC_ABSOLUTE,      /* R_ARM_ABS32, R_386_32 */
+    HYBRIS_RELOC_RELATIVE,      /* R_ARM_RELATIVE, R_386_RELATIVE */
+    HYBRIS_RELOC_PC_RELATIVE,   /* R_ARM_REL32, R_386_PC32 */
+    HYBRIS_RELOC_COPY,          /* R_ARM_COPY */
+    HYBRIS_RELOC_OTHER,
+    HYBRIS_RELOC_NTYPES
+};
+
+struct hybris_linker_lib_stats {
+    const struct hybris_linker_lib_stats *next; /* in load order */
+    char name[HYBRIS_LINKER_STATS_NAME_LEN];
+
+    unsigned long long open_ns;         /* open_library() */
+    unsigned long long load_ns;         /* load_segments() */
+    unsigned long long reloc_ns[HYBRIS_RELOC_NTYPES];
+    unsigned reloc_count[HYBRIS_RELOC_NTYPES];
+    unsigned long long ctor_ns;         /* constructors */
+
+    /* Page faults taken by the loading threads while mapping, relocating and
+     * running constructors, not counting those of the dependencies */
+    unsigned minflt;
+    unsigned majflt;
+
+    unsigned huge_pages;                /* of text, see HYBRIS_LD_HUGE_TEXT */
+    unsigned textrel_pages;             /* made writable for DT_TEXTREL */
+    unsigned dirty_kb;                  /* Private_Dirty once linked */
+    unsigned relro_kb;                  /* shared, see HYBRIS_LD_RELRO_DIR */
+
+    unsigned lookups;                   /* symbols looked up */
+    unsigned hook_hits;                 /* symbols resolved to a hook */
+};
+
+struct hybris_linker_stats {
+    int enabled;
+    unsigned libraries;                 /* entries in libs */
+    unsigned lookups;
+    unsigned scope_probes;              /* libraries searched for them */
+    unsigned symcache_hits;
+    unsigned symcache_misses;
+    const struct hybris_linker_lib_stats *libs;
+};
+
+/* Returns the statistics collected so far. Records are never freed, so the
+ * result stays valid; libraries loaded later are appended to libs. */
+const struct hybris_linker_stats *hybris_linker_get_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _HYBRIS_LINKER_STATS_H_ */
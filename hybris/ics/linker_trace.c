@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2013 Canonical Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "linker.h"
+#include "linker_debug.h"
+#include "linker_format.h"
+#include "linker_trace.h"
+
+/* Each thread appends to the chunk its trace_chunk points to. Only the
+ * owning thread writes a chunk; it publishes an event by bumping count
+ * after a barrier, so the exit handler can read any chunk without locking.
+ * Full chunks are kept and a fresh one is pushed onto trace_chunks with a
+ * compare-and-swap. Like the rest of the linker this doesn't malloc(). */
+#define TRACE_CHUNK_EVENTS 1024
+
+struct trace_event {
+    unsigned long long ts;
+    const char *cat;
+    const char *name;
+    char phase;
+    char arg[HYBRIS_TRACE_ARG_LEN];
+};
+
+struct trace_chunk {
+    struct trace_chunk *next;
+    pid_t tid;
+    unsigned count;
+    struct trace_event events[TRACE_CHUNK_EVENTS];
+};
+
+int linker_trace_on;
+
+static struct trace_chunk *trace_chunks;
+static __thread struct trace_chunk *trace_chunk;
+static const char *trace_output;
+static pid_t trace_pid;
+
+int hybris_trace_enabled(void)
+{
+    return linker_trace_on;
+}
+
+static struct trace_chunk *trace_new_chunk(void)
+{
+    struct trace_chunk *c;
+
+    c = mmap(NULL, sizeof(*c), PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (c == MAP_FAILED)
+        return NULL;
+    c->tid = syscall(SYS_gettid);
+    do {
+        c->next = trace_chunks;
+    } while (!__sync_bool_compare_and_swap(&trace_chunks, c->next, c));
+    return c;
+}
+
+static void trace_record(char phase, const char *cat, const char *name,
+                         const char *arg)
+{
+    struct trace_chunk *c = trace_chunk;
+    struct trace_event *ev;
+    struct timespec ts;
+
+    if (c == NULL || c->count == TRACE_CHUNK_EVENTS) {
+        c = trace_new_chunk();
+        if (c == NULL)
+            return;
+        trace_chunk = c;
+    }
+
+    ev = &c->events[c->count];
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ev->ts = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    ev->cat = cat;
+    ev->name = name;
+    ev->phase = phase;
+    if (arg)
+        format_buffer(ev->arg, sizeof(ev->arg), "%s", arg);
+    else
+        ev->arg[0] = '\0';
+
+    __sync_synchronize();
+    c->count++;
+}
+
+void hybris_trace_begin(const char *cat, const char *name, const char *arg)
+{
+    if (linker_trace_on)
+        trace_record('B', cat, name, arg);
+}
+
+void hybris_trace_end(const char *cat, const char *name)
+{
+    if (linker_trace_on)
+        trace_record('E', cat, name, NULL);
+}
+
+struct trace_out {
+    int fd;
+    int len;
+    char buf[4096];
+};
+
+static void trace_flush(struct trace_out *out)
+{
+    if (out->len > 0)
+        write(out->fd, out->buf, out->len);
+    out->len = 0;
+}
+
+static void trace_put(struct trace_out *out, const char *s, int len)
+{
+    if (out->len + len > (int)sizeof(out->buf))
+        trace_flush(out);
+    memcpy(out->buf + out->len, s, len);
+    out->len += len;
+}
+
+static void trace_puts(struct trace_out *out, const char *s)
+{
+    trace_put(out, s, strlen(s));
+}
+
+/* Library paths and symbol names are ordinary strings, but don't let one
+ * break the JSON if it isn't. */
+static void trace_put_escaped(struct trace_out *out, const char *s)
+{
+    char esc[8];
+
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            esc[0] = '\\';
+            esc[1] = *s;
+            trace_put(out, esc, 2);
+        } else if ((unsigned char)*s < 0x20) {
+            trace_put(out, esc, format_buffer(esc, sizeof(esc), "\\u%04x",
+                                              (unsigned char)*s));
+        } else
+            trace_put(out, s, 1);
+    }
+}
+
+static void trace_write_event(struct trace_out *out, pid_t tid,
+                              const struct trace_event *ev, int first)
+{
+    char buf[128];
+
+    trace_put(out, buf, format_buffer(buf, sizeof(buf),
+              "%s\n{\"name\":\"", first ? "" : ","));
+    trace_put_escaped(out, ev->name);
+    trace_put(out, buf, format_buffer(buf, sizeof(buf),
+              "\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03u,"
+              "\"pid\":%d,\"tid\":%d", ev->cat, ev->phase, ev->ts / 1000,
+              (unsigned)(ev->ts % 1000), trace_pid, tid));
+    if (ev->arg[0]) {
+        trace_puts(out, ",\"args\":{\"arg\":\"");
+        trace_put_escaped(out, ev->arg);
+        trace_puts(out, "\"}");
+    }
+    trace_puts(out, "}");
+}
+
+static void linker_trace_dump(void)
+{
+    static struct trace_out out;
+    const struct trace_chunk *c;
+    char path[PATH_MAX];
+    unsigned i, count;
+    int first = 1;
+
+    /* A forked child inherits our events and the file name; leave the
+     * file to the parent. */
+    if (getpid() != trace_pid)
+        return;
+    linker_trace_on = 0;
+
+    if (trace_output[strlen(trace_output) - 1] == '/') {
+        if (format_buffer(path, sizeof(path), "%shybris-trace-%d.json",
+                          trace_output, trace_pid) >= (int)sizeof(path))
+            return;
+    } else
+        format_buffer(path, sizeof(path), "%s", trace_output);
+
+    out.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out.fd < 0)
+        return;
+    out.len = 0;
+
+    /* Chunks are listed newest first; viewers order events by ts. */
+    trace_puts(&out, "{\"traceEvents\":[");
+    for (c = trace_chunks; c != NULL; c = c->next) {
+        count = c->count;
+        __sync_synchronize();
+        for (i = 0; i < count; i++) {
+            trace_write_event(&out, c->tid, &c->events[i], first);
+            first = 0;
+        }
+    }
+    trace_puts(&out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+    trace_flush(&out);
+    close(out.fd);
+}
+
+static void __attribute__((constructor)) linker_trace_init(void)
+{
+    const char *env = getenv("HYBRIS_TRACE");
+
+    if (env == NULL || *env == '\0')
+        return;
+
+    trace_output = env;
+    trace_pid = getpid();
+    linker_trace_on = 1;
+    atexit(linker_trace_dump);
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2013 Canonical Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HYBRIS_LINKER_TRACE_H_
+#define _HYBRIS_LINKER_TRACE_H_
+
+/* Timeline tracing.
+ *
+ * Enabled when libhybris is loaded with HYBRIS_TRACE set to a file name, or
+ * to a directory ending in '/' to write <dir>/hybris-trace-<pid>.json. The
+ * file is written at exit in the Chrome trace-event JSON format and can be
+ * opened in about:tracing or Perfetto.
+ *
+ * Each thread records into its own buffer without taking any lock. Nested
+ * begin/end pairs on one thread show up as nested slices. cat and name must
+ * be string constants, as only the pointers are kept; arg is copied (and
+ * truncated to HYBRIS_TRACE_ARG_LEN - 1 characters) and may be NULL.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HYBRIS_TRACE_ARG_LEN 44
+
+int hybris_trace_enabled(void);
+void hybris_trace_begin(const char *cat, const char *name, const char *arg);
+void hybris_trace_end(const char *cat, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _HYBRIS_LINKER_TRACE_H_ */
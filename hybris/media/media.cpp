@@ -23,6 +23,8 @@
 #include <dlfcn.h>
 #include <stddef.h>
 
+#include "linker_trace.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -44,8 +46,11 @@ struct MediaPlayerBridge
         return "/system/lib/libmedia_compat_layer.so";
     }
 
-    MediaPlayerBridge() : libmediaplayer_handle(android_dlopen(path_to_library(), RTLD_LAZY))
+    MediaPlayerBridge() : libmediaplayer_handle(NULL)
     {
+        hybris_trace_begin("bridge", "MediaPlayerBridge", path_to_library());
+        libmediaplayer_handle = android_dlopen(path_to_library(), RTLD_LAZY);
+        hybris_trace_end("bridge", "MediaPlayerBridge");
         assert(libmediaplayer_handle && "Error loading media player library from /system/lib/libmedia_compat_layer.so");
     }
 
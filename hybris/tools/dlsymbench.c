@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2013 Canonical Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * hybris-dlsymbench: time concurrent android_dlsym() calls
+ *
+ * Usage: hybris-dlsymbench [-n iterations] [-w] library symbol...
+ *
+ * Opens library with android_dlopen() and looks the symbols up in turn
+ * from 1, 2, 4 and 8 threads at once, the way the EGL, GLES and camera
+ * wrappers resolve their entry points on first use. Times are in ns per
+ * android_dlsym() call, best of three runs. dlsym() holds the dl lock
+ * shared, so with enough CPUs the time stays flat as threads are added.
+ *
+ * With -w, another thread keeps calling android_dlopen() and
+ * android_dlclose() on the library meanwhile, taking the dl lock
+ * exclusively each time; its own count of pairs is printed as well.
+ */
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+extern void *android_dlopen(const char *filename, int flag);
+extern void *android_dlsym(void *handle, const char *symbol);
+extern int android_dlclose(void *handle);
+
+struct worker {
+    pthread_t thread;
+    unsigned iterations;
+    unsigned first;             /* symbol to start with */
+};
+
+static const char *library;
+static void *handle;
+static char **symbols;
+static int nsymbols;
+
+static volatile int start_flag;
+static volatile int stop_flag;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    unsigned i, n = w->first;
+
+    while (!start_flag)
+        ;
+    for (i = 0; i < w->iterations; i++) {
+        if (android_dlsym(handle, symbols[n]) == NULL) {
+            fprintf(stderr, "%s: %s not found\n", library, symbols[n]);
+            exit(1);
+        }
+        if (++n == (unsigned)nsymbols)
+            n = 0;
+    }
+    return NULL;
+}
+
+static void *writer_main(void *arg)
+{
+    unsigned long *pairs = arg;
+    void *h;
+
+    while (!stop_flag) {
+        h = android_dlopen(library, RTLD_NOW);
+        if (h != NULL)
+            android_dlclose(h);
+        (*pairs)++;
+    }
+    return NULL;
+}
+
+static int usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [-n iterations] [-w] library symbol...\n",
+            argv0);
+    return 1;
+}
+
+/* ns per android_dlsym() call over threads threads */
+static double run(int threads, unsigned iterations)
+{
+    struct worker w[threads];
+    uint64_t t, best = ~0ULL;
+    int round, i;
+
+    for (round = 0; round < 3; round++) {
+        start_flag = 0;
+        for (i = 0; i < threads; i++) {
+            w[i].iterations = iterations;
+            w[i].first = i % nsymbols;
+            pthread_create(&w[i].thread, NULL, worker_main, &w[i]);
+        }
+        t = now_ns();
+        start_flag = 1;
+        for (i = 0; i < threads; i++)
+            pthread_join(w[i].thread, NULL);
+        t = now_ns() - t;
+
+        if (t < best)
+            best = t;
+    }
+    return (double)best / ((double)threads * iterations);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned iterations = 1000000;
+    unsigned long pairs = 0;
+    pthread_t writer;
+    int with_writer = 0;
+    int opt, n;
+
+    while ((opt = getopt(argc, argv, "n:w")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 'w':
+            with_writer = 1;
+            break;
+        default:
+            return usage(argv[0]);
+        }
+    }
+    if (argc - optind < 2)
+        return usage(argv[0]);
+    library = argv[optind];
+    symbols = &argv[optind + 1];
+    nsymbols = argc - optind - 1;
+
+    handle = android_dlopen(library, RTLD_NOW);
+    if (handle == NULL) {
+        fprintf(stderr, "%s: cannot load\n", library);
+        return 1;
+    }
+
+    if (with_writer)
+        pthread_create(&writer, NULL, writer_main, &pairs);
+
+    printf("dlsym %s%s", library, with_writer ? " (dlopen/dlclose running)" :
+                                                "");
+    for (n = 1; n <= 8; n *= 2)
+        printf(" %d: %6.1f ns", n, run(n, iterations / n));
+    printf("\n");
+
+    if (with_writer) {
+        stop_flag = 1;
+        pthread_join(writer, NULL);
+        printf("dlopen/dlclose pairs meanwhile: %lu\n", pairs);
+    }
+
+    android_dlclose(handle);
+    return 0;
+}
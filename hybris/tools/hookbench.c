@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2013 Canonical Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * hybris-hookbench: time get_hooked_symbol() over a large symbol set
+ *
+ * Usage: hybris-hookbench [-n symbols] [-r rounds] [hooks.gperf]
+ *
+ * Builds the imports of a synthetic library with 50000 undefined symbols
+ * by default, one in ten of them a hooked name read from the hook table
+ * (common/hooks.gperf), and the rest C++ names nothing hooks. The linker
+ * calls get_hooked_symbol() once for each of them before looking them up,
+ * so going through the whole set is the startup cost of hooking:
+ *
+ *   gperf   get_hooked_symbol(), a perfect hash and one compare
+ *   linear  getenv("GRAPHICS") and a strcmp() over every entry of the
+ *           table, which is what get_hooked_symbol() used to do
+ *
+ * The best of rounds (5 by default) runs is reported, in ns per symbol and
+ * ms for the whole set, along with how many symbols each found hooked.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+extern void *get_hooked_symbol(char *sym);
+
+#define HOOKS_MAX 1024
+
+static char *hooks[HOOKS_MAX];
+static int nhooks;
+static int nvidia_hack;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Reads the names between the two %% lines of the gperf input */
+static int read_hooks(const char *path)
+{
+    char line[256], *comma;
+    int in_table = 0;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), f) != NULL && nhooks < HOOKS_MAX) {
+        if (!strncmp(line, "%%", 2)) {
+            if (in_table)
+                break;
+            in_table = 1;
+            continue;
+        }
+        if (!in_table || line[0] == '#')
+            continue;
+        if ((comma = strchr(line, ',')) == NULL)
+            continue;
+        *comma = '\0';
+        hooks[nhooks++] = strdup(line);
+    }
+    fclose(f);
+    return nhooks > 0 ? 0 : -1;
+}
+
+static void *lookup_gperf(char *sym)
+{
+    return get_hooked_symbol(sym);
+}
+
+static void *lookup_linear(char *sym)
+{
+    char *graphics = getenv("GRAPHICS");
+    int i;
+
+    nvidia_hack = graphics != NULL && strcmp("NVIDIA", graphics) == 0;
+    for (i = 0; i < nhooks; i++) {
+        if (strcmp(sym, hooks[i]) == 0)
+            return hooks[i];
+    }
+    return NULL;
+}
+
+static void run(const char *name, void *(*lookup)(char *), char **symbols,
+                int n, int rounds)
+{
+    uint64_t t, best = ~0ULL;
+    int round, i, hits = 0;
+
+    for (round = 0; round < rounds; round++) {
+        hits = 0;
+        t = now_ns();
+        for (i = 0; i < n; i++) {
+            if (lookup(symbols[i]) != NULL)
+                hits++;
+        }
+        t = now_ns() - t;
+        if (t < best)
+            best = t;
+    }
+    printf("%-7s %7.1f ns/symbol %8.2f ms for %d symbols, %d hooked\n",
+           name, (double)best / n, best / 1000000.0, n, hits);
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = "common/hooks.gperf";
+    char **symbols, name[64];
+    int n = 50000, rounds = 5;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+        switch (opt) {
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n symbols] [-r rounds] "
+                    "[hooks.gperf]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc)
+        path = argv[optind];
+    if (n < 1)
+        n = 1;
+    if (rounds < 1)
+        rounds = 1;
+
+    if (read_hooks(path) < 0) {
+        fprintf(stderr, "%s: no hooks read from %s\n", argv[0], path);
+        return 1;
+    }
+
+    /* None of the made up names contains "pthread", which
+     * get_hooked_symbol() treats specially */
+    symbols = malloc(n * sizeof(*symbols));
+    for (i = 0; i < n; i++) {
+        if (i % 10 == 0) {
+            symbols[i] = hooks[(i / 10) % nhooks];
+        } else {
+            snprintf(name, sizeof(name), "_ZN7android%dGLContext%dEPKv",
+                     i % 97, i);
+            symbols[i] = strdup(name);
+        }
+    }
+
+    run("gperf", lookup_gperf, symbols, n, rounds);
+    run("linear", lookup_linear, symbols, n, rounds);
+    return 0;
+}
@@ -0,0 +1,470 @@
+/*
+ * Copyright (C) 2013 Canonical Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * hybris-loadtest: check how the linker loads the newer relocation formats
+ *
+ * Usage: [HYBRIS_LINKER_STATS=/dev/null] hybris-loadtest
+ *
+ * Writes small shared objects to a temporary directory and loads them with
+ * android_dlopen(), so that they go through find_library() and link_image()
+ * like any library. Each has a read-only page that it relocates through
+ * DT_TEXTREL and a writable one, and defines two symbols:
+ *
+ *   relr    DT_RELR, then the same table under the DT_ANDROID_RELR tags:
+ *           the listed words get the base added and no other word changes,
+ *           the read-only page is read-only again afterwards, and, with
+ *           HYBRIS_LINKER_STATS set, every word is counted as RELATIVE
+ *   packed  DT_REL followed by DT_ANDROID_REL with HYBRIS_LD_CACHE_DIR set:
+ *           both tables are applied, read-only targets included, and the
+ *           resolution cache has one slot per relocation, numbered DT_REL
+ *           first, with the symbols bound where they were; loading it
+ *           again takes the symbols from that cache
+ *   reject  DT_ANDROID_RELA and a DT_RELRENT other than 4 fail to load
+ *
+ * Prints one line per check and exits with 1 if any failed. Only builds
+ * for the 32-bit ARM and x86 targets the linker supports.
+ */
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "linker.h"
+#include "linker_stats.h"
+
+extern void *android_dlopen(const char *filename, int flag);
+extern int android_dlclose(void *handle);
+
+#if defined(__arm__)
+#define MACHINE    EM_ARM
+#define R_ABS      R_ARM_ABS32
+#define R_RELATIVE R_ARM_RELATIVE
+#else
+#define MACHINE    EM_386
+#define R_ABS      R_386_32
+#define R_RELATIVE R_386_RELATIVE
+#endif
+
+/* Layout of the images: headers and tables in the first page, then the
+ * read-only page the text relocations go to, then a writable page with
+ * the dynamic section and data words. */
+#define IMAGE_SIZE  (3 * PAGE_SIZE)
+#define TABLES_OFF  0x200
+#define TEXT_OFF    PAGE_SIZE
+#define DATA_OFF    (2 * PAGE_SIZE)
+#define WORDS_OFF   (DATA_OFF + 0x200)
+#define WORDS       64
+
+/* Symbol 1 is at the data words, symbol 2 at the text words */
+#define SYM_DATA    1
+#define SYM_TEXT    2
+
+struct image {
+    unsigned char buf[IMAGE_SIZE];
+    unsigned used;              /* of the first page */
+    unsigned *dyn;
+    unsigned ndyn;
+};
+
+static char dir[] = "/tmp/hybris-loadtestXXXXXX";
+static int failures;
+
+static void check(const char *what, int ok)
+{
+    printf("%-58s %s\n", what, ok ? "ok" : "FAIL");
+    if (!ok)
+        failures++;
+}
+
+/* The addend each word starts with, distinct so that a word relocated
+ * twice or in the wrong place shows */
+static unsigned text_addend(unsigned i)
+{
+    return 0x100 + i * 8;
+}
+
+static unsigned data_addend(unsigned i)
+{
+    return 0x4000 + i * 8;
+}
+
+static unsigned *image_words(struct image *img, unsigned off)
+{
+    return (unsigned *)(img->buf + off);
+}
+
+/* Copies len bytes into the first page, and returns their offset */
+static unsigned image_add(struct image *img, const void *data, unsigned len)
+{
+    unsigned off = img->used;
+
+    memcpy(img->buf + off, data, len);
+    img->used = (off + len + 3) & ~3;
+    return off;
+}
+
+static void image_dyn(struct image *img, unsigned tag, unsigned val)
+{
+    img->dyn[img->ndyn++] = tag;
+    img->dyn[img->ndyn++] = val;
+}
+
+/* Headers, symbols and the words to relocate. The caller adds its
+ * relocation tables and dynamic entries, and then calls image_write(). */
+static void image_init(struct image *img)
+{
+    static const char strtab[] = "\0loadtest_data\0loadtest_text";
+    Elf32_Ehdr *ehdr = (Elf32_Ehdr *)img->buf;
+    Elf32_Phdr *phdr = (Elf32_Phdr *)(ehdr + 1);
+    Elf32_Sym syms[3];
+    unsigned hash[2 + 1 + 3];
+    unsigned i, symtab_off, strtab_off, hash_off;
+
+    memset(img, 0, sizeof(*img));
+    memcpy(ehdr->e_ident, ELFMAG, SELFMAG);
+    ehdr->e_ident[EI_CLASS] = ELFCLASS32;
+    ehdr->e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr->e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr->e_type = ET_DYN;
+    ehdr->e_machine = MACHINE;
+    ehdr->e_version = EV_CURRENT;
+    ehdr->e_phoff = sizeof(*ehdr);
+    ehdr->e_ehsize = sizeof(*ehdr);
+    ehdr->e_phentsize = sizeof(*phdr);
+    ehdr->e_phnum = 3;
+
+    phdr[0].p_type = PT_LOAD;
+    phdr[0].p_flags = PF_R | PF_X;
+    phdr[0].p_filesz = phdr[0].p_memsz = DATA_OFF;
+    phdr[0].p_align = PAGE_SIZE;
+    phdr[1].p_type = PT_LOAD;
+    phdr[1].p_flags = PF_R | PF_W;
+    phdr[1].p_offset = phdr[1].p_vaddr = DATA_OFF;
+    phdr[1].p_filesz = phdr[1].p_memsz = PAGE_SIZE;
+    phdr[1].p_align = PAGE_SIZE;
+    phdr[2].p_type = PT_DYNAMIC;
+    phdr[2].p_flags = PF_R | PF_W;
+    phdr[2].p_offset = phdr[2].p_vaddr = DATA_OFF;
+    phdr[2].p_filesz = phdr[2].p_memsz = 0x200;
+    img->used = TABLES_OFF;
+
+    memset(syms, 0, sizeof(syms));
+    syms[SYM_DATA].st_name = 1;
+    syms[SYM_DATA].st_value = WORDS_OFF;
+    syms[SYM_DATA].st_info = ELF32_ST_INFO(STB_GLOBAL, STT_OBJECT);
+    syms[SYM_DATA].st_shndx = 1;
+    syms[SYM_TEXT].st_name = 15;
+    syms[SYM_TEXT].st_value = TEXT_OFF;
+    syms[SYM_TEXT].st_info = ELF32_ST_INFO(STB_GLOBAL, STT_OBJECT);
+    syms[SYM_TEXT].st_shndx = 1;
+    symtab_off = image_add(img, syms, sizeof(syms));
+    strtab_off = image_add(img, strtab, sizeof(strtab));
+
+    /* One bucket chaining both symbols */
+    hash[0] = 1;
+    hash[1] = 3;
+    hash[2] = SYM_TEXT;
+    hash[3] = 0;
+    hash[4] = 0;
+    hash[5] = SYM_DATA;
+    hash_off = image_add(img, hash, sizeof(hash));
+
+    for (i = 0; i < WORDS; i++) {
+        image_words(img, TEXT_OFF)[i] = text_addend(i);
+        image_words(img, WORDS_OFF)[i] = data_addend(i);
+    }
+
+    img->dyn = image_words(img, DATA_OFF);
+    image_dyn(img, DT_HASH, hash_off);
+    image_dyn(img, DT_SYMTAB, symtab_off);
+    image_dyn(img, DT_SYMENT, sizeof(Elf32_Sym));
+    image_dyn(img, DT_STRTAB, strtab_off);
+    image_dyn(img, DT_STRSZ, sizeof(strtab));
+    image_dyn(img, DT_TEXTREL, 0);
+}
+
+/* Writes the image to dir/name, and returns the path */
+static const char *image_write(struct image *img, const char *name)
+{
+    static char path[256];
+    int fd;
+
+    image_dyn(img, DT_NULL, 0);
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, img->buf, IMAGE_SIZE) != IMAGE_SIZE) {
+        perror(path);
+        exit(1);
+    }
+    close(fd);
+    return path;
+}
+
+/* Returns 1 if the page at addr is mapped writable */
+static int writable(unsigned addr)
+{
+    unsigned long start, end;
+    char perms[5], line[256];
+    int ret = 0;
+    FILE *f;
+
+    f = fopen("/proc/self/maps", "r");
+    if (f == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "%lx-%lx %4s", &start, &end, perms) == 3 &&
+            addr >= start && addr < end) {
+            ret = perms[1] == 'w';
+            break;
+        }
+    }
+    fclose(f);
+    return ret;
+}
+
+/* Returns 1 if the words of the loaded image at si are their addends plus
+ * what adjust says for them */
+static int words_are(soinfo *si, unsigned off, unsigned (*addend)(unsigned),
+                     const unsigned *adjust)
+{
+    const unsigned *words = (const unsigned *)(si->base + off);
+    unsigned i;
+
+    for (i = 0; i < WORDS; i++) {
+        if (words[i] != addend(i) + adjust[i])
+            return 0;
+    }
+    return 1;
+}
+
+/* Text words 0, 1 and 3, and data words 0 to 31: an address entry and a
+ * bitmap each */
+static const unsigned relr[] = {
+    TEXT_OFF, (1 << 1) | (1 << 3) | 1,
+    WORDS_OFF, 0xffffffff,
+};
+#define RELR_WORDS (3 + 32)
+
+static void check_relr_tags(const char *name, unsigned tag, unsigned sz_tag,
+                            unsigned ent_tag)
+{
+    unsigned text_adjust[WORDS], data_adjust[WORDS];
+    const struct hybris_linker_lib_stats *st;
+    struct image img;
+    soinfo *si;
+    unsigned i;
+    char what[80];
+
+    image_init(&img);
+    image_dyn(&img, tag, image_add(&img, relr, sizeof(relr)));
+    image_dyn(&img, sz_tag, sizeof(relr));
+    image_dyn(&img, ent_tag, sizeof(unsigned));
+
+    si = android_dlopen(image_write(&img, name), RTLD_NOW);
+    snprintf(what, sizeof(what), "relr: %s loads", name);
+    check(what, si != NULL);
+    if (si == NULL)
+        return;
+
+    memset(text_adjust, 0, sizeof(text_adjust));
+    memset(data_adjust, 0, sizeof(data_adjust));
+    text_adjust[0] = text_adjust[1] = text_adjust[3] = si->base;
+    for (i = 0; i < 32; i++)
+        data_adjust[i] = si->base;
+    snprintf(what, sizeof(what), "relr: %s relocates the read-only words",
+             name);
+    check(what, words_are(si, TEXT_OFF, text_addend, text_adjust));
+    snprintf(what, sizeof(what), "relr: %s relocates the writable words",
+             name);
+    check(what, words_are(si, WORDS_OFF, data_addend, data_adjust));
+    snprintf(what, sizeof(what), "relr: %s text is read-only again", name);
+    check(what, !writable(si->base + TEXT_OFF));
+
+    st = si->stats;
+    if (st != NULL) {
+        snprintf(what, sizeof(what), "relr: %s counts %d RELATIVE", name,
+                 RELR_WORDS);
+        check(what, st->reloc_count[HYBRIS_RELOC_RELATIVE] == RELR_WORDS);
+    }
+    android_dlclose(si);
+}
+
+static void check_relr(void)
+{
+    check_relr_tags("libloadtest-relr.so", DT_RELR, DT_RELRSZ, DT_RELRENT);
+    check_relr_tags("libloadtest-android-relr.so", DT_ANDROID_RELR,
+                    DT_ANDROID_RELRSZ, DT_ANDROID_RELRENT);
+}
+
+static void put_sleb(unsigned char *data, unsigned *size, int v)
+{
+    unsigned char byte;
+    int more;
+
+    do {
+        byte = v & 0x7f;
+        v >>= 7;
+        more = !((v == 0 && !(byte & 0x40)) || (v == -1 && (byte & 0x40)));
+        data[(*size)++] = byte | (more ? 0x80 : 0);
+    } while (more);
+}
+
+/* Slots 0 and 1 are DT_REL, 2 to 4 DT_ANDROID_REL */
+#define PACKED_SLOTS 5
+
+/* Returns the bindings in the resolution cache of name, or NULL. The
+ * layout is that of "Persistent resolution cache" in ics/linker.c: four
+ * words of header, four per library in the scope, and then one per
+ * relocation. */
+static unsigned *read_ldcache(const char *name, unsigned *nbinding)
+{
+    static unsigned buf[1024];
+    char path[256];
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s.ldcache", dir, name);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    n = read(fd, buf, sizeof(buf));
+    close(fd);
+    if (n < 16 || (size_t)n != (4 + buf[2] * 4 + buf[3]) * sizeof(unsigned))
+        return NULL;
+    *nbinding = buf[3];
+    return &buf[4 + buf[2] * 4];
+}
+
+static int packed_words_ok(soinfo *si)
+{
+    unsigned text_adjust[WORDS], data_adjust[WORDS];
+
+    memset(text_adjust, 0, sizeof(text_adjust));
+    memset(data_adjust, 0, sizeof(data_adjust));
+    data_adjust[0] = data_adjust[1] = si->base + WORDS_OFF;
+    text_adjust[4] = si->base;
+    data_adjust[2] = si->base + TEXT_OFF;
+    data_adjust[3] = si->base;
+    return words_are(si, TEXT_OFF, text_addend, text_adjust) &&
+           words_are(si, WORDS_OFF, data_addend, data_adjust);
+}
+
+static void check_packed(void)
+{
+    static const char name[] = "libloadtest-packed.so";
+    unsigned char stream[64];
+    const unsigned *bindings;
+    unsigned nbinding, size = 0;
+    Elf32_Rel rel[2];
+    struct image img;
+    const char *path;
+    soinfo *si;
+
+    image_init(&img);
+    rel[0].r_offset = WORDS_OFF;
+    rel[0].r_info = ELF32_R_INFO(SYM_DATA, R_ABS);
+    rel[1].r_offset = WORDS_OFF + 4;
+    rel[1].r_info = ELF32_R_INFO(SYM_DATA, R_ABS);
+    image_dyn(&img, DT_REL, image_add(&img, rel, sizeof(rel)));
+    image_dyn(&img, DT_RELSZ, sizeof(rel));
+    image_dyn(&img, DT_RELENT, sizeof(Elf32_Rel));
+
+    /* Ungrouped: an r_offset delta and an r_info each */
+    memcpy(stream, "APS2", 4);
+    size = 4;
+    put_sleb(stream, &size, 3);
+    put_sleb(stream, &size, 0);
+    put_sleb(stream, &size, 3);
+    put_sleb(stream, &size, 0);
+    put_sleb(stream, &size, TEXT_OFF + 4 * 4);
+    put_sleb(stream, &size, ELF32_R_INFO(0, R_RELATIVE));
+    put_sleb(stream, &size, WORDS_OFF + 2 * 4 - (TEXT_OFF + 4 * 4));
+    put_sleb(stream, &size, ELF32_R_INFO(SYM_TEXT, R_ABS));
+    put_sleb(stream, &size, 4);
+    put_sleb(stream, &size, ELF32_R_INFO(0, R_RELATIVE));
+    image_dyn(&img, DT_ANDROID_REL, image_add(&img, stream, size));
+    image_dyn(&img, DT_ANDROID_RELSZ, size);
+    path = image_write(&img, name);
+
+    si = android_dlopen(path, RTLD_NOW);
+    check("packed: loads", si != NULL);
+    if (si == NULL)
+        return;
+    check("packed: applies DT_REL and DT_ANDROID_REL", packed_words_ok(si));
+    check("packed: text is read-only again",
+          !writable(si->base + TEXT_OFF));
+    android_dlclose(si);
+
+    bindings = read_ldcache(name, &nbinding);
+    check("packed: writes a resolution cache", bindings != NULL);
+    if (bindings == NULL)
+        return;
+    check("packed: caches one slot per relocation",
+          nbinding == PACKED_SLOTS);
+    check("packed: numbers DT_REL first, then DT_ANDROID_REL",
+          nbinding == PACKED_SLOTS &&
+          bindings[0] == SYM_DATA && bindings[1] == SYM_DATA &&
+          bindings[2] == 0xffffffff && bindings[3] == SYM_TEXT &&
+          bindings[4] == 0xffffffff);
+
+    si = android_dlopen(path, RTLD_NOW);
+    check("packed: loads again from the cache",
+          si != NULL && packed_words_ok(si));
+    if (si != NULL)
+        android_dlclose(si);
+}
+
+static void check_reject(void)
+{
+    static const unsigned char aps2[] = { 'A', 'P', 'S', '2', 0, 0 };
+    struct image img;
+
+    image_init(&img);
+    image_dyn(&img, DT_ANDROID_RELA, image_add(&img, aps2, sizeof(aps2)));
+    image_dyn(&img, DT_ANDROID_RELASZ, sizeof(aps2));
+    check("reject: DT_ANDROID_RELA",
+          android_dlopen(image_write(&img, "libloadtest-rela.so"),
+                         RTLD_NOW) == NULL);
+
+    image_init(&img);
+    image_dyn(&img, DT_RELR, image_add(&img, relr, sizeof(relr)));
+    image_dyn(&img, DT_RELRSZ, sizeof(relr));
+    image_dyn(&img, DT_RELRENT, 8);
+    check("reject: DT_RELRENT of 8",
+          android_dlopen(image_write(&img, "libloadtest-relrent.so"),
+                         RTLD_NOW) == NULL);
+}
+
+int main(void)
+{
+    if (mkdtemp(dir) == NULL) {
+        perror(dir);
+        return 1;
+    }
+    /* Read by the linker on the first load */
+    setenv("HYBRIS_LD_CACHE_DIR", dir, 1);
+
+    check_relr();
+    check_packed();
+    check_reject();
+
+    printf("%d failures\n", failures);
+    return failures ? 1 : 0;
+}
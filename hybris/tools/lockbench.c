@@ -0,0 +1,387 @@
+/*
+ * Copyright (C) 2013 Canonical Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * hybris-lockbench: time the pthread shims that Android libraries get
+ *
+ * Usage: hybris-lockbench [-t threads] [-n iterations]
+ *
+ * The shims are looked up with get_hooked_symbol(), the way the linker
+ * binds them for Android libraries, and called on bionic sized objects.
+ * Each is compared with "glibc-ptr", a glibc object reached through a
+ * pointer stored in the bionic object, which is what the shims used to do.
+ *
+ *   mutex uncontended   lock/unlock pairs on one thread
+ *   mutex contended     threads lock/unlock pairs on the same mutex
+ *   rwlock readers      rdlock/unlock pairs on the same rwlock from 1, 2, 4
+ *                       and 8 threads, none of them writing
+ *   cond wakeup         from pthread_cond_signal() to the waiter running
+ *   cond timeout        how late a 10ms pthread_cond_timedwait_relative_np()
+ *                       returns; glibc-ptr waits for a CLOCK_REALTIME
+ *                       deadline 10ms away (the shim used to pass the
+ *                       relative time itself as that deadline, and so
+ *                       returned at once)
+ *
+ * Mutex and rwlock times are in ns per lock/unlock pair, best of three
+ * runs; with enough CPUs a rwlock that scales keeps the reader time flat
+ * as threads are added. Cond
+ * times are the mean and worst case over the iterations (-n / 1000 for
+ * wakeups, -n / 100000 for timeouts).
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+extern void *get_hooked_symbol(char *sym);
+
+typedef int (*lock_fn)(void *);
+
+struct lock_ops {
+    const char *name;
+    lock_fn lock;
+    lock_fn unlock;
+    void *obj;
+    int readers;                /* shared locking, so nothing to count */
+};
+
+struct worker {
+    pthread_t thread;
+    const struct lock_ops *ops;
+    unsigned iterations;
+};
+
+static volatile int start_flag;
+static volatile unsigned long shared_counter;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    unsigned i;
+
+    while (!start_flag)
+        ;
+    for (i = 0; i < w->iterations; i++) {
+        w->ops->lock(w->ops->obj);
+        shared_counter++;
+        w->ops->unlock(w->ops->obj);
+    }
+    return NULL;
+}
+
+static void *reader_main(void *arg)
+{
+    struct worker *w = arg;
+    unsigned long sum = 0;
+    unsigned i;
+
+    while (!start_flag)
+        ;
+    for (i = 0; i < w->iterations; i++) {
+        w->ops->lock(w->ops->obj);
+        sum += shared_counter;
+        w->ops->unlock(w->ops->obj);
+    }
+    return (void *)sum;
+}
+
+/* ns per lock/unlock pair over threads threads */
+static double run(const struct lock_ops *ops, int threads,
+                  unsigned iterations)
+{
+    struct worker w[threads];
+    uint64_t t, best = ~0ULL;
+    int round, i;
+
+    for (round = 0; round < 3; round++) {
+        start_flag = 0;
+        shared_counter = 0;
+        for (i = 0; i < threads; i++) {
+            w[i].ops = ops;
+            w[i].iterations = iterations;
+            pthread_create(&w[i].thread, NULL,
+                           ops->readers ? reader_main : worker_main, &w[i]);
+        }
+        t = now_ns();
+        start_flag = 1;
+        for (i = 0; i < threads; i++)
+            pthread_join(w[i].thread, NULL);
+        t = now_ns() - t;
+
+        if (!ops->readers &&
+            shared_counter != (unsigned long)threads * iterations) {
+            fprintf(stderr, "%s: lost updates, %lu of %lu\n", ops->name,
+                    shared_counter, (unsigned long)threads * iterations);
+            exit(1);
+        }
+        if (t < best)
+            best = t;
+    }
+    return (double)best / ((double)threads * iterations);
+}
+
+typedef int (*wait_fn)(void *cond, void *mutex);
+typedef int (*signal_fn)(void *cond);
+typedef int (*timedwait_fn)(void *cond, void *mutex,
+                            const struct timespec *reltime);
+
+struct cond_ops {
+    const char *name;
+    lock_fn lock;
+    lock_fn unlock;
+    wait_fn wait;
+    signal_fn signal;
+    timedwait_fn timedwait;
+    void *mutex;
+    void *cond;
+};
+
+static volatile unsigned cond_seq, cond_ack;
+static volatile uint64_t cond_stamp;
+static uint64_t wake_total, wake_max;
+
+static void *cond_waiter(void *arg)
+{
+    const struct cond_ops *ops = arg;
+    unsigned seen = 0;
+    uint64_t t;
+
+    for (;;) {
+        ops->lock(ops->mutex);
+        while (cond_seq == seen)
+            ops->wait(ops->cond, ops->mutex);
+        t = now_ns() - cond_stamp;
+        seen = cond_seq;
+        ops->unlock(ops->mutex);
+
+        if (seen == ~0u)
+            break;
+        wake_total += t;
+        if (t > wake_max)
+            wake_max = t;
+        cond_ack = seen;
+    }
+    return NULL;
+}
+
+static void run_cond_wakeup(const struct cond_ops *ops, unsigned iterations)
+{
+    pthread_t waiter;
+    unsigned i;
+
+    cond_seq = cond_ack = 0;
+    wake_total = wake_max = 0;
+    pthread_create(&waiter, NULL, cond_waiter, (void *)ops);
+
+    for (i = 1; i <= iterations + 1; i++) {
+        /* Let the waiter get back to sleep first */
+        while (cond_ack != i - 1)
+            sched_yield();
+        usleep(100);
+        ops->lock(ops->mutex);
+        cond_stamp = now_ns();
+        cond_seq = i <= iterations ? i : ~0u;
+        ops->signal(ops->cond);
+        ops->unlock(ops->mutex);
+    }
+    pthread_join(waiter, NULL);
+
+    printf("cond  %-10s wakeup      %7.1f us mean %7.1f us max\n", ops->name,
+           wake_total / 1000.0 / iterations, wake_max / 1000.0);
+}
+
+static void run_cond_timeout(const struct cond_ops *ops, unsigned iterations)
+{
+    struct timespec reltime = { 0, 10000000 };
+    uint64_t t, late, total = 0, max = 0;
+    unsigned i;
+
+    for (i = 0; i < iterations; i++) {
+        ops->lock(ops->mutex);
+        t = now_ns();
+        if (ops->timedwait(ops->cond, ops->mutex, &reltime) != ETIMEDOUT) {
+            ops->unlock(ops->mutex);
+            continue;
+        }
+        late = now_ns() - t - reltime.tv_nsec;
+        ops->unlock(ops->mutex);
+        total += late;
+        if (late > max)
+            max = late;
+    }
+
+    printf("cond  %-10s timeout     %7.1f us mean %7.1f us max late\n",
+           ops->name, total / 1000.0 / iterations, max / 1000.0);
+}
+
+static int glibc_ptr_lock(void *obj)
+{
+    return pthread_mutex_lock(*(pthread_mutex_t **)obj);
+}
+
+static int glibc_ptr_unlock(void *obj)
+{
+    return pthread_mutex_unlock(*(pthread_mutex_t **)obj);
+}
+
+static int glibc_ptr_rdlock(void *obj)
+{
+    return pthread_rwlock_rdlock(*(pthread_rwlock_t **)obj);
+}
+
+static int glibc_ptr_rwunlock(void *obj)
+{
+    return pthread_rwlock_unlock(*(pthread_rwlock_t **)obj);
+}
+
+static int glibc_ptr_wait(void *cond, void *mutex)
+{
+    return pthread_cond_wait(*(pthread_cond_t **)cond,
+                             *(pthread_mutex_t **)mutex);
+}
+
+static int glibc_ptr_signal(void *cond)
+{
+    return pthread_cond_signal(*(pthread_cond_t **)cond);
+}
+
+static int glibc_ptr_timedwait(void *cond, void *mutex,
+                               const struct timespec *reltime)
+{
+    struct timespec abstime;
+
+    clock_gettime(CLOCK_REALTIME, &abstime);
+    abstime.tv_sec += reltime->tv_sec;
+    abstime.tv_nsec += reltime->tv_nsec;
+    if (abstime.tv_nsec >= 1000000000) {
+        abstime.tv_sec++;
+        abstime.tv_nsec -= 1000000000;
+    }
+    return pthread_cond_timedwait(*(pthread_cond_t **)cond,
+                                  *(pthread_mutex_t **)mutex, &abstime);
+}
+
+int main(int argc, char **argv)
+{
+    static pthread_mutex_t *glibc_mutex;
+    static pthread_cond_t *glibc_cond;
+    static pthread_rwlock_t *glibc_rwlock;
+    static int bionic_mutex, bionic_cond;
+    /* 40 bytes, the size of bionic's pthread_rwlock_t on 32-bit */
+    static int bionic_rwlock[10];
+    struct lock_ops ops[2], rwops[2];
+    struct cond_ops cops[2];
+    unsigned iterations = 1000000;
+    int threads = 4;
+    int opt, i, n;
+
+    while ((opt = getopt(argc, argv, "t:n:")) != -1) {
+        switch (opt) {
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-t threads] [-n iterations]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (threads < 1)
+        threads = 1;
+
+    glibc_mutex = malloc(sizeof(*glibc_mutex));
+    pthread_mutex_init(glibc_mutex, NULL);
+    glibc_cond = malloc(sizeof(*glibc_cond));
+    pthread_cond_init(glibc_cond, NULL);
+    glibc_rwlock = malloc(sizeof(*glibc_rwlock));
+    pthread_rwlock_init(glibc_rwlock, NULL);
+
+    ops[0].name = "hybris";
+    ops[0].lock = (lock_fn)get_hooked_symbol("pthread_mutex_lock");
+    ops[0].unlock = (lock_fn)get_hooked_symbol("pthread_mutex_unlock");
+    ops[0].obj = &bionic_mutex;
+    ops[0].readers = 0;
+    ops[1].name = "glibc-ptr";
+    ops[1].lock = glibc_ptr_lock;
+    ops[1].unlock = glibc_ptr_unlock;
+    ops[1].obj = &glibc_mutex;
+    ops[1].readers = 0;
+
+    for (i = 0; i < 2; i++) {
+        printf("mutex %-10s uncontended %7.1f ns   contended (%d threads) "
+               "%7.1f ns\n", ops[i].name, run(&ops[i], 1, iterations),
+               threads, run(&ops[i], threads, iterations / threads));
+    }
+
+    rwops[0].name = "hybris";
+    rwops[0].lock = (lock_fn)get_hooked_symbol("pthread_rwlock_rdlock");
+    rwops[0].unlock = (lock_fn)get_hooked_symbol("pthread_rwlock_unlock");
+    rwops[0].obj = bionic_rwlock;
+    rwops[0].readers = 1;
+    rwops[1].name = "glibc-ptr";
+    rwops[1].lock = glibc_ptr_rdlock;
+    rwops[1].unlock = glibc_ptr_rwunlock;
+    rwops[1].obj = &glibc_rwlock;
+    rwops[1].readers = 1;
+
+    for (i = 0; i < 2; i++) {
+        printf("rwlock %-9s readers    ", rwops[i].name);
+        for (n = 1; n <= 8; n *= 2)
+            printf(" %d: %6.1f ns", n, run(&rwops[i], n, iterations / n));
+        printf("\n");
+    }
+
+    cops[0].name = "hybris";
+    cops[0].lock = ops[0].lock;
+    cops[0].unlock = ops[0].unlock;
+    cops[0].wait = (wait_fn)get_hooked_symbol("pthread_cond_wait");
+    cops[0].signal = (signal_fn)get_hooked_symbol("pthread_cond_signal");
+    cops[0].timedwait = (timedwait_fn)
+        get_hooked_symbol("pthread_cond_timedwait_relative_np");
+    cops[0].mutex = &bionic_mutex;
+    cops[0].cond = &bionic_cond;
+    cops[1].name = "glibc-ptr";
+    cops[1].lock = glibc_ptr_lock;
+    cops[1].unlock = glibc_ptr_unlock;
+    cops[1].wait = glibc_ptr_wait;
+    cops[1].signal = glibc_ptr_signal;
+    cops[1].timedwait = glibc_ptr_timedwait;
+    cops[1].mutex = &glibc_mutex;
+    cops[1].cond = &glibc_cond;
+
+    for (i = 0; i < 2; i++)
+        run_cond_wakeup(&cops[i], iterations / 1000 ? iterations / 1000 : 1);
+    for (i = 0; i < 2; i++)
+        run_cond_timeout(&cops[i],
+                         iterations / 100000 ? iterations / 100000 : 1);
+    return 0;
+}
@@ -0,0 +1,346 @@
+/*
+ * Copyright (C) 2013 Canonical Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * hybris-locktest: check the lock shims against bionic's behaviour
+ *
+ * Usage: hybris-locktest
+ *
+ * The shims are looked up with get_hooked_symbol(), as in
+ * hybris-lockbench, and called on bionic sized objects: a statically
+ * initialized, 40-byte pthread_rwlock_t, which may not be initialized as
+ * process shared, 4-byte pthread_mutex_ts of each
+ * type, initialized from glibc attributes as Android libraries do, and a
+ * 4-byte pthread_cond_t whose timed waits must time out holding the
+ * mutex. Calls that have to come from another thread than the one holding
+ * the lock are made on a short-lived thread. Prints each check, and exits
+ * with 1 if any of them failed.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+extern void *get_hooked_symbol(char *sym);
+
+typedef int (*rwlock_fn)(void *);
+typedef int (*timed_rwlock_fn)(void *, const struct timespec *);
+typedef int (*init_fn)(void *, const void *);
+typedef int (*timedwait_fn)(void *, void *, const struct timespec *);
+
+static rwlock_fn rdlock, tryrdlock, wrlock, trywrlock, unlock, destroy;
+static timed_rwlock_fn timedrdlock, timedwrlock;
+static rwlock_fn mutex_lock, mutex_trylock, mutex_unlock, mutex_destroy;
+static init_fn mutex_init, cond_init;
+static timedwait_fn cond_timedwait, cond_timedwait_monotonic;
+static timedwait_fn cond_timedwait_relative_np;
+static init_fn rwlock_init;
+static rwlock_fn rwlockattr_init, rwlockattr_destroy;
+static int (*rwlockattr_setpshared)(void *, int);
+
+/* 40 bytes, the size of bionic's pthread_rwlock_t on 32-bit */
+static int rwlock[10];
+static int mutex;
+static int cond;
+static int failures;
+
+static void check(const char *what, int got, int expected)
+{
+    printf("%-52s %s", what, got == expected ? "ok\n" : "FAIL");
+    if (got != expected) {
+        printf(" (%d, expected %d)\n", got, expected);
+        failures++;
+    }
+}
+
+struct call {
+    rwlock_fn fn;
+    void *obj;
+};
+
+static void *call_main(void *arg)
+{
+    struct call *call = arg;
+
+    return (void *)(long)call->fn(call->obj);
+}
+
+/* The result of fn on obj, called from another thread */
+static int call_on_elsewhere(rwlock_fn fn, void *obj)
+{
+    struct call call = { fn, obj };
+    pthread_t thread;
+    void *ret;
+
+    pthread_create(&thread, NULL, call_main, &call);
+    pthread_join(thread, &ret);
+    return (int)(long)ret;
+}
+
+/* The result of fn on the rwlock, called from another thread */
+static int call_elsewhere(rwlock_fn fn)
+{
+    return call_on_elsewhere(fn, rwlock);
+}
+
+/* Unlocks what it gets, so that the lock isn't left to a thread that is
+ * gone */
+static int trywrlock_unlock(void *obj)
+{
+    int ret = trywrlock(obj);
+
+    if (ret == 0)
+        ret = unlock(obj);
+    return ret;
+}
+
+static int mutex_trylock_unlock(void *obj)
+{
+    int ret = mutex_trylock(obj);
+
+    if (ret == 0)
+        ret = mutex_unlock(obj);
+    return ret;
+}
+
+/* ms milliseconds from now on clock */
+static struct timespec soon(clockid_t clock, int ms)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    ts.tv_nsec += ms * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
+static int timedwrlock_soon(void *obj)
+{
+    struct timespec ts = soon(CLOCK_REALTIME, 10);
+
+    return timedwrlock(obj, &ts);
+}
+
+/* Initializes the mutex as type */
+static int mutex_init_type(int type)
+{
+    pthread_mutexattr_t attr;
+    int ret;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, type);
+    ret = mutex_init(&mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return ret;
+}
+
+/* Process shared rwlocks aren't supported, and must be refused */
+static void check_rwlock_pshared(void)
+{
+    int attr;
+
+    check("rwlockattr init", rwlockattr_init(&attr), 0);
+    check("rwlockattr setpshared private",
+          rwlockattr_setpshared(&attr, PTHREAD_PROCESS_PRIVATE), 0);
+    check("init private", rwlock_init(rwlock, &attr), 0);
+    check("rwlockattr setpshared shared",
+          rwlockattr_setpshared(&attr, PTHREAD_PROCESS_SHARED), 0);
+    check("init process shared", rwlock_init(rwlock, &attr), ENOTSUP);
+    check("rwlockattr destroy", rwlockattr_destroy(&attr), 0);
+}
+
+static void check_mutex_normal(void)
+{
+    check("normal mutex: init", mutex_init(&mutex, NULL), 0);
+    check("normal mutex: lock", mutex_lock(&mutex), 0);
+    check("normal mutex: trylock", mutex_trylock(&mutex), EBUSY);
+    check("normal mutex: destroy while locked", mutex_destroy(&mutex),
+          EBUSY);
+    check("normal mutex: unlock", mutex_unlock(&mutex), 0);
+    check("normal mutex: unlock when unlocked", mutex_unlock(&mutex),
+          EPERM);
+    check("normal mutex: destroy", mutex_destroy(&mutex), 0);
+}
+
+static void check_mutex_errorcheck(void)
+{
+    check("errorcheck mutex: init",
+          mutex_init_type(PTHREAD_MUTEX_ERRORCHECK), 0);
+    check("errorcheck mutex: lock", mutex_lock(&mutex), 0);
+    check("errorcheck mutex: lock again by the owner", mutex_lock(&mutex),
+          EDEADLK);
+    check("errorcheck mutex: trylock by the owner", mutex_trylock(&mutex),
+          EBUSY);
+    check("errorcheck mutex: trylock from another thread",
+          call_on_elsewhere(mutex_trylock, &mutex), EBUSY);
+    check("errorcheck mutex: unlock from another thread",
+          call_on_elsewhere(mutex_unlock, &mutex), EPERM);
+    check("errorcheck mutex: destroy while locked", mutex_destroy(&mutex),
+          EBUSY);
+    check("errorcheck mutex: unlock", mutex_unlock(&mutex), 0);
+    check("errorcheck mutex: unlock when unlocked", mutex_unlock(&mutex),
+          EPERM);
+    check("errorcheck mutex: trylock from another thread when unlocked",
+          call_on_elsewhere(mutex_trylock_unlock, &mutex), 0);
+    check("errorcheck mutex: destroy", mutex_destroy(&mutex), 0);
+}
+
+static void check_mutex_recursive(void)
+{
+    int i;
+
+    check("recursive mutex: init", mutex_init_type(PTHREAD_MUTEX_RECURSIVE),
+          0);
+    check("recursive mutex: lock", mutex_lock(&mutex), 0);
+    check("recursive mutex: lock again by the owner", mutex_lock(&mutex), 0);
+    check("recursive mutex: trylock by the owner", mutex_trylock(&mutex), 0);
+    check("recursive mutex: trylock from another thread",
+          call_on_elsewhere(mutex_trylock, &mutex), EBUSY);
+    check("recursive mutex: unlock from another thread",
+          call_on_elsewhere(mutex_unlock, &mutex), EPERM);
+    /* Each lock takes an unlock */
+    for (i = 0; i < 2; i++) {
+        check("recursive mutex: unlock a nested lock", mutex_unlock(&mutex),
+              0);
+        check("recursive mutex: trylock from another thread while nested",
+              call_on_elsewhere(mutex_trylock, &mutex), EBUSY);
+    }
+    check("recursive mutex: unlock the last lock", mutex_unlock(&mutex), 0);
+    check("recursive mutex: unlock when unlocked", mutex_unlock(&mutex),
+          EPERM);
+    check("recursive mutex: trylock from another thread when unlocked",
+          call_on_elsewhere(mutex_trylock_unlock, &mutex), 0);
+    check("recursive mutex: destroy", mutex_destroy(&mutex), 0);
+}
+
+/* Each timed wait has to time out with the mutex held again */
+static void check_cond_timeout(void)
+{
+    struct timespec bad = { 0, 1000000000 };
+    struct timespec rel = { 0, 10000000 };
+    struct timespec ts;
+
+    check("cond: init", cond_init(&cond, NULL), 0);
+    check("cond: mutex init", mutex_init(&mutex, NULL), 0);
+    check("cond: lock the mutex", mutex_lock(&mutex), 0);
+
+    ts = soon(CLOCK_REALTIME, 10);
+    check("cond: timedwait times out",
+          cond_timedwait(&cond, &mutex, &ts), ETIMEDOUT);
+    check("cond: the mutex is held after timing out",
+          call_on_elsewhere(mutex_trylock, &mutex), EBUSY);
+
+    ts = soon(CLOCK_MONOTONIC, 10);
+    check("cond: timedwait_monotonic times out",
+          cond_timedwait_monotonic(&cond, &mutex, &ts), ETIMEDOUT);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec--;
+    check("cond: timedwait_monotonic with a past deadline",
+          cond_timedwait_monotonic(&cond, &mutex, &ts), ETIMEDOUT);
+    check("cond: timedwait_relative_np times out",
+          cond_timedwait_relative_np(&cond, &mutex, &rel), ETIMEDOUT);
+    check("cond: timedwait with a bad deadline",
+          cond_timedwait(&cond, &mutex, &bad), EINVAL);
+    check("cond: the mutex is still held",
+          call_on_elsewhere(mutex_trylock, &mutex), EBUSY);
+    check("cond: unlock the mutex", mutex_unlock(&mutex), 0);
+}
+
+int main(void)
+{
+    struct timespec bad = { 0, 1000000000 };
+    int i;
+
+    rdlock = (rwlock_fn)get_hooked_symbol("pthread_rwlock_rdlock");
+    tryrdlock = (rwlock_fn)get_hooked_symbol("pthread_rwlock_tryrdlock");
+    wrlock = (rwlock_fn)get_hooked_symbol("pthread_rwlock_wrlock");
+    trywrlock = (rwlock_fn)get_hooked_symbol("pthread_rwlock_trywrlock");
+    unlock = (rwlock_fn)get_hooked_symbol("pthread_rwlock_unlock");
+    destroy = (rwlock_fn)get_hooked_symbol("pthread_rwlock_destroy");
+    timedrdlock = (timed_rwlock_fn)
+        get_hooked_symbol("pthread_rwlock_timedrdlock");
+    timedwrlock = (timed_rwlock_fn)
+        get_hooked_symbol("pthread_rwlock_timedwrlock");
+    rwlock_init = (init_fn)get_hooked_symbol("pthread_rwlock_init");
+    rwlockattr_init = (rwlock_fn)get_hooked_symbol("pthread_rwlockattr_init");
+    rwlockattr_destroy = (rwlock_fn)
+        get_hooked_symbol("pthread_rwlockattr_destroy");
+    rwlockattr_setpshared = (int (*)(void *, int))
+        get_hooked_symbol("pthread_rwlockattr_setpshared");
+    mutex_init = (init_fn)get_hooked_symbol("pthread_mutex_init");
+    mutex_lock = (rwlock_fn)get_hooked_symbol("pthread_mutex_lock");
+    mutex_trylock = (rwlock_fn)get_hooked_symbol("pthread_mutex_trylock");
+    mutex_unlock = (rwlock_fn)get_hooked_symbol("pthread_mutex_unlock");
+    mutex_destroy = (rwlock_fn)get_hooked_symbol("pthread_mutex_destroy");
+    cond_init = (init_fn)get_hooked_symbol("pthread_cond_init");
+    cond_timedwait = (timedwait_fn)get_hooked_symbol("pthread_cond_timedwait");
+    cond_timedwait_monotonic = (timedwait_fn)
+        get_hooked_symbol("pthread_cond_timedwait_monotonic");
+    cond_timedwait_relative_np = (timedwait_fn)
+        get_hooked_symbol("pthread_cond_timedwait_relative_np");
+
+    /* Readers share the lock and keep writers out */
+    check("rdlock", rdlock(rwlock), 0);
+    check("tryrdlock from another thread", call_elsewhere(tryrdlock), 0);
+    check("unlock that read lock", unlock(rwlock), 0);
+    check("trywrlock from another thread while reading",
+          call_elsewhere(trywrlock), EBUSY);
+    check("timedwrlock from another thread while reading",
+          call_elsewhere(timedwrlock_soon), ETIMEDOUT);
+    check("destroy while reading", destroy(rwlock), EBUSY);
+    check("unlock", unlock(rwlock), 0);
+    check("unlock when unlocked", unlock(rwlock), EPERM);
+
+    /* As in bionic, the writer can lock again, and each lock takes an
+     * unlock */
+    check("wrlock", wrlock(rwlock), 0);
+    check("wrlock again by the writer", wrlock(rwlock), 0);
+    check("rdlock by the writer", rdlock(rwlock), 0);
+    check("tryrdlock by the writer", tryrdlock(rwlock), 0);
+    check("trywrlock by the writer", trywrlock(rwlock), 0);
+    check("timedrdlock by the writer with a bad deadline",
+          timedrdlock(rwlock, &bad), EINVAL);
+    check("unlock from another thread", call_elsewhere(unlock), EPERM);
+    for (i = 0; i < 4; i++) {
+        check("unlock a nested lock", unlock(rwlock), 0);
+        check("tryrdlock from another thread while nested",
+              call_elsewhere(tryrdlock), EBUSY);
+    }
+    check("unlock the write lock", unlock(rwlock), 0);
+    check("trywrlock from another thread after the last unlock",
+          call_elsewhere(trywrlock_unlock), 0);
+    check("unlock after the other thread's unlock", unlock(rwlock), EPERM);
+
+    /* Deadlines are checked even when the lock is free */
+    check("timedrdlock with a bad deadline", timedrdlock(rwlock, &bad),
+          EINVAL);
+    check("timedwrlock with a bad deadline", timedwrlock(rwlock, &bad),
+          EINVAL);
+    check("destroy", destroy(rwlock), 0);
+
+    check_rwlock_pshared();
+    check_mutex_normal();
+    check_mutex_errorcheck();
+    check_mutex_recursive();
+    check_cond_timeout();
+
+    printf("%d failures\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,190 @@
+/*
+ * Copyright (C) 2013 Canonical Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * hybris-prefaultbench: compare the prefault policies of the linker
+ *
+ * Usage: hybris-prefaultbench [-r rounds] [-c] lib.so...
+ *
+ * Loads the libraries with android_dlopen() under each HYBRIS_LD_PREFAULT
+ * policy in turn (see "Prefault policies" in ics/linker.c), and reports
+ * the page faults taken and the time it took, from the first dlopen() to
+ * the last one returning, constructors included. Every run is made in a
+ * child process of its own, since the linker reads the policy once and
+ * keeps the libraries it loaded. Each column is the best of rounds (3 by
+ * default) runs.
+ *
+ * With -c, the page cache of the named libraries, but not of their
+ * dependencies, is dropped before every run, to see major faults and
+ * readahead at work as on a cold start.
+ */
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern void *android_dlopen(const char *filename, int flag);
+
+static const char *policies[] = {
+    "none",
+    "readahead",
+    "populate",
+    "willneed",
+    "sequential",
+    "readahead,populate",
+};
+
+struct result {
+    uint64_t ns;
+    long minflt;
+    long majflt;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void drop_cache(char **libs, int n)
+{
+    int i, fd;
+
+    for (i = 0; i < n; i++) {
+        fd = open(libs[i], O_RDONLY);
+        if (fd < 0)
+            continue;
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+/* In the child: loads the libraries under policy and writes the result to
+ * fd */
+static void load(const char *policy, char **libs, int n, int fd)
+{
+    struct rusage before, after;
+    struct result r;
+    int i;
+
+    setenv("HYBRIS_LD_PREFAULT", policy, 1);
+
+    getrusage(RUSAGE_SELF, &before);
+    r.ns = now_ns();
+    for (i = 0; i < n; i++) {
+        if (android_dlopen(libs[i], RTLD_NOW) == NULL) {
+            fprintf(stderr, "%s: cannot load\n", libs[i]);
+            _exit(1);
+        }
+    }
+    r.ns = now_ns() - r.ns;
+    getrusage(RUSAGE_SELF, &after);
+
+    r.minflt = after.ru_minflt - before.ru_minflt;
+    r.majflt = after.ru_majflt - before.ru_majflt;
+    write(fd, &r, sizeof(r));
+    _exit(0);
+}
+
+/* Runs load() in a child. Returns -1 if it failed. */
+static int run(const char *policy, char **libs, int n, struct result *r)
+{
+    int fds[2], status;
+    pid_t child;
+    ssize_t got;
+
+    if (pipe(fds) < 0)
+        return -1;
+    child = fork();
+    if (child < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (child == 0) {
+        close(fds[0]);
+        load(policy, libs, n, fds[1]);
+    }
+
+    close(fds[1]);
+    got = read(fds[0], r, sizeof(*r));
+    close(fds[0]);
+    waitpid(child, &status, 0);
+    if (got != sizeof(*r) || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct result r, best;
+    int rounds = 3, cold = 0;
+    int opt, round;
+    unsigned i;
+
+    while ((opt = getopt(argc, argv, "r:c")) != -1) {
+        switch (opt) {
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 'c':
+            cold = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-r rounds] [-c] lib.so...\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (optind == argc) {
+        fprintf(stderr, "Usage: %s [-r rounds] [-c] lib.so...\n", argv[0]);
+        return 1;
+    }
+    if (rounds < 1)
+        rounds = 1;
+
+    printf("%-20s %10s %10s %10s\n", "policy", "minflt", "majflt", "ms");
+    for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        best.ns = ~0ULL;
+        best.minflt = best.majflt = -1;
+        for (round = 0; round < rounds; round++) {
+            if (cold)
+                drop_cache(&argv[optind], argc - optind);
+            if (run(policies[i], &argv[optind], argc - optind, &r) < 0) {
+                fprintf(stderr, "%s: loading failed\n", policies[i]);
+                return 1;
+            }
+            if (r.ns < best.ns)
+                best.ns = r.ns;
+            if (best.minflt < 0 || r.minflt < best.minflt)
+                best.minflt = r.minflt;
+            if (best.majflt < 0 || r.majflt < best.majflt)
+                best.majflt = r.majflt;
+        }
+        printf("%-20s %10ld %10ld %10.2f\n", policies[i], best.minflt,
+               best.majflt, best.ns / 1000000.0);
+    }
+    return 0;
+}
@@ -0,0 +1,345 @@
+/*
+ * Copyright (C) 2013 Canonical Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * hybris-prelink: assign fixed load addresses to a set of Android libraries
+ *
+ * Usage: hybris-prelink [-b base] [-s size] [-n] lib.so...
+ *
+ * The libraries are packed one after the other, page aligned, into
+ * [base, base + size), which defaults to the area the ics linker is built
+ * for (LINKER_TEXT_BASE / LINKER_AREA_SIZE). For each library the leading
+ * DT_RELCOUNT R_ARM_RELATIVE / R_386_RELATIVE relocations are applied in
+ * the file for the assigned base, and the file is tagged the way
+ * is_prelinked() and prelinked_relative_count() in ics/linker.c expect:
+ *
+ *     ... | relative_count, "HYB " | base, "PRE " | EOF
+ *
+ * When the linker manages to load the library at that base it skips those
+ * relocations; when that range is taken, it loads the library elsewhere
+ * and moves them by the difference. Running the tool again on a library
+ * it already prelinked moves it to the new base. Libraries are rewritten
+ * through a temporary file and rename(), so a library that is in use is
+ * never modified.
+ *
+ * Only 32-bit little endian objects are supported.
+ */
+
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef LINKER_TEXT_BASE
+#define LINKER_TEXT_BASE 0xB0000100
+#endif
+#ifndef LINKER_AREA_SIZE
+#define LINKER_AREA_SIZE 0x01000000
+#endif
+
+#define PAGE_SIZE 4096
+#define PAGE_MASK 4095
+
+#ifndef DT_RELCOUNT
+#define DT_RELCOUNT 0x6ffffffa
+#endif
+
+struct trailer {
+    uint32_t value;
+    char tag[4];
+};
+
+struct image {
+    const char *name;
+    unsigned char *data;
+    size_t size;            /* without any trailer we recognised */
+    uint32_t old_base;      /* base the RELATIVE relocs were applied for */
+    uint32_t old_count;     /* number of them, 0 if none */
+    Elf32_Ehdr *ehdr;
+    Elf32_Phdr *phdr;
+};
+
+static int dry_run;
+
+/* Translate a virtual address into a pointer into the file, or NULL if
+ * [vaddr, vaddr + len) isn't backed by the file. */
+static void *vaddr_to_file(struct image *img, uint32_t vaddr, uint32_t len)
+{
+    int i;
+
+    for (i = 0; i < img->ehdr->e_phnum; i++) {
+        Elf32_Phdr *ph = &img->phdr[i];
+        if (ph->p_type != PT_LOAD)
+            continue;
+        if (vaddr >= ph->p_vaddr && vaddr - ph->p_vaddr + len <= ph->p_filesz &&
+            ph->p_offset + (vaddr - ph->p_vaddr) + len <= img->size)
+            return img->data + ph->p_offset + (vaddr - ph->p_vaddr);
+    }
+    return NULL;
+}
+
+static int read_image(struct image *img, const char *name)
+{
+    struct trailer t;
+    struct stat st;
+    int fd;
+
+    memset(img, 0, sizeof(*img));
+    img->name = name;
+
+    fd = open(name, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "%s: %s\n", name, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    img->size = st.st_size;
+    img->data = malloc(img->size + 2 * sizeof(struct trailer));
+    if (img->data == NULL ||
+        read(fd, img->data, img->size) != (ssize_t)img->size) {
+        fprintf(stderr, "%s: cannot read\n", name);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    img->ehdr = (Elf32_Ehdr *)img->data;
+    if (img->size < sizeof(Elf32_Ehdr) ||
+        memcmp(img->ehdr->e_ident, ELFMAG, SELFMAG) ||
+        img->ehdr->e_ident[EI_CLASS] != ELFCLASS32 ||
+        img->ehdr->e_ident[EI_DATA] != ELFDATA2LSB ||
+        img->ehdr->e_type != ET_DYN ||
+        (img->ehdr->e_machine != EM_ARM && img->ehdr->e_machine != EM_386) ||
+        img->ehdr->e_phoff + img->ehdr->e_phnum * sizeof(Elf32_Phdr) >
+            img->size) {
+        fprintf(stderr, "%s: not a 32-bit ARM or x86 shared library\n", name);
+        return -1;
+    }
+    img->phdr = (Elf32_Phdr *)(img->data + img->ehdr->e_phoff);
+
+    /* Strip the trailers of a previous run */
+    if (img->size >= sizeof(t)) {
+        memcpy(&t, img->data + img->size - sizeof(t), sizeof(t));
+        if (!memcmp(t.tag, "PRE ", 4)) {
+            img->size -= sizeof(t);
+            img->old_base = t.value;
+            memcpy(&t, img->data + img->size - sizeof(t), sizeof(t));
+            if (img->size >= sizeof(t) && !memcmp(t.tag, "HYB ", 4)) {
+                img->size -= sizeof(t);
+                img->old_count = t.value;
+            }
+        }
+    }
+    if (img->old_count == 0)
+        img->old_base = 0;
+    return 0;
+}
+
+static uint32_t image_extent(struct image *img)
+{
+    uint32_t max_vaddr = 0;
+    int i;
+
+    for (i = 0; i < img->ehdr->e_phnum; i++) {
+        Elf32_Phdr *ph = &img->phdr[i];
+        if (ph->p_type == PT_LOAD && ph->p_vaddr + ph->p_memsz > max_vaddr)
+            max_vaddr = ph->p_vaddr + ph->p_memsz;
+    }
+    return (max_vaddr + PAGE_SIZE - 1) & ~PAGE_MASK;
+}
+
+/* Apply the leading RELATIVE relocations for base. Returns how many were
+ * applied, or -1 if the library can't be prelinked. */
+static int apply_relative(struct image *img, uint32_t base)
+{
+    uint32_t rel_vaddr = 0, rel_size = 0, relcount = 0;
+    uint32_t type = img->ehdr->e_machine == EM_ARM ? R_ARM_RELATIVE
+                                                   : R_386_RELATIVE;
+    Elf32_Dyn *dyn = NULL;
+    Elf32_Rel *rel;
+    uint32_t i;
+
+    for (i = 0; i < img->ehdr->e_phnum; i++) {
+        if (img->phdr[i].p_type == PT_DYNAMIC)
+            dyn = vaddr_to_file(img, img->phdr[i].p_vaddr,
+                                img->phdr[i].p_filesz);
+    }
+    if (dyn == NULL) {
+        fprintf(stderr, "%s: no dynamic section\n", img->name);
+        return -1;
+    }
+
+    for (; dyn->d_tag != DT_NULL; dyn++) {
+        if (dyn->d_tag == DT_REL)
+            rel_vaddr = dyn->d_un.d_ptr;
+        else if (dyn->d_tag == DT_RELSZ)
+            rel_size = dyn->d_un.d_val;
+        else if (dyn->d_tag == DT_RELCOUNT)
+            relcount = dyn->d_un.d_val;
+        else if (dyn->d_tag == DT_TEXTREL) {
+            fprintf(stderr, "%s: has text relocations\n", img->name);
+            return -1;
+        }
+    }
+
+    if (img->old_count != 0 && img->old_count != relcount) {
+        fprintf(stderr, "%s: prelinked for a different DT_RELCOUNT\n",
+                img->name);
+        return -1;
+    }
+    if (relcount == 0)
+        return 0;
+
+    rel = vaddr_to_file(img, rel_vaddr, relcount * sizeof(Elf32_Rel));
+    if (rel == NULL || relcount * sizeof(Elf32_Rel) > rel_size) {
+        fprintf(stderr, "%s: bad DT_REL/DT_RELCOUNT\n", img->name);
+        return -1;
+    }
+
+    /* Check everything first, so that we never write half a job */
+    for (i = 0; i < relcount; i++) {
+        if (ELF32_R_TYPE(rel[i].r_info) != type ||
+            vaddr_to_file(img, rel[i].r_offset, 4) == NULL) {
+            fprintf(stderr, "%s: RELATIVE relocation %u at 0x%08x can't be "
+                    "prelinked\n", img->name, i, rel[i].r_offset);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < relcount; i++) {
+        uint32_t *p = vaddr_to_file(img, rel[i].r_offset, 4);
+        uint32_t v;
+        memcpy(&v, p, 4);
+        v += base - img->old_base;
+        memcpy(p, &v, 4);
+    }
+    return relcount;
+}
+
+static int write_image(struct image *img, uint32_t base, uint32_t count)
+{
+    struct trailer t[2];
+    char tmp[4096];
+    struct stat st;
+    int fd;
+
+    t[0].value = count;
+    memcpy(t[0].tag, "HYB ", 4);
+    t[1].value = base;
+    memcpy(t[1].tag, "PRE ", 4);
+    memcpy(img->data + img->size, t, sizeof(t));
+
+    if (stat(img->name, &st) < 0 ||
+        snprintf(tmp, sizeof(tmp), "%s.prelink", img->name) >= (int)sizeof(tmp))
+        return -1;
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    if (write(fd, img->data, img->size + sizeof(t)) !=
+            (ssize_t)(img->size + sizeof(t)) ||
+        fsync(fd) < 0 || close(fd) < 0) {
+        fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    if (rename(tmp, img->name) < 0) {
+        fprintf(stderr, "%s: %s\n", img->name, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-b base] [-s size] [-n] lib.so...\n"
+            "  -b base  start of the prelink area (default 0x%08x)\n"
+            "  -s size  size of the prelink area (default 0x%08x)\n"
+            "  -n       only print the assigned bases\n",
+            argv0, LINKER_TEXT_BASE & ~PAGE_MASK, LINKER_AREA_SIZE);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t base = LINKER_TEXT_BASE & ~PAGE_MASK;
+    uint32_t size = LINKER_AREA_SIZE;
+    uint32_t next, end;
+    int opt, i, ret = 0;
+
+    while ((opt = getopt(argc, argv, "b:s:n")) != -1) {
+        switch (opt) {
+        case 'b':
+            base = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            size = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            dry_run = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind >= argc || (base & PAGE_MASK))
+        usage(argv[0]);
+
+    next = base;
+    end = base + size;
+    for (i = optind; i < argc; i++) {
+        struct image img;
+        uint32_t extent;
+        int count;
+
+        if (read_image(&img, argv[i]) < 0) {
+            free(img.data);
+            ret = 1;
+            continue;
+        }
+
+        extent = image_extent(&img);
+        if (extent == 0 || extent > end - next) {
+            fprintf(stderr, "%s: does not fit in the prelink area "
+                    "(0x%08x bytes needed, 0x%08x left)\n",
+                    img.name, extent, end - next);
+            free(img.data);
+            ret = 1;
+            continue;
+        }
+
+        count = apply_relative(&img, next);
+        if (count < 0 || (!dry_run && write_image(&img, next, count) < 0)) {
+            free(img.data);
+            ret = 1;
+            continue;
+        }
+
+        printf("0x%08x 0x%08x %6d %s\n", next, extent, count, img.name);
+        next += extent;
+        free(img.data);
+    }
+    return ret;
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2013 Canonical Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * hybris-prelinkbench: time the relocation of prelinked libraries
+ *
+ * Usage: HYBRIS_LINKER_STATS=/dev/null hybris-prelinkbench [-r rounds]
+ *            lib.so...
+ *
+ * Loads and unloads each library rounds times (5 by default) with
+ * android_dlopen() and android_dlclose(), and reports how it was loaded
+ * along with the best round's times from the linker statistics:
+ *
+ *   prelinked      at the base hybris-prelink gave it, so the RELATIVE
+ *                  relocations it applied in the file are skipped
+ *   moved          prelinked, but that range was taken; those relocations
+ *                  are moved to the base the library got instead
+ *   not prelinked  all RELATIVE relocations are applied at load time
+ *
+ * Comparing a library with a copy of it that went through hybris-prelink
+ * shows what prelinking saves. Only the library itself is counted, not
+ * its dependencies, and a library that is already loaded, such as libc.so,
+ * isn't loaded again, so it can't be measured.
+ */
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "linker.h"
+#include "linker_stats.h"
+
+extern void *android_dlopen(const char *filename, int flag);
+extern int android_dlclose(void *handle);
+
+static const char *load_mode(const soinfo *si)
+{
+    if (si->flags & FLAG_PRELINKED)
+        return "prelinked";
+    if (si->prelink_base != 0)
+        return "moved";
+    return "not prelinked";
+}
+
+/* Loads name rounds times, and prints the best times. Returns -1 if it
+ * can't be loaded or measured. */
+static int run(const char *name, int rounds)
+{
+    const struct hybris_linker_lib_stats *st;
+    unsigned long long reloc_ns, best_reloc = ~0ULL, best_load = ~0ULL;
+    const char *mode = NULL;
+    unsigned relative = 0;
+    soinfo *si;
+    int round, i;
+
+    for (round = 0; round < rounds; round++) {
+        si = android_dlopen(name, RTLD_NOW);
+        if (si == NULL) {
+            fprintf(stderr, "%s: cannot load\n", name);
+            return -1;
+        }
+        st = si->stats;
+        if (si->refcount > 1 || st == NULL) {
+            fprintf(stderr, "%s: %s\n", name, st ? "already loaded" :
+                                                   "no statistics");
+            android_dlclose(si);
+            return -1;
+        }
+
+        reloc_ns = 0;
+        for (i = 0; i < HYBRIS_RELOC_NTYPES; i++)
+            reloc_ns += st->reloc_ns[i];
+        if (reloc_ns < best_reloc)
+            best_reloc = reloc_ns;
+        if (st->open_ns + st->load_ns + reloc_ns < best_load)
+            best_load = st->open_ns + st->load_ns + reloc_ns;
+        relative = st->reloc_count[HYBRIS_RELOC_RELATIVE];
+        mode = load_mode(si);
+
+        android_dlclose(si);
+    }
+
+    printf("%-40s %-13s %8u relative %10.1f us relocating "
+           "%10.1f us loading\n", name, mode, relative, best_reloc / 1000.0,
+           best_load / 1000.0);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int rounds = 5;
+    int opt, ret = 0;
+
+    while ((opt = getopt(argc, argv, "r:")) != -1) {
+        switch (opt) {
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-r rounds] lib.so...\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind == argc) {
+        fprintf(stderr, "Usage: %s [-r rounds] lib.so...\n", argv[0]);
+        return 1;
+    }
+    if (rounds < 1)
+        rounds = 1;
+
+    if (!hybris_linker_get_stats()->enabled) {
+        fprintf(stderr, "%s: needs HYBRIS_LINKER_STATS to be set\n",
+                argv[0]);
+        return 1;
+    }
+
+    for (; optind < argc; optind++) {
+        if (run(argv[optind], rounds) < 0)
+            ret = 1;
+    }
+    return ret;
+}
@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2013 Canonical Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * hybris-relbench: time the linker's RELATIVE relocation loop
+ *
+ * Usage: hybris-relbench [-r rounds] [count...]
+ *
+ * For each count (10000, 100000 and 1000000 by default) a synthetic
+ * DT_REL table of that many RELATIVE relocations is built over a data
+ * area of one word per relocation, and applied rounds times with
+ *
+ *   switch:    a per-entry loop that decodes and switches on each entry
+ *              like reloc_library() in ics/linker.c does
+ *   relcount:  relative_relocs_apply() from ics/linker_reloc.h, as used
+ *              for the DT_RELCOUNT block
+ *
+ * once with the table sorted by r_offset, as static linkers emit it, and
+ * once shuffled, to show what the order is worth. The best round is
+ * reported, in ns per relocation. The switch here only knows four types,
+ * so it is a lower bound on what reloc_library() costs per entry.
+ */
+
+#include <elf.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "linker_reloc.h"
+
+#if defined(__arm__)
+#define R_RELATIVE R_ARM_RELATIVE
+#else
+#define R_RELATIVE R_386_RELATIVE
+#endif
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Kept out of line, as reloc_library() is, so that the compiler doesn't
+ * specialise it for the one relocation type it is ever given here. */
+static int __attribute__((noinline))
+apply_switch(unsigned long base, const Elf_Rel *rel, unsigned count)
+{
+    unsigned i;
+
+    for (i = 0; i < count; i++, rel++) {
+        unsigned type = ELF32_R_TYPE(rel->r_info);
+        unsigned sym = ELF32_R_SYM(rel->r_info);
+        unsigned *reloc = (unsigned *)(base + rel->r_offset);
+
+        switch (type) {
+        case R_ARM_JUMP_SLOT:
+        case R_ARM_GLOB_DAT:
+        case R_ARM_ABS32:
+            *reloc = sym;
+            break;
+        case R_RELATIVE:
+            if (sym)
+                return -1;
+            *reloc += base;
+            break;
+        default:
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int __attribute__((noinline))
+apply_relcount(unsigned long base, const Elf_Rel *rel, unsigned count)
+{
+    return relative_relocs_apply(base, base, rel, count,
+                                 R_RELATIVE) == count ? 0 : -1;
+}
+
+static void *map(size_t size)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return p;
+}
+
+static double run(int (*apply)(unsigned long, const Elf_Rel *, unsigned),
+                  unsigned long base, const Elf_Rel *rel, unsigned count,
+                  int rounds)
+{
+    uint64_t best = ~0ULL, t;
+    int i;
+
+    for (i = 0; i < rounds; i++) {
+        t = now_ns();
+        if (apply(base, rel, count) < 0) {
+            fprintf(stderr, "bad relocation table\n");
+            exit(1);
+        }
+        t = now_ns() - t;
+        if (t < best)
+            best = t;
+    }
+    return (double)best / count;
+}
+
+static void bench(unsigned count, int rounds)
+{
+    size_t rel_size = count * sizeof(Elf_Rel);
+    size_t data_size = count * sizeof(unsigned);
+    Elf_Rel *rel = map(rel_size);
+    unsigned *data = map(data_size);
+    Elf_Rel tmp;
+    unsigned i, j;
+    int shuffled;
+
+    srand(count);
+    for (i = 0; i < count; i++) {
+        rel[i].r_offset = i * sizeof(unsigned);
+        rel[i].r_info = ELF32_R_INFO(0, R_RELATIVE);
+    }
+
+    for (shuffled = 0; shuffled < 2; shuffled++) {
+        if (shuffled) {
+            for (i = count - 1; i > 0; i--) {
+                j = rand() % (i + 1);
+                tmp = rel[i];
+                rel[i] = rel[j];
+                rel[j] = tmp;
+            }
+        }
+        /* Fault the pages in before timing anything */
+        memset(data, 0, data_size);
+        printf("%8u %-8s switch %6.2f ns   relcount %6.2f ns\n", count,
+               shuffled ? "shuffled" : "sorted",
+               run(apply_switch, (unsigned long)data, rel, count, rounds),
+               run(apply_relcount, (unsigned long)data, rel, count, rounds));
+    }
+
+    munmap(rel, rel_size);
+    munmap(data, data_size);
+}
+
+int main(int argc, char **argv)
+{
+    static const unsigned default_counts[] = { 10000, 100000, 1000000 };
+    int rounds = 20;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "r:")) != -1) {
+        switch (opt) {
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-r rounds] [count...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (rounds < 1)
+        rounds = 1;
+
+    printf("   count order    ns per relocation, best of %d rounds\n",
+           rounds);
+    if (optind == argc) {
+        for (i = 0; i < 3; i++)
+            bench(default_counts[i], rounds);
+    }
+    for (i = optind; i < argc; i++) {
+        if (atoi(argv[i]) > 0)
+            bench(atoi(argv[i]), rounds);
+    }
+    return 0;
+}
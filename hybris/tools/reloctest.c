@@ -0,0 +1,369 @@
+/*
+ * Copyright (C) 2013 Canonical Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * hybris-reloctest: check the relocation decoders of ics/linker_reloc.h
+ *
+ * Usage: hybris-reloctest
+ *
+ * Encodes known relocation tables the way static linkers do and checks
+ * what the linker's decoders make of them:
+ *
+ *   relative  relative_relocs_apply() on DT_REL tables, stopping at the
+ *             first entry that isn't RELATIVE, and moving words that
+ *             hybris-prelink relocated for another base
+ *   relr      relr_apply() on DT_RELR tables built from offset lists:
+ *             every listed word gets the load bias added to the addend
+ *             already in it, no other word changes, and the words are
+ *             counted
+ *   aps2      packed_reloc_next() on DT_ANDROID_REL streams using each
+ *             kind of grouping: the r_offset and r_info of every entry,
+ *             and the rejection of truncated, inconsistent and RELA
+ *             streams, which carry explicit addends the linker can't use
+ *
+ * Prints each check, and exits with 1 if any of them failed.
+ */
+
+#include <elf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "linker_reloc.h"
+
+#if defined(__arm__)
+#define R_RELATIVE R_ARM_RELATIVE
+#define R_OTHER    R_ARM_GLOB_DAT
+#else
+#define R_RELATIVE R_386_RELATIVE
+#define R_OTHER    R_386_GLOB_DAT
+#endif
+
+/* Words in the data area relocated by the relr checks */
+#define DATA_WORDS 256
+
+static int failures;
+
+static void check(const char *what, int ok)
+{
+    printf("%-58s %s\n", what, ok ? "ok" : "FAIL");
+    if (!ok)
+        failures++;
+}
+
+static void check_relative(void)
+{
+    unsigned data[8];
+    Elf_Rel rel[8];
+    unsigned long base = (unsigned long)data;
+    unsigned i;
+    int ok = 1;
+
+    /* Offsets are relative to base, so that each adds base to itself */
+    for (i = 0; i < 8; i++) {
+        data[i] = i;
+        rel[i].r_offset = i * sizeof(unsigned);
+        rel[i].r_info = ELF32_R_INFO(0, R_RELATIVE);
+    }
+    check("relative: applies a table of RELATIVE entries",
+          relative_relocs_apply(base, base, rel, 8, R_RELATIVE) == 8);
+    for (i = 0; i < 8; i++)
+        ok &= data[i] == (unsigned)(i + base);
+    check("relative: adds the bias to each word", ok);
+
+    rel[5].r_info = ELF32_R_INFO(1, R_OTHER);
+    check("relative: stops at the first entry of another type",
+          relative_relocs_apply(base, base, rel, 8, R_RELATIVE) == 5);
+}
+
+/* A library hybris-prelink relocated for prelink_base, but loaded at base:
+ * the words it touched move by the difference, and nothing else changes */
+static void check_relative_moved(void)
+{
+    unsigned data[16];
+    Elf_Rel rel[8];
+    unsigned long base = (unsigned long)data;
+    unsigned prelink_base = 0xb0000000;
+    unsigned i;
+    int ok = 1;
+
+    for (i = 0; i < 16; i++)
+        data[i] = 0x100 + i * 4;
+    for (i = 0; i < 8; i++) {
+        data[i * 2] += prelink_base;
+        rel[i].r_offset = i * 2 * sizeof(unsigned);
+        rel[i].r_info = ELF32_R_INFO(0, R_RELATIVE);
+    }
+    check("relative: applies a bias that isn't the base",
+          relative_relocs_apply(base, base - prelink_base, rel, 8,
+                                R_RELATIVE) == 8);
+    for (i = 0; i < 16; i++)
+        ok &= data[i] == (unsigned)(0x100 + i * 4 + (i % 2 ? 0 : base));
+    check("relative: moves the prelinked words to the base", ok);
+}
+
+/* Encodes the sorted, word aligned offsets into relr, the way lld does for
+ * 32-bit targets. Returns the number of entries. */
+static unsigned relr_encode(const unsigned *offsets, unsigned n,
+                            unsigned *relr)
+{
+    unsigned count = 0, i = 0;
+    unsigned where, bitmap, delta;
+
+    while (i < n) {
+        relr[count++] = offsets[i];
+        where = offsets[i++] + sizeof(unsigned);
+        for (;;) {
+            bitmap = 0;
+            while (i < n) {
+                delta = offsets[i] - where;
+                if (delta >= 31 * sizeof(unsigned))
+                    break;
+                bitmap |= 1u << (delta / sizeof(unsigned));
+                i++;
+            }
+            if (bitmap == 0)
+                break;
+            relr[count++] = (bitmap << 1) | 1;
+            where += 31 * sizeof(unsigned);
+        }
+    }
+    return count;
+}
+
+static void check_relr_case(const char *what, const unsigned *words,
+                            unsigned n)
+{
+    unsigned data[DATA_WORDS], offsets[DATA_WORDS], relr[DATA_WORDS];
+    char listed[DATA_WORDS];
+    unsigned long base = (unsigned long)data;
+    unsigned i, count;
+    char name[80];
+    int ok = 1;
+
+    memset(listed, 0, sizeof(listed));
+    for (i = 0; i < n; i++) {
+        offsets[i] = words[i] * sizeof(unsigned);
+        listed[words[i]] = 1;
+    }
+    count = relr_encode(offsets, n, relr);
+
+    /* Distinct implicit addends, so a word relocated twice shows */
+    for (i = 0; i < DATA_WORDS; i++)
+        data[i] = 0x1000 + i * 8;
+    ok &= relr_apply(base, relr, count) == n;
+    for (i = 0; i < DATA_WORDS; i++)
+        ok &= data[i] == (listed[i] ? (unsigned)(0x1000 + i * 8 + base) :
+                                      0x1000 + i * 8);
+
+    snprintf(name, sizeof(name), "relr: %s (%u entries)", what, count);
+    check(name, ok);
+}
+
+static void check_relr(void)
+{
+    static const unsigned single[] = { 7 };
+    static const unsigned sparse[] = { 0, 40, 100, 200 };
+    static const unsigned bitmap[] = { 2, 3, 5, 8, 13, 21, 32 };
+    static const unsigned edge[] = { 10, 11, 41, 42, 72, 73 };
+    unsigned run[100];
+    unsigned i;
+
+    for (i = 0; i < 100; i++)
+        run[i] = 50 + i;
+
+    check_relr_case("one word", single, 1);
+    check_relr_case("words too far apart for a bitmap", sparse, 4);
+    check_relr_case("words within one bitmap", bitmap, 7);
+    check_relr_case("last bit of a bitmap, then the next one", edge, 6);
+    check_relr_case("100 words in a row", run, 100);
+}
+
+/* A growing APS2 stream */
+struct stream {
+    unsigned char data[512];
+    unsigned size;
+};
+
+static void put_sleb(struct stream *s, int v)
+{
+    unsigned char byte;
+    int more;
+
+    do {
+        byte = v & 0x7f;
+        v >>= 7;
+        more = !((v == 0 && !(byte & 0x40)) || (v == -1 && (byte & 0x40)));
+        s->data[s->size++] = byte | (more ? 0x80 : 0);
+    } while (more);
+}
+
+static void put_header(struct stream *s, unsigned count, unsigned offset)
+{
+    memcpy(s->data, "APS2", 4);
+    s->size = 4;
+    put_sleb(s, count);
+    put_sleb(s, offset);
+}
+
+/* Returns 1 if decoding s gives exactly the n entries of expected, and
+ * then reports the end */
+static int decodes_to(const struct stream *s, const Elf32_Rel *expected,
+                      unsigned n)
+{
+    struct packed_reloc_iter it;
+    unsigned i;
+
+    if (packed_reloc_init(&it, s->data, s->size) < 0)
+        return 0;
+    for (i = 0; i < n; i++) {
+        if (packed_reloc_next(&it) != 1 ||
+            it.rel.r_offset != expected[i].r_offset ||
+            it.rel.r_info != expected[i].r_info)
+            return 0;
+    }
+    return packed_reloc_next(&it) == 0;
+}
+
+/* Returns 1 if decoding s fails before its end */
+static int rejected(const struct stream *s)
+{
+    struct packed_reloc_iter it;
+    int ret;
+
+    if (packed_reloc_init(&it, s->data, s->size) < 0)
+        return 1;
+    while ((ret = packed_reloc_next(&it)) > 0)
+        ;
+    return ret < 0;
+}
+
+static void check_aps2(void)
+{
+    const unsigned relative = ELF32_R_INFO(0, R_RELATIVE);
+    const unsigned sym3 = ELF32_R_INFO(3, R_OTHER);
+    const unsigned sym9 = ELF32_R_INFO(9, R_OTHER);
+    Elf32_Rel expected[8];
+    struct stream s;
+    unsigned i;
+
+    /* 4 RELATIVE entries 4 bytes apart, sharing both delta and info */
+    put_header(&s, 4, 0x1000);
+    put_sleb(&s, 4);
+    put_sleb(&s, PACKED_RELOC_GROUPED_BY_INFO |
+                 PACKED_RELOC_GROUPED_BY_OFFSET_DELTA);
+    put_sleb(&s, 4);
+    put_sleb(&s, relative);
+    for (i = 0; i < 4; i++) {
+        expected[i].r_offset = 0x1004 + i * 4;
+        expected[i].r_info = relative;
+    }
+    check("aps2: group sharing offset delta and info",
+          decodes_to(&s, expected, 4));
+
+    /* Then a group sharing the info only, with a backwards delta, and
+     * one sharing nothing */
+    put_header(&s, 7, 0x2000);
+    put_sleb(&s, 3);
+    put_sleb(&s, PACKED_RELOC_GROUPED_BY_INFO);
+    put_sleb(&s, sym3);
+    put_sleb(&s, 0x10);
+    put_sleb(&s, 0x200);
+    put_sleb(&s, -0x8);
+    put_sleb(&s, 4);
+    put_sleb(&s, 0);
+    put_sleb(&s, 0x4);
+    put_sleb(&s, sym9);
+    put_sleb(&s, 0x4);
+    put_sleb(&s, relative);
+    put_sleb(&s, 0x1000);
+    put_sleb(&s, sym3);
+    put_sleb(&s, 0x4);
+    put_sleb(&s, relative);
+    expected[0].r_offset = 0x2010;
+    expected[1].r_offset = 0x2210;
+    expected[2].r_offset = 0x2208;
+    expected[0].r_info = expected[1].r_info = expected[2].r_info = sym3;
+    expected[3].r_offset = 0x220c;
+    expected[3].r_info = sym9;
+    expected[4].r_offset = 0x2210;
+    expected[4].r_info = relative;
+    expected[5].r_offset = 0x3210;
+    expected[5].r_info = sym3;
+    expected[6].r_offset = 0x3214;
+    expected[6].r_info = relative;
+    check("aps2: groups by info only, and ungrouped",
+          decodes_to(&s, expected, 7));
+
+    /* Offsets and infos that take several SLEB128 bytes */
+    put_header(&s, 2, 0x7fff0000);
+    put_sleb(&s, 2);
+    put_sleb(&s, 0);
+    put_sleb(&s, 0xfff0);
+    put_sleb(&s, ELF32_R_INFO(0x12345, R_OTHER));
+    put_sleb(&s, -0x7fff0000);
+    put_sleb(&s, relative);
+    expected[0].r_offset = 0x7ffffff0;
+    expected[0].r_info = ELF32_R_INFO(0x12345, R_OTHER);
+    expected[1].r_offset = 0xfff0;
+    expected[1].r_info = relative;
+    check("aps2: multibyte and negative numbers",
+          decodes_to(&s, expected, 2));
+
+    put_header(&s, 0, 0);
+    check("aps2: empty stream", decodes_to(&s, expected, 0));
+
+    memcpy(s.data, "APS1", 4);
+    check("aps2: rejects a bad magic", rejected(&s));
+
+    /* A group that says it holds more than the stream does */
+    put_header(&s, 2, 0);
+    put_sleb(&s, 3);
+    put_sleb(&s, PACKED_RELOC_GROUPED_BY_INFO |
+                 PACKED_RELOC_GROUPED_BY_OFFSET_DELTA);
+    put_sleb(&s, 4);
+    put_sleb(&s, relative);
+    check("aps2: rejects a group larger than the count", rejected(&s));
+
+    /* RELA groups carry explicit addends */
+    put_header(&s, 1, 0);
+    put_sleb(&s, 1);
+    put_sleb(&s, PACKED_RELOC_GROUP_HAS_ADDEND);
+    put_sleb(&s, 4);
+    put_sleb(&s, relative);
+    put_sleb(&s, 0x40);
+    check("aps2: rejects groups with addends", rejected(&s));
+
+    /* Stops in the middle of an entry */
+    put_header(&s, 2, 0);
+    put_sleb(&s, 2);
+    put_sleb(&s, 0);
+    put_sleb(&s, 4);
+    put_sleb(&s, relative);
+    put_sleb(&s, 4);
+    check("aps2: rejects a truncated stream", rejected(&s));
+}
+
+int main(void)
+{
+    check_relative();
+    check_relative_moved();
+    check_relr();
+    check_aps2();
+
+    printf("%d failures\n", failures);
+    return failures != 0;
+}
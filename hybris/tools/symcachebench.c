@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2013 Canonical Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * hybris-symcachebench: compare symbol relocation with and without the
+ * symbol cache
+ *
+ * Usage: HYBRIS_LINKER_STATS=/dev/null hybris-symcachebench [-r rounds]
+ *            lib.so...
+ *
+ * Loads the libraries with android_dlopen(), once with the symbol cache of
+ * the linker (see "Process-wide symbol resolution cache" in ics/linker.c)
+ * and once with HYBRIS_LD_SYMCACHE=0, where every lookup walks the
+ * precomputed scope of the library. Reports the time spent on relocations
+ * that need a symbol, summed over every library loaded, dependencies
+ * included, along with the lookups made and the libraries probed for them.
+ * Every run is made in a child process of its own, since the linker reads
+ * the setting once and keeps the libraries it loaded. Each line is the best
+ * of rounds (3 by default) runs.
+ */
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "linker_stats.h"
+
+extern void *android_dlopen(const char *filename, int flag);
+
+struct result {
+    unsigned long long reloc_ns;
+    unsigned lookups;
+    unsigned scope_probes;
+    unsigned hits;
+    unsigned misses;
+};
+
+/* In the child: loads the libraries and writes the result to fd */
+static void load(const char *symcache, char **libs, int n, int fd)
+{
+    const struct hybris_linker_stats *stats;
+    const struct hybris_linker_lib_stats *st;
+    struct result r = { 0 };
+    int i;
+
+    setenv("HYBRIS_LD_SYMCACHE", symcache, 1);
+
+    for (i = 0; i < n; i++) {
+        if (android_dlopen(libs[i], RTLD_NOW) == NULL) {
+            fprintf(stderr, "%s: cannot load\n", libs[i]);
+            _exit(1);
+        }
+    }
+
+    stats = hybris_linker_get_stats();
+    for (st = stats->libs; st != NULL; st = st->next) {
+        for (i = 0; i < HYBRIS_RELOC_NTYPES; i++) {
+            if (i != HYBRIS_RELOC_RELATIVE)
+                r.reloc_ns += st->reloc_ns[i];
+        }
+    }
+    r.lookups = stats->lookups;
+    r.scope_probes = stats->scope_probes;
+    r.hits = stats->symcache_hits;
+    r.misses = stats->symcache_misses;
+    write(fd, &r, sizeof(r));
+    _exit(0);
+}
+
+/* Runs load() in a child. Returns -1 if it failed. */
+static int run(const char *symcache, char **libs, int n, struct result *r)
+{
+    int fds[2], status;
+    pid_t child;
+    ssize_t got;
+
+    if (pipe(fds) < 0)
+        return -1;
+    child = fork();
+    if (child < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (child == 0) {
+        close(fds[0]);
+        load(symcache, libs, n, fds[1]);
+    }
+
+    close(fds[1]);
+    got = read(fds[0], r, sizeof(*r));
+    close(fds[0]);
+    waitpid(child, &status, 0);
+    if (got != sizeof(*r) || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const char *modes[] = { "1", "0" };
+    struct result r, best;
+    int rounds = 3;
+    int opt, round;
+    unsigned i;
+
+    while ((opt = getopt(argc, argv, "r:")) != -1) {
+        switch (opt) {
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-r rounds] lib.so...\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind == argc) {
+        fprintf(stderr, "Usage: %s [-r rounds] lib.so...\n", argv[0]);
+        return 1;
+    }
+    if (rounds < 1)
+        rounds = 1;
+
+    if (!hybris_linker_get_stats()->enabled) {
+        fprintf(stderr, "%s: needs HYBRIS_LINKER_STATS to be set\n",
+                argv[0]);
+        return 1;
+    }
+
+    printf("%-10s %10s %10s %12s %10s %10s\n", "symcache", "ms", "lookups",
+           "probes", "hits", "misses");
+    for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        best.reloc_ns = ~0ULL;
+        for (round = 0; round < rounds; round++) {
+            if (run(modes[i], &argv[optind], argc - optind, &r) < 0) {
+                fprintf(stderr, "%s: loading failed\n", argv[0]);
+                return 1;
+            }
+            if (r.reloc_ns < best.reloc_ns)
+                best = r;
+        }
+        printf("%-10s %10.2f %10u %12u %10u %10u\n",
+               *modes[i] == '1' ? "on" : "off", best.reloc_ns / 1000000.0,
+               best.lookups, best.scope_probes, best.hits, best.misses);
+    }
+    return 0;
+}